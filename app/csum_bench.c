@@ -0,0 +1,147 @@
+#include "lib.h"
+#include <time.h>
+
+#define CSUM_BENCH_BYTES	(64 << 20)	/* summed per size and implementation */
+#define CSUM_BENCH_MAX		65536
+
+static int default_sizes[] = { 20, 64, 256, 576, 1460, 4096, 9000, 65535 };
+
+static void usage(void)
+{
+	printf(
+		"csum_bench - internet checksum micro-benchmark\n\n"
+		"Usage: csum_bench [OPTIONS] [size ...]\n"
+		"OPTIONS:\n"
+		"      -n MB          data summed per size and implementation\n"
+		"      -h             display help information\n\n"
+		"Every usable implementation is run over each size(default:\n"
+		"20 64 256 576 1460 4096 9000 65535), both checksum only and\n"
+		"checksum-and-copy, results are checked against the word one.\n"
+	);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned short fold(unsigned int sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* every length and both alignments against the reference */
+static int csum_verify(struct csum_impl *impl, unsigned char *src,
+		unsigned char *dst)
+{
+	int len, off;
+	unsigned short ref;
+
+	for (off = 0; off < 2; off++) {
+		for (len = 0; len < 300; len++) {
+			ref = fold(csum_impls[0].csum(src + off, len, 0x1234));
+			if (fold(impl->csum(src + off, len, 0x1234)) != ref)
+				return -1;
+			memset(dst, 0, len + 2);
+			if (fold(impl->csum_copy(dst + off, src + off, len,
+						0x1234)) != ref ||
+				memcmp(dst + off, src + off, len))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static double csum_run(struct csum_impl *impl, int copy, int size, int loops,
+		unsigned char *src, unsigned char *dst)
+{
+	volatile unsigned int sink = 0;
+	double start;
+	int i;
+
+	start = now_ns();
+	if (copy) {
+		for (i = 0; i < loops; i++)
+			sink += impl->csum_copy(dst, src, size, 0);
+	} else {
+		for (i = 0; i < loops; i++)
+			sink += impl->csum(src, size, 0);
+	}
+	return (now_ns() - start) / loops;
+}
+
+void csum_bench(int argc, char **argv)
+{
+	struct csum_impl *impl;
+	unsigned char *src, *dst;
+	int *sizes = default_sizes;
+	int nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	long total = CSUM_BENCH_BYTES;
+	int c, i, loops;
+	double sum_ns, copy_ns;
+
+	optind = 1;
+	while ((c = getopt(argc, argv, "n:h")) != -1) {
+		switch (c) {
+		case 'n':
+			total = atol(optarg) << 20;
+			break;
+		case 'h':
+		default:
+			usage();
+			return;
+		}
+	}
+	if (total <= 0) {
+		usage();
+		return;
+	}
+	if (optind < argc) {
+		nsizes = argc - optind;
+		sizes = xmalloc(nsizes * sizeof(int));
+		for (i = 0; i < nsizes; i++) {
+			sizes[i] = atoi(argv[optind + i]);
+			if (sizes[i] <= 0 || sizes[i] > CSUM_BENCH_MAX) {
+				printf("size must be 1-%d\n", CSUM_BENCH_MAX);
+				free(sizes);
+				return;
+			}
+		}
+	}
+
+	src = xmalloc(CSUM_BENCH_MAX + 2);
+	dst = xmalloc(CSUM_BENCH_MAX + 2);
+	srand(1);
+	for (i = 0; i < CSUM_BENCH_MAX + 2; i++)
+		src[i] = rand();
+
+	printf("%-6s %-7s %10s %10s %10s %10s\n", "impl", "size",
+		"ns/sum", "MB/s", "ns/copy", "MB/s");
+	for (impl = csum_impls; impl->name; impl++) {
+		if (impl->usable && !impl->usable())
+			continue;
+		if (csum_verify(impl, src, dst) < 0) {
+			printf("%-6s checksum mismatch, skipped\n", impl->name);
+			continue;
+		}
+		for (i = 0; i < nsizes; i++) {
+			loops = total / sizes[i];
+			if (loops < 1)
+				loops = 1;
+			sum_ns = csum_run(impl, 0, sizes[i], loops, src, dst);
+			copy_ns = csum_run(impl, 1, sizes[i], loops, src, dst);
+			printf("%-6s %-7d %10.1f %10.0f %10.1f %10.0f\n",
+				impl->name, sizes[i],
+				sum_ns, sizes[i] * 1e3 / sum_ns,
+				copy_ns, sizes[i] * 1e3 / copy_ns);
+		}
+	}
+	free(src);
+	free(dst);
+	if (sizes != default_sizes)
+		free(sizes);
+}
@@ -0,0 +1,169 @@
+#include "lib.h"
+#include "netif.h"
+#include "ip.h"
+#include "route.h"
+#include <time.h>
+
+#define RT_BENCH_ROUTES		900000	/* about a full bgp table */
+#define RT_BENCH_LOOKUPS	10000000
+#define RT_BENCH_VERIFY		200
+
+/* rough prefix length mix of a bgp table, in 1/1000 */
+static struct {
+	int depth;
+	int permille;
+} rt_bench_mix[] = {
+	{ 24, 600 }, { 23, 70 }, { 22, 110 }, { 21, 40 }, { 20, 40 },
+	{ 19, 30 }, { 18, 20 }, { 17, 15 }, { 16, 20 }, { 15, 5 },
+	{ 14, 5 }, { 12, 5 }, { 10, 2 }, { 8, 3 }, { 25, 10 },
+	{ 26, 8 }, { 28, 7 }, { 32, 10 },
+};
+
+static void usage(void)
+{
+	printf(
+		"rt_bench - route lookup benchmark\n\n"
+		"Usage: rt_bench [OPTIONS]\n"
+		"OPTIONS:\n"
+		"      -n routes      prefixes loaded(default %d)\n"
+		"      -l lookups     random addresses looked up(default %d)\n"
+		"      -h             display help information\n\n"
+		"A private lpm table is loaded with random prefixes of a bgp-like\n"
+		"length mix, the live routing table is not touched.\n",
+		RT_BENCH_ROUTES, RT_BENCH_LOOKUPS
+	);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int rt_bench_rand(void)
+{
+	return (unsigned int)rand() << 16 ^ rand();
+}
+
+static int rt_bench_depth(void)
+{
+	int i, r = rand() % 1000;
+
+	for (i = 0; i < sizeof(rt_bench_mix) / sizeof(rt_bench_mix[0]); i++) {
+		r -= rt_bench_mix[i].permille;
+		if (r < 0)
+			return rt_bench_mix[i].depth;
+	}
+	return 24;
+}
+
+/* what the old sorted list walk does: longest, then newest prefix */
+static struct rtentry *rt_bench_linear(struct rtentry *rts, int n,
+		unsigned int ipaddr)
+{
+	struct rtentry *best = NULL;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((ipaddr ^ rts[i].rt_net) & rts[i].rt_netmask)
+			continue;
+		if (!best || lpm_depth(rts[i].rt_netmask) >=
+				lpm_depth(best->rt_netmask))
+			best = &rts[i];
+	}
+	return best;
+}
+
+void rt_bench(int argc, char **argv)
+{
+	struct rt_lpm *lpm;
+	struct rtentry *rts, *rt;
+	unsigned int *addrs;
+	int nroutes = RT_BENCH_ROUTES;
+	int nlookups = RT_BENCH_LOOKUPS;
+	unsigned int mask;
+	double start, add_ns, lookup_ns, linear_ns, del_ns;
+	int c, i, depth, bad = 0;
+	volatile unsigned long sink = 0;
+
+	optind = 1;
+	while ((c = getopt(argc, argv, "n:l:h")) != -1) {
+		switch (c) {
+		case 'n':
+			nroutes = atoi(optarg);
+			break;
+		case 'l':
+			nlookups = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			return;
+		}
+	}
+	if (nroutes <= 0 || nlookups <= 0) {
+		usage();
+		return;
+	}
+
+	rts = xzalloc(nroutes * sizeof(*rts));
+	addrs = xmalloc(nlookups * sizeof(*addrs));
+	srand(1);
+	for (i = 0; i < nroutes; i++) {
+		depth = rt_bench_depth();
+		mask = _htonl(~0U << (32 - depth));
+		rts[i].rt_net = rt_bench_rand() & mask;
+		rts[i].rt_netmask = mask;
+	}
+	for (i = 0; i < nlookups; i++)
+		addrs[i] = rt_bench_rand();
+
+	lpm = lpm_alloc();
+	start = now_ns();
+	for (i = 0; i < nroutes; i++) {
+		if (lpm_add(lpm, &rts[i]) < 0) {
+			printf("table full after %d routes\n", i);
+			nroutes = i;
+			break;
+		}
+	}
+	add_ns = (now_ns() - start) / nroutes;
+
+	start = now_ns();
+	for (i = 0; i < nlookups; i++)
+		sink += (unsigned long)lpm_lookup(lpm, addrs[i]);
+	lookup_ns = (now_ns() - start) / nlookups;
+
+	/* the linear walk is checked and timed on a few addresses only */
+	start = now_ns();
+	for (i = 0; i < RT_BENCH_VERIFY && i < nlookups; i++) {
+		rt = rt_bench_linear(rts, nroutes, addrs[i]);
+		if (rt != lpm_lookup(lpm, addrs[i]))
+			bad++;
+	}
+	linear_ns = (now_ns() - start) / i;
+
+	printf("routes: %d, tbl8 groups: %u\n", nroutes, lpm->group_used);
+	printf("add:    %10.1f ns/route\n", add_ns);
+	printf("lookup: %10.1f ns (%.1f M lookups/s)\n", lookup_ns,
+			1e3 / lookup_ns);
+	printf("linear: %10.1f ns, %d of %d lookups mismatch\n", linear_ns,
+			bad, i);
+
+	/* without replacements the table must drain completely */
+	bad = 0;
+	start = now_ns();
+	for (i = nroutes - 1; i >= 0; i--)
+		lpm_delete(lpm, &rts[i], NULL);
+	del_ns = (now_ns() - start) / nroutes;
+	for (i = 0; i < nroutes; i++)
+		if (lpm_lookup(lpm, rts[i].rt_net))
+			bad++;
+	printf("delete: %10.1f ns/route, %u tbl8 groups left, %s\n", del_ns,
+			lpm->group_used, bad ? "lookup errors" : "ok");
+
+	lpm_free(lpm);
+	free(rts);
+	free(addrs);
+}
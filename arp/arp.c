@@ -5,15 +5,13 @@
 
 #define BRD_HWADDR ((unsigned char *)"\xff\xff\xff\xff\xff\xff")
 
-void arp_request(struct arpentry *ae)
+void arp_request(struct netdev *dev, unsigned int ipaddr)
 {
 	struct pkbuf *pkb;
-	struct ether *ehdr;
 	struct arp *ahdr;
 
-	pkb = alloc_pkb(ETH_HRD_SZ + ARP_HRD_SZ);
-	ehdr = (struct ether *)pkb->pk_data;
-	ahdr = (struct arp *)ehdr->eth_data;
+	pkb = alloc_pkb(ARP_HRD_SZ);
+	ahdr = (struct arp *)pkb_put(pkb, ARP_HRD_SZ);
 	/* normal arp information */
 	ahdr->arp_hrd = _htons(ARP_HRD_ETHER);
 	ahdr->arp_pro = _htons(ETH_P_IP);
@@ -21,22 +19,22 @@ void arp_request(struct arpentry *ae)
 	ahdr->arp_prolen = IP_ALEN;
 	ahdr->arp_op = _htons(ARP_OP_REQUEST);
 	/* address */
-	ahdr->arp_sip = ae->ae_dev->net_ipaddr;
-	hwacpy(ahdr->arp_sha, ae->ae_dev->net_hwaddr);
-	ahdr->arp_tip = ae->ae_ipaddr;
+	ahdr->arp_sip = dev->net_ipaddr;
+	hwacpy(ahdr->arp_sha, dev->net_hwaddr);
+	ahdr->arp_tip = ipaddr;
 	hwacpy(ahdr->arp_tha, BRD_HWADDR);
 
 	arpdbg(IPFMT"("MACFMT")->"IPFMT"(request)",
 				ipfmt(ahdr->arp_sip),
 				macfmt(ahdr->arp_sha),
 				ipfmt(ahdr->arp_tip));
-	netdev_tx(ae->ae_dev, pkb, pkb->pk_len - ETH_HRD_SZ, ETH_P_ARP, BRD_HWADDR);
+	netdev_tx(dev, pkb, ETH_P_ARP, BRD_HWADDR);
 }
 
 void arp_reply(struct netdev *dev, struct pkbuf *pkb)
 {
-	struct ether *ehdr = (struct ether *)pkb->pk_data;
-	struct arp *ahdr = (struct arp *)ehdr->eth_data;
+	struct ether *ehdr = pkb2eth(pkb);
+	struct arp *ahdr = (struct arp *)pkb->pk_data;
 	arpdbg("replying arp request");
 	/* arp field */
 	ahdr->arp_op = ARP_OP_REPLY;
@@ -46,14 +44,13 @@ void arp_reply(struct netdev *dev, struct pkbuf *pkb)
 	ahdr->arp_sip = dev->net_ipaddr;
 	arp_ntoh(ahdr);
 	/* ether field */
-	netdev_tx(dev, pkb, ARP_HRD_SZ, ETH_P_ARP, ehdr->eth_src);
+	pkb_trim(pkb, ARP_HRD_SZ);
+	netdev_tx(dev, pkb, ETH_P_ARP, ehdr->eth_src);
 }
 
 void arp_recv(struct netdev *dev, struct pkbuf *pkb)
 {
-	struct ether *ehdr = (struct ether *)pkb->pk_data;
-	struct arp *ahdr = (struct arp *)ehdr->eth_data;
-	struct arpentry *ae;
+	struct arp *ahdr = (struct arp *)pkb->pk_data;
 
 	/* real arp process */
 	arpdbg(IPFMT " -> " IPFMT, ipfmt(ahdr->arp_sip), ipfmt(ahdr->arp_tip));
@@ -69,16 +66,9 @@ void arp_recv(struct netdev *dev, struct pkbuf *pkb)
 		goto free_pkb;
 	}
 
-	ae = arp_lookup(ahdr->arp_pro, ahdr->arp_sip);
-	if (ae) {
-		/* passive learning(REQUEST): update old arp entry in cache */
-		hwacpy(ae->ae_hwaddr, ahdr->arp_sha);
-		/* send waiting packet (maybe we receive arp reply) */
-		if (ae->ae_state == ARP_WAITING)
-			arp_queue_send(ae);
-		ae->ae_state = ARP_RESOLVED;
-		ae->ae_ttl = ARP_TIMEOUT;
-	} else if (ahdr->arp_op == ARP_OP_REQUEST) {
+	/* passive learning(REQUEST): update old arp entry in cache */
+	if (arp_update(ahdr->arp_pro, ahdr->arp_sip, ahdr->arp_sha) < 0 &&
+		ahdr->arp_op == ARP_OP_REQUEST) {
 		/* Unsolicited ARP reply is not accepted */
 		arp_insert(dev, ahdr->arp_pro, ahdr->arp_sip, ahdr->arp_sha);
 	}
@@ -97,15 +87,15 @@ free_pkb:
  */
 void arp_in(struct netdev *dev, struct pkbuf *pkb)
 {
-	struct ether *ehdr = (struct ether *)pkb->pk_data;
-	struct arp *ahdr = (struct arp *)ehdr->eth_data;
+	struct ether *ehdr = pkb2eth(pkb);
+	struct arp *ahdr = (struct arp *)pkb->pk_data;
 
 	if (pkb->pk_type == PKT_OTHERHOST) {
 		arpdbg("arp(l2) packet is not for us");
 		goto err_free_pkb;
 	}
 
-	if (pkb->pk_len < ETH_HRD_SZ + ARP_HRD_SZ) {
+	if (pkb->pk_len < ARP_HRD_SZ) {
 		arpdbg("arp packet is too small");
 		goto err_free_pkb;
 	}
@@ -3,187 +3,596 @@
 #include "lib.h"
 #include "list.h"
 #include "compile.h"
+#include "epoch.h"
 
-#define arp_cache_head (&arp_cache[0])
-#define arp_cache_end (&arp_cache[ARP_CACHE_SZ])
-static struct arpentry arp_cache[ARP_CACHE_SZ];
+/*
+ * Neighbour cache: entries hash by ip address into buckets with their own
+ * lock. The bucket array doubles when the chains grow long, which takes
+ * arp_table_lock for writing, every writer holds it for reading.
+ * Nothing outside this file keeps a pointer to an entry.
+ *
+ * Resolving a known address takes no lock at all: changes a reader can see
+ * (chain links, state, hardware address) are made inside a bucket sequence
+ * count, so a reader walks the chain, then checks the count did not move.
+ * Lockless readers run inside an epoch(see epoch.h): unlinked entries and
+ * replaced tables are stamped when retired, and arp_timer() frees them only
+ * once no reader is left from before the stamp, so a reader never follows
+ * a pointer into freed memory.
+ *
+ * Eviction is a clock over all entries in insertion order: a hit only sets
+ * ae_ref, the hand gives such entries a second chance and takes the first
+ * one not used since it last passed.
+ */
+struct arp_bucket {
+	pthread_mutex_t ab_lock;
+	unsigned int ab_seq;		/* odd while chain is being changed */
+	struct list_head ab_head;	/* arpentry chain */
+};
 
-/* Lock Definition */
-#ifdef STATIC_MUTEX
-pthread_mutex_t arp_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-#else
-pthread_mutex_t arp_cache_mutex;
-/* Why are they not defined in pthread.h? */
-#ifndef PTHREAD_MUTEX_NORMAL
-#define	PTHREAD_MUTEX_NORMAL PTHREAD_MUTEX_TIMED_NP
-#endif
-#endif	/* STATIC_MUTEX */
-
-/* Lock Init */
-static _inline void arp_cache_lock_init(void)
-{
-#ifndef STATIC_MUTEX
-	/* It is evil to init pthread mutex dynamically X< */
-	pthread_mutexattr_t attr;
-	if (pthread_mutexattr_init(&attr) != 0)
-		perrx("pthread_mutexattr_init");
-	if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL) != 0)
-		perrx("pthread_mutexattr_settype");
-	if (pthread_mutex_init(&arp_cache_mutex, &attr) != 0)
-		perrx("pthread_mutex_init");
-#endif
+struct arp_table {
+	struct list_head at_retire;	/* on arp_retired_tables once replaced */
+	unsigned long at_epoch;		/* when it was replaced */
+	unsigned int at_bits;
+	struct arp_bucket at_buckets[0];
+};
+
+static struct arp_table *arp_tbl;
+static pthread_rwlock_t arp_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t arp_retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(arp_retired);		/* unlinked entries, via ae_list */
+static LIST_HEAD(arp_retired_tables);
+static pthread_mutex_t arp_lru_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(arp_lru);		/* clock list, hand at the head */
+static int arp_entries;
+unsigned int arp_cache_max = ARP_CACHE_SZ;
+unsigned int arp_genid = 1;
+struct arp_stats arp_stats;
+
+/*
+ * Hits are counted in slots spread over threads, one shared counter would
+ * be the only cache line every transmitting thread writes.
+ */
+#define ARP_HIT_SLOTS	16
+static struct {
+	unsigned long hits;
+} __attribute__((aligned(64))) arp_hit_slots[ARP_HIT_SLOTS];
+static unsigned int arp_hit_next;
+static __thread int arp_hit_slot = -1;
+
+#define arp_hash_size(t) (1U << (t)->at_bits)
+#define arp_stat_inc(field) __atomic_fetch_add(&arp_stats.field, 1, __ATOMIC_RELAXED)
+
+static void arp_hit(void)
+{
+	if (arp_hit_slot < 0)
+		arp_hit_slot = __atomic_fetch_add(&arp_hit_next, 1,
+				__ATOMIC_RELAXED) % ARP_HIT_SLOTS;
+	__atomic_fetch_add(&arp_hit_slots[arp_hit_slot].hits, 1,
+			__ATOMIC_RELAXED);
 }
 
 /* Lock Function */
 #ifdef DEBUG_ARPCACHE_LOCK
-#define arp_cache_lock() do { dbg("lock"); pthread_mutex_lock(&arp_cache_mutex); } while(0)
-#define arp_cache_unlock() do { dbg("unlock"); pthread_mutex_unlock(&arp_cache_mutex); } while(0)
+#define arp_bucket_lock(b) do { dbg("lock"); pthread_mutex_lock(&(b)->ab_lock); } while(0)
+#define arp_bucket_unlock(b) do { dbg("unlock"); pthread_mutex_unlock(&(b)->ab_lock); } while(0)
 #else
-static _inline void arp_cache_lock(void)
+static _inline void arp_bucket_lock(struct arp_bucket *b)
 {
-	pthread_mutex_lock(&arp_cache_mutex);
+	pthread_mutex_lock(&b->ab_lock);
 }
 
-static _inline void arp_cache_unlock(void)
+static _inline void arp_bucket_unlock(struct arp_bucket *b)
 {
-	pthread_mutex_unlock(&arp_cache_mutex);
+	pthread_mutex_unlock(&b->ab_lock);
 }
 #endif	/* end DEBUG_ARPCACHE_LOCK */
 
-void arp_queue_send(struct arpentry *ae)
+static _inline unsigned int arp_hash(unsigned int ipaddr, unsigned int bits)
+{
+	return (ipaddr * 2654435761U) >> (32 - bits);
+}
+
+/* Assert bucket of @b is locked: readers retry or fall back meanwhile */
+static _inline void arp_write_begin(struct arp_bucket *b)
+{
+	__atomic_store_n(&b->ab_seq, b->ab_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static _inline void arp_write_end(struct arp_bucket *b)
+{
+	__atomic_store_n(&b->ab_seq, b->ab_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* lock bucket of @ipaddr, with table held for reading */
+static struct arp_bucket *arp_bucket_get(unsigned int ipaddr)
+{
+	struct arp_bucket *b;
+
+	pthread_rwlock_rdlock(&arp_table_lock);
+	b = &arp_tbl->at_buckets[arp_hash(ipaddr, arp_tbl->at_bits)];
+	arp_bucket_lock(b);
+	return b;
+}
+
+static void arp_bucket_put(struct arp_bucket *b)
+{
+	arp_bucket_unlock(b);
+	pthread_rwlock_unlock(&arp_table_lock);
+}
+
+static struct arpentry *arp_bucket_find(struct arp_bucket *b,
+		unsigned short pro, unsigned int ipaddr)
+{
+	struct arpentry *ae;
+
+	list_for_each_entry(ae, &b->ab_head, ae_hash) {
+		if (ae->ae_pro == pro && ae->ae_ipaddr == ipaddr)
+			return ae;
+	}
+	return NULL;
+}
+
+static void arp_queue_send(struct netdev *dev, struct list_head *list,
+		unsigned char *hwaddr)
 {
 	struct pkbuf *pkb;
-	while (!list_empty(&ae->ae_list)) {
-		pkb = list_first_entry(&ae->ae_list, struct pkbuf, pk_list);
-		list_del(ae->ae_list.next);
+	while (!list_empty(list)) {
+		pkb = list_first_entry(list, struct pkbuf, pk_list);
+		list_del(list->next);
 		arpdbg("send pending packet");
-		netdev_tx(ae->ae_dev, pkb, pkb->pk_len - ETH_HRD_SZ,
-				pkb->pk_pro, ae->ae_hwaddr);
+		netdev_tx(dev, pkb, pkb->pk_pro, hwaddr);
 	}
 }
 
-void arp_queue_drop(struct arpentry *ae)
+static void arp_queue_drop(struct list_head *list)
 {
 	struct pkbuf *pkb;
-	while (!list_empty(&ae->ae_list)) {
-		pkb = list_first_entry(&ae->ae_list, struct pkbuf, pk_list);
-		list_del(ae->ae_list.next);
+	while (!list_empty(list)) {
+		pkb = list_first_entry(list, struct pkbuf, pk_list);
+		list_del(list->next);
 		arpdbg("drop pending packet");
 		free_pkb(pkb);
 	}
 }
 
-struct arpentry *arp_alloc(void)
+/* queue @pkb on waiting entry, the oldest one is dropped when it is full */
+static void arp_enqueue(struct arpentry *ae, struct pkbuf *pkb)
 {
-	static int next = 0;
-	int i;
-	struct arpentry *ae;
+	struct pkbuf *old;
+
+	if (ae->ae_qlen >= ARP_QUEUE_MAX) {
+		old = list_first_entry(&ae->ae_list, struct pkbuf, pk_list);
+		list_del(&old->pk_list);
+		free_pkb(old);
+		ae->ae_qlen--;
+		arp_stat_inc(queue_drops);
+	}
+	list_add_tail(&pkb->pk_list, &ae->ae_list);
+	ae->ae_qlen++;
+}
 
-	arp_cache_lock();
-	/* round-robin loop algorithm */
-	for (i = 0; i < ARP_CACHE_SZ; i++) {
-		if (arp_cache[next].ae_state == ARP_FREE)
+/*
+ * Link @ae into chain of @b, readers see it only once it is complete.
+ * It joins the clock list just behind the hand.
+ */
+static void arp_chain_add(struct arp_bucket *b, struct arpentry *ae)
+{
+	struct list_head *head = &b->ab_head;
+
+	ae->ae_hash.prev = head;
+	ae->ae_hash.next = head->next;
+	head->next->prev = &ae->ae_hash;
+	__atomic_store_n(&head->next, &ae->ae_hash, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&arp_lru_lock);
+	list_add_tail(&ae->ae_lru, &arp_lru);
+	pthread_mutex_unlock(&arp_lru_lock);
+}
+
+/* mark @ae used, written only when the clock hand has cleared it */
+static _inline void arp_touch(struct arpentry *ae)
+{
+	if (!__atomic_load_n(&ae->ae_ref, __ATOMIC_RELAXED))
+		__atomic_store_n(&ae->ae_ref, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Assert bucket @b of @ae is locked, pending packets go to @drop.
+ * @ae keeps its chain pointers: a reader standing on it walks on safely.
+ */
+static void arp_entry_del(struct arp_bucket *b, struct arpentry *ae,
+		struct list_head *drop)
+{
+	arp_write_begin(b);
+	__list_del(ae->ae_hash.prev, ae->ae_hash.next);
+	arp_write_end(b);
+	list_splice_tail_init(&ae->ae_list, drop);
+	__atomic_fetch_sub(&arp_entries, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&arp_lru_lock);
+	list_del(&ae->ae_lru);
+	pthread_mutex_unlock(&arp_lru_lock);
+
+	pthread_mutex_lock(&arp_retire_lock);
+	ae->ae_retire = epoch_stamp();
+	list_add_tail(&ae->ae_list, &arp_retired);
+	pthread_mutex_unlock(&arp_retire_lock);
+}
+
+/* free what no reader can be on any more, retired lists are in stamp order */
+static void arp_reap(void)
+{
+	struct arpentry *ae, *anext;
+	struct arp_table *t, *tnext;
+	unsigned long safe = epoch_safe();
+
+	pthread_mutex_lock(&arp_retire_lock);
+	list_for_each_entry_safe(ae, anext, &arp_retired, ae_list) {
+		if (ae->ae_retire >= safe)
 			break;
-		next = (next + 1) % ARP_CACHE_SZ;
+		list_del(&ae->ae_list);
+		free(ae);
 	}
-	/* not found */
-	if (i >= ARP_CACHE_SZ) {
-		arpdbg("arp cache is full");
-		arp_cache_unlock();
-		return NULL;
+	list_for_each_entry_safe(t, tnext, &arp_retired_tables, at_retire) {
+		if (t->at_epoch >= safe)
+			break;
+		list_del(&t->at_retire);
+		free(t);
 	}
-	/* init */
-	ae = &arp_cache[next];
-	ae->ae_dev = NULL;
+	pthread_mutex_unlock(&arp_retire_lock);
+}
+
+static struct arpentry *arp_entry_alloc(struct netdev *nd, unsigned short pro,
+		unsigned int ipaddr)
+{
+	struct arpentry *ae = xzalloc(sizeof(*ae));
+
+	list_init(&ae->ae_list);
+	ae->ae_dev = nd;
+	ae->ae_pro = pro;
+	ae->ae_ipaddr = ipaddr;
 	ae->ae_retry = ARP_REQ_RETRY;
 	ae->ae_ttl = ARP_WAITTIME;
 	ae->ae_state = ARP_WAITING;
-	ae->ae_pro = ETH_P_IP;		/* default protocol */
-	list_init(&ae->ae_list);
-	/* for next time allocation */
-	next = (next + 1) % ARP_CACHE_SZ;
-	arp_cache_unlock();
-
 	return ae;
 }
 
-int arp_insert(struct netdev *nd, unsigned short pro,
-		unsigned int ipaddr, unsigned char *hwaddr)
+/*
+ * Make room for one more entry: the clock hand passes over entries used
+ * since its last round, clearing their mark, and drops the first one
+ * that is not. Each entry passed needs a hit to be passed again.
+ */
+static void arp_evict(void)
 {
+	struct arp_bucket *b;
 	struct arpentry *ae;
-	ae = arp_alloc();
-	if (!ae)
-		return -1;
-	ae->ae_dev = nd;
-	ae->ae_pro = pro;
-	ae->ae_ttl = ARP_TIMEOUT;
-	ae->ae_ipaddr = ipaddr;
-	ae->ae_state = ARP_RESOLVED;
-	hwacpy(ae->ae_hwaddr, hwaddr);
-	return 0;
+	unsigned int ipaddr = 0;
+	unsigned short pro = 0;
+	int found = 0, resolved = 0, n;
+	LIST_HEAD(drop);
+
+	if (arp_entries < arp_cache_max)
+		return;
+	pthread_mutex_lock(&arp_lru_lock);
+	/* one round clears every mark */
+	for (n = arp_entries; n >= 0 && !list_empty(&arp_lru); n--) {
+		ae = list_first_entry(&arp_lru, struct arpentry, ae_lru);
+		list_del(&ae->ae_lru);
+		list_add_tail(&ae->ae_lru, &arp_lru);
+		if (__atomic_load_n(&ae->ae_ref, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&ae->ae_ref, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		ipaddr = ae->ae_ipaddr;
+		pro = ae->ae_pro;
+		found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&arp_lru_lock);
+	if (!found)
+		return;
+	/* it may have gone meanwhile: find it again under its lock */
+	b = arp_bucket_get(ipaddr);
+	ae = arp_bucket_find(b, pro, ipaddr);
+	if (ae) {
+		resolved = (ae->ae_state == ARP_RESOLVED);
+		arp_entry_del(b, ae, &drop);
+		arp_stat_inc(evictions);
+	}
+	arp_bucket_put(b);
+	arp_queue_drop(&drop);
+	if (resolved)
+		arp_genid_bump();
 }
 
-struct arpentry *arp_lookup(unsigned short pro, unsigned int ipaddr)
+static struct arp_table *arp_table_alloc(unsigned int bits)
 {
-	struct arpentry *ae, *ret = NULL;
-	arp_cache_lock();
-	arpdbg("pro:%d "IPFMT, pro, ipfmt(ipaddr));
-	for (ae = arp_cache_head; ae < arp_cache_end; ae++) {
-		if (ae->ae_state == ARP_FREE)
-			continue;
-		if (ae->ae_pro == pro && ae->ae_ipaddr == ipaddr) {
-			ret = ae;
+	struct arp_table *t;
+	unsigned int i;
+
+	t = xmalloc(sizeof(*t) + (sizeof(struct arp_bucket) << bits));
+	t->at_bits = bits;
+	for (i = 0; i < arp_hash_size(t); i++) {
+		pthread_mutex_init(&t->at_buckets[i].ab_lock, NULL);
+		t->at_buckets[i].ab_seq = 0;
+		list_init(&t->at_buckets[i].ab_head);
+	}
+	return t;
+}
+
+/*
+ * Double the buckets once chains average more than ARP_HASH_LOAD entries.
+ * Entries are relinked into the new table in place, old buckets are left
+ * odd for good so readers still on them give up and look again.
+ */
+static void arp_grow(void)
+{
+	struct arp_table *nt, *ot;
+	struct arpentry *ae, *next;
+	unsigned int i;
+
+	if (arp_entries <= arp_hash_size(arp_tbl) * ARP_HASH_LOAD ||
+		arp_tbl->at_bits >= ARP_HASH_MAXBITS)
+		return;
+	pthread_rwlock_wrlock(&arp_table_lock);
+	ot = arp_tbl;
+	if (arp_entries <= arp_hash_size(ot) * ARP_HASH_LOAD ||
+		ot->at_bits >= ARP_HASH_MAXBITS) {
+		pthread_rwlock_unlock(&arp_table_lock);
+		return;
+	}
+	nt = arp_table_alloc(ot->at_bits + 1);
+	for (i = 0; i < arp_hash_size(ot); i++)
+		arp_write_begin(&ot->at_buckets[i]);
+	for (i = 0; i < arp_hash_size(ot); i++) {
+		list_for_each_entry_safe(ae, next, &ot->at_buckets[i].ab_head,
+					ae_hash)
+			list_add_tail(&ae->ae_hash, &nt->at_buckets[
+				arp_hash(ae->ae_ipaddr, nt->at_bits)].ab_head);
+		pthread_mutex_destroy(&ot->at_buckets[i].ab_lock);
+	}
+	__atomic_store_n(&arp_tbl, nt, __ATOMIC_RELEASE);
+	arp_stats.resizes++;
+	pthread_rwlock_unlock(&arp_table_lock);
+
+	pthread_mutex_lock(&arp_retire_lock);
+	ot->at_epoch = epoch_stamp();
+	list_add_tail(&ot->at_retire, &arp_retired_tables);
+	pthread_mutex_unlock(&arp_retire_lock);
+}
+
+/* lockless lookup of resolved @ipaddr, see arp_lookup_fast() */
+static int __arp_lookup_fast(unsigned int ipaddr, unsigned char *hwaddr)
+{
+	struct arp_table *t = __atomic_load_n(&arp_tbl, __ATOMIC_ACQUIRE);
+	struct arp_bucket *b = &t->at_buckets[arp_hash(ipaddr, t->at_bits)];
+	struct arpentry *ae, *found = NULL;
+	struct list_head *pos;
+	unsigned int seq;
+	int n = 0;
+
+	seq = __atomic_load_n(&b->ab_seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return -1;
+	pos = __atomic_load_n(&b->ab_head.next, __ATOMIC_ACQUIRE);
+	while (pos != &b->ab_head) {
+		/* a chain moved by arp_grow() need not lead back here */
+		if (++n > ARP_WALK_MAX)
+			return -1;
+		ae = list_entry(pos, struct arpentry, ae_hash);
+		if (ae->ae_ipaddr == ipaddr && ae->ae_pro == ETH_P_IP) {
+			found = ae;
 			break;
 		}
+		pos = __atomic_load_n(&pos->next, __ATOMIC_ACQUIRE);
 	}
-	arp_cache_unlock();
+	if (!found || found->ae_state != ARP_RESOLVED)
+		return -1;
+	hwacpy(hwaddr, found->ae_hwaddr);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&b->ab_seq, __ATOMIC_RELAXED) != seq)
+		return -1;
+	arp_touch(found);
+	return 0;
+}
+
+/*
+ * Lockless lookup of resolved @ipaddr: 0 if copied to @hwaddr, -1 if it is
+ * not resolved or its bucket changed under us, the caller then locks.
+ */
+static int arp_lookup_fast(unsigned int ipaddr, unsigned char *hwaddr)
+{
+	int ret;
+
+	epoch_enter();
+	ret = __arp_lookup_fast(ipaddr, hwaddr);
+	epoch_exit();
 	return ret;
 }
 
-struct arpentry *arp_lookup_resolv(unsigned short pro, unsigned int ipaddr)
+/*
+ * Find next-hop hardware address of @ipaddr for sending @pkb:
+ *  0: copied to @hwaddr, caller sends @pkb
+ *  1: @pkb is queued until the address is resolved
+ */
+int arp_resolve(struct netdev *nd, unsigned int ipaddr, struct pkbuf *pkb,
+		unsigned char *hwaddr)
+{
+	struct arp_bucket *b;
+	struct arpentry *ae, *nae;
+
+	if (arp_lookup_fast(ipaddr, hwaddr) == 0) {
+		arp_hit();
+		return 0;
+	}
+	b = arp_bucket_get(ipaddr);
+	ae = arp_bucket_find(b, ETH_P_IP, ipaddr);
+	if (ae && ae->ae_state == ARP_RESOLVED) {
+		hwacpy(hwaddr, ae->ae_hwaddr);
+		arp_touch(ae);
+		arp_bucket_put(b);
+		arp_hit();
+		return 0;
+	}
+	if (ae) {
+		arpdbg("arp entry is waiting");
+		arp_enqueue(ae, pkb);
+		arp_bucket_put(b);
+		return 1;
+	}
+	arp_bucket_put(b);
+
+	arpdbg("not found arp cache");
+	arp_stat_inc(misses);
+	arp_evict();
+	nae = arp_entry_alloc(nd, ETH_P_IP, ipaddr);
+	b = arp_bucket_get(ipaddr);
+	/* someone else may have been quicker */
+	ae = arp_bucket_find(b, ETH_P_IP, ipaddr);
+	if (ae) {
+		free(nae);
+		if (ae->ae_state == ARP_RESOLVED) {
+			hwacpy(hwaddr, ae->ae_hwaddr);
+			arp_bucket_put(b);
+			return 0;
+		}
+		arp_enqueue(ae, pkb);
+		arp_bucket_put(b);
+		return 1;
+	}
+	arp_enqueue(nae, pkb);
+	arp_write_begin(b);
+	arp_chain_add(b, nae);
+	arp_write_end(b);
+	__atomic_fetch_add(&arp_entries, 1, __ATOMIC_RELAXED);
+	arp_bucket_put(b);
+	arp_request(nd, ipaddr);
+	arp_grow();
+	return 1;
+}
+
+/* update existing entry of @ipaddr and flush its pending packets, -1 if none */
+int arp_update(unsigned short pro, unsigned int ipaddr, unsigned char *hwaddr)
 {
+	struct arp_bucket *b;
 	struct arpentry *ae;
-	ae = arp_lookup(pro, ipaddr);
-	if (ae && ae->ae_pro == ARP_RESOLVED)
-		return ae;
-	return NULL;
+	struct netdev *nd;
+	int changed;
+	LIST_HEAD(pending);
+
+	b = arp_bucket_get(ipaddr);
+	ae = arp_bucket_find(b, pro, ipaddr);
+	if (!ae) {
+		arp_bucket_put(b);
+		return -1;
+	}
+	changed = ae->ae_state != ARP_RESOLVED ||
+		hwacmp(ae->ae_hwaddr, hwaddr) != 0;
+	if (changed) {
+		arp_write_begin(b);
+		hwacpy(ae->ae_hwaddr, hwaddr);
+		ae->ae_state = ARP_RESOLVED;
+		arp_write_end(b);
+	}
+	/* send waiting packet (maybe we receive arp reply) */
+	list_splice_tail_init(&ae->ae_list, &pending);
+	ae->ae_qlen = 0;
+	ae->ae_ttl = ARP_TIMEOUT;
+	nd = ae->ae_dev;
+	arp_bucket_put(b);
+	/* after the update: dst cache must not keep the old one */
+	if (changed)
+		arp_genid_bump();
+	arp_queue_send(nd, &pending, hwaddr);
+	return 0;
 }
 
-void arp_timer(int delta)
+int arp_insert(struct netdev *nd, unsigned short pro,
+		unsigned int ipaddr, unsigned char *hwaddr)
 {
+	struct arp_bucket *b;
 	struct arpentry *ae;
 
-	arp_cache_lock();
-	for (ae = arp_cache_head; ae < arp_cache_end; ae++) {
-		if (ae->ae_state == ARP_FREE)
-			continue;
-		ae->ae_ttl -= delta;
-		if (ae->ae_ttl <= 0) {
+	arp_evict();
+	ae = arp_entry_alloc(nd, pro, ipaddr);
+	ae->ae_ttl = ARP_TIMEOUT;
+	ae->ae_state = ARP_RESOLVED;
+	hwacpy(ae->ae_hwaddr, hwaddr);
+	b = arp_bucket_get(ipaddr);
+	if (arp_bucket_find(b, pro, ipaddr)) {
+		arp_bucket_put(b);
+		free(ae);
+		return arp_update(pro, ipaddr, hwaddr);
+	}
+	arp_write_begin(b);
+	arp_chain_add(b, ae);
+	arp_write_end(b);
+	__atomic_fetch_add(&arp_entries, 1, __ATOMIC_RELAXED);
+	arp_bucket_put(b);
+	arp_genid_bump();
+	arp_grow();
+	return 0;
+}
+
+/* arp request to be sent after bucket lock is released */
+struct arp_probe {
+	struct list_head list;
+	struct netdev *dev;
+	unsigned int ipaddr;
+};
+
+void arp_timer(int delta)
+{
+	struct arp_table *t;
+	struct arp_bucket *b;
+	struct arpentry *ae, *next;
+	struct arp_probe *probe, *pnext;
+	unsigned int i;
+	int expired = 0;
+	LIST_HEAD(drop);
+	LIST_HEAD(probes);
+
+	pthread_rwlock_rdlock(&arp_table_lock);
+	t = arp_tbl;
+	for (i = 0; i < arp_hash_size(t); i++) {
+		b = &t->at_buckets[i];
+		arp_bucket_lock(b);
+		list_for_each_entry_safe(ae, next, &b->ab_head, ae_hash) {
+			ae->ae_ttl -= delta;
+			if (ae->ae_ttl > 0)
+				continue;
 			if ((ae->ae_state == ARP_WAITING && --ae->ae_retry < 0)
 				|| ae->ae_state == ARP_RESOLVED) {
-				if (ae->ae_state == ARP_WAITING)
-					arp_queue_drop(ae);
-				ae->ae_state = ARP_FREE;
+				if (ae->ae_state == ARP_RESOLVED)
+					expired = 1;
+				arp_entry_del(b, ae, &drop);
 			} else {
 				/* retry arp request */
 				ae->ae_ttl = ARP_WAITTIME;
-				arp_cache_unlock();
-				arp_request(ae);
-				arp_cache_lock();
+				probe = xmalloc(sizeof(*probe));
+				probe->dev = ae->ae_dev;
+				probe->ipaddr = ae->ae_ipaddr;
+				list_add_tail(&probe->list, &probes);
 			}
 		}
+		arp_bucket_unlock(b);
+	}
+	pthread_rwlock_unlock(&arp_table_lock);
+	if (expired)
+		arp_genid_bump();
+	arp_queue_drop(&drop);
+	list_for_each_entry_safe(probe, pnext, &probes, list) {
+		arp_request(probe->dev, probe->ipaddr);
+		free(probe);
 	}
-	arp_cache_unlock();
+	arp_reap();
 }
 
 void arp_cache_init(void)
 {
-	int i;
-	for (i = 0; i < ARP_CACHE_SZ; i++)
-		arp_cache[i].ae_state = ARP_FREE;
+	arp_tbl = arp_table_alloc(ARP_HASH_BITS);
 	dbg("ARP CACHE INIT");
-	arp_cache_lock_init();
-	dbg("ARP CACHE SEMAPHORE INIT");
 }
 
 static const char *__arpstate[] = {
@@ -207,21 +616,44 @@ char *ipnfmt(unsigned int ipaddr)
 
 void arp_cache_traverse(void)
 {
+	struct arp_table *t;
+	struct arp_bucket *b;
 	struct arpentry *ae;
+	unsigned int i;
 	int first;
 
-	arp_cache_lock();
+	pthread_rwlock_rdlock(&arp_table_lock);
 	first = 1;
-	for (ae = arp_cache_head; ae < arp_cache_end; ae++) {
-		if (ae->ae_state == ARP_FREE)
-			continue;
-		if (first) {
-			printf("State    Timeout(s)  HWaddress         Address\n");
-			first = 0;
+	t = arp_tbl;
+	for (i = 0; i < arp_hash_size(t); i++) {
+		b = &t->at_buckets[i];
+		arp_bucket_lock(b);
+		list_for_each_entry(ae, &b->ab_head, ae_hash) {
+			if (first) {
+				printf("State    Timeout(s)  HWaddress         Address\n");
+				first = 0;
+			}
+			printf("%-9s%-12d" MACFMT " %s\n",
+				arpstate(ae), ((ae->ae_ttl < 0) ? 0 : ae->ae_ttl),
+				macfmt(ae->ae_hwaddr), ipnfmt(ae->ae_ipaddr));
 		}
-		printf("%-9s%-12d" MACFMT " %s\n",
-			arpstate(ae), ((ae->ae_ttl < 0) ? 0 : ae->ae_ttl),
-			macfmt(ae->ae_hwaddr), ipnfmt(ae->ae_ipaddr));
+		arp_bucket_unlock(b);
 	}
-	arp_cache_unlock();
+	pthread_rwlock_unlock(&arp_table_lock);
+}
+
+void arp_cache_stat(void)
+{
+	unsigned long hits = 0;
+	int i;
+
+	for (i = 0; i < ARP_HIT_SLOTS; i++)
+		hits += __atomic_load_n(&arp_hit_slots[i].hits, __ATOMIC_RELAXED);
+	printf("entries:     %d/%u\n", arp_entries, arp_cache_max);
+	printf("buckets:     %u(resized %u times)\n", arp_hash_size(arp_tbl),
+			arp_stats.resizes);
+	printf("hits:        %lu\n", hits);
+	printf("misses:      %lu\n", arp_stats.misses);
+	printf("evictions:   %lu\n", arp_stats.evictions);
+	printf("queue drops: %lu\n", arp_stats.queue_drops);
 }
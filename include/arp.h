@@ -9,9 +9,14 @@
 #define ARP_IP
 
 /* arp cache */
-#define ARP_CACHE_SZ	20
+#define ARP_CACHE_SZ	1024	/* default arp_cache_max */
 #define ARP_TIMEOUT	600	/* 10 minutes */
 #define ARP_WAITTIME	1
+#define ARP_QUEUE_MAX	8	/* packets pending per unresolved entry */
+#define ARP_HASH_BITS	6	/* initial buckets */
+#define ARP_HASH_MAXBITS	16
+#define ARP_HASH_LOAD	2	/* average chain length before doubling */
+#define ARP_WALK_MAX	64	/* lockless reader gives up past this */
 
 /* arp entry state */
 #define ARP_FREE	1
@@ -21,10 +26,17 @@
 #define ARP_REQ_RETRY	4
 
 struct arpentry {
-	struct list_head ae_list;		/* packet pending for hard address */
+	struct list_head ae_hash;		/* hash bucket chain */
+	struct list_head ae_list;		/* packet pending for hard address,
+						   retire list once unlinked */
+	struct list_head ae_lru;		/* clock list for eviction */
+	int ae_qlen;				/* packets on ae_list */
 	struct netdev *ae_dev;			/* associated net interface */
 	int ae_retry;				/* arp reuqest retrying times */
 	int ae_ttl;				/* entry timeout */
+	int ae_ref;				/* used since the clock hand
+						   last passed it */
+	unsigned long ae_retire;		/* unlink epoch once retired */
 	unsigned int ae_state;			/* entry state */
 	unsigned short ae_pro;			/* L3 protocol supported by arp */
 	unsigned int ae_ipaddr;			/* L3 protocol address(ip) */
@@ -68,19 +80,31 @@ static inline void arp_hton(struct arp *ahdr)
 }
 #define arp_ntoh(ahdr) arp_hton(ahdr)
 
+/* bumped whenever an ip to hardware address mapping changes */
+extern unsigned int arp_genid;
+#define arp_genid_bump() __atomic_add_fetch(&arp_genid, 1, __ATOMIC_RELEASE)
+
+struct arp_stats {
+	unsigned long misses;		/* new entry, arp request sent */
+	unsigned long evictions;	/* lru entry dropped for a new one */
+	unsigned long queue_drops;	/* pending packet dropped, queue full */
+	unsigned int resizes;		/* hash table doublings */
+};
+extern struct arp_stats arp_stats;
+extern unsigned int arp_cache_max;
+
 extern void arp_cache_traverse(void);
+extern void arp_cache_stat(void);
 extern void arp_cache_init(void);
 extern void arp_timer(int delta);
 extern void arp_proc(int);
 
-extern struct arpentry *arp_alloc(void);
-extern struct arpentry *arp_lookup(unsigned short, unsigned int);
-extern struct arpentry *arp_lookup_resolv(unsigned short, unsigned int);
+extern int arp_resolve(struct netdev *, unsigned int, struct pkbuf *,
+			unsigned char *);
+extern int arp_update(unsigned short, unsigned int, unsigned char *);
 extern int arp_insert(struct netdev *, unsigned short, unsigned int, unsigned char *);
 
-extern void arp_queue_drop(struct arpentry *);
-extern void arp_queue_send(struct arpentry *);
-extern void arp_request(struct arpentry *);
+extern void arp_request(struct netdev *, unsigned int);
 extern void arp_in(struct netdev *dev, struct pkbuf *pkb);
 
 #endif	/* arp.h */
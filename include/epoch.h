@@ -0,0 +1,15 @@
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+/*
+ * Epoch based reclamation for lockless readers:
+ *   reader: epoch_enter(), follow shared pointers, epoch_exit()
+ *   writer: unlink object, stamp it with epoch_stamp(),
+ *           free it once the stamp is below epoch_safe()
+ */
+extern void epoch_enter(void);
+extern void epoch_exit(void);
+extern unsigned long epoch_stamp(void);
+extern unsigned long epoch_safe(void);
+
+#endif	/* epoch.h */
@@ -17,6 +17,8 @@ struct ether {
 	unsigned char eth_data[0];		/* data field */
 } __attribute__((packed));
 
+#define pkb2eth(pkb) ((struct ether *)((pkb)->pk_mh))
+
 static inline void hwacpy(void *dst, void *src)
 {
 	memcpy(dst, src, ETH_ALEN);
@@ -4,6 +4,7 @@
 #include "netif.h"
 #include "ether.h"
 #include "list.h"
+#include "lib.h"
 
 /* IP Packet Format */
 #define IP_ALEN 4
@@ -50,7 +51,7 @@ struct ip {
 #define ipndlen(nip) (_ntohs((nip)->ip_len) - iphlen(nip))
 #define ipdata(ip) ((unsigned char *)(ip) + iphlen(ip))
 #define ipoff(ip) ((((ip)->ip_fragoff) & IP_FRAG_OFF) * 8)
-#define pkb2ip(pkb) ((struct ip *)((pkb)->pk_data + ETH_HRD_SZ))
+#define pkb2ip(pkb) ((struct ip *)((pkb)->pk_nh))
 
 #define IPFMT "%d.%d.%d.%d"
 #define ipfmt(ip)\
@@ -64,6 +65,24 @@ static inline void ip_ntoh(struct ip *iphdr)
 }
 #define ip_hton(ip) ip_ntoh(ip)
 
+/* Assert iphdr is net-order and ip_ttl > 0 */
+static inline void ip_decrease_ttl(struct ip *iphdr)
+{
+	/* ttl is the high byte of the ttl/protocol header word */
+	unsigned short old = _htons(iphdr->ip_ttl << 8 | iphdr->ip_pro);
+
+	iphdr->ip_ttl--;
+	iphdr->ip_cksum = csum_replace2(iphdr->ip_cksum, old,
+				_htons(iphdr->ip_ttl << 8 | iphdr->ip_pro));
+}
+
+/* prepend ip header(no option) before L4 data in pkb */
+static inline struct ip *pkb_push_ip(struct pkbuf *pkb)
+{
+	pkb->pk_nh = pkb_push(pkb, IP_HRD_SZ);
+	return pkb2ip(pkb);
+}
+
 /* Fragment */
 struct fragment {
 	unsigned short frag_id;
@@ -100,10 +119,11 @@ static inline int equsubnet(unsigned int mask, unsigned int ip1, unsigned int ip
 extern struct pkbuf *ip_reass(struct pkbuf *);
 extern void ip_send_dev(struct netdev *, struct pkbuf *);
 extern void ip_send_out(struct pkbuf *);
-extern void ip_send_info(struct pkbuf *, unsigned char, unsigned short,
+extern void ip_send_info(struct pkbuf *, unsigned char,
 		unsigned char, unsigned char, unsigned int);
 extern void ip_send_frag(struct netdev *, struct pkbuf *);
 extern void ip_in(struct netdev *, struct pkbuf *);
+extern void ip_in_list(struct netdev *, struct list_head *);
 extern void ip_timer(int delta);
 extern void ip_forward(struct pkbuf *pkb);
 
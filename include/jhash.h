@@ -0,0 +1,44 @@
+#ifndef __JHASH_H
+#define __JHASH_H
+
+/*
+ * Bob Jenkins' lookup3 hash for a few 32-bit words (reference to Linux).
+ * @initval is a secret seed, so remote peers cannot aim at one bucket.
+ */
+#define JHASH_INITVAL	0xdeadbeef
+
+#define jhash_rol32(w, s) (((w) << (s)) | ((w) >> (32 - (s))))
+
+#define jhash_final(a, b, c)			\
+	do {					\
+		c ^= b; c -= jhash_rol32(b, 14);	\
+		a ^= c; a -= jhash_rol32(c, 11);	\
+		b ^= a; b -= jhash_rol32(a, 25);	\
+		c ^= b; c -= jhash_rol32(b, 16);	\
+		a ^= c; a -= jhash_rol32(c, 4);		\
+		b ^= a; b -= jhash_rol32(a, 14);	\
+		c ^= b; c -= jhash_rol32(b, 24);	\
+	} while (0)
+
+static inline unsigned int jhash_3words(unsigned int a, unsigned int b,
+				unsigned int c, unsigned int initval)
+{
+	a += JHASH_INITVAL + (3 << 2) + initval;
+	b += JHASH_INITVAL + (3 << 2) + initval;
+	c += JHASH_INITVAL + (3 << 2) + initval;
+	jhash_final(a, b, c);
+	return c;
+}
+
+static inline unsigned int jhash_2words(unsigned int a, unsigned int b,
+				unsigned int initval)
+{
+	return jhash_3words(a, b, 0, initval);
+}
+
+static inline unsigned int jhash_1word(unsigned int a, unsigned int initval)
+{
+	return jhash_3words(a, 0, 0, initval);
+}
+
+#endif	/* jhash.h */
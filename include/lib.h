@@ -107,6 +107,7 @@ do {\
 extern unsigned int net_debug;
 extern void *xmalloc(int);
 extern void *xzalloc(int);
+extern void get_random_bytes(void *, int);
 extern void perrx(char *str);
 extern int str2ip(char *str, unsigned int *ip);
 extern int parse_ip_mask(const char* str, unsigned int* ip, unsigned int* mask);
@@ -125,5 +126,42 @@ struct tcp;
 extern void udp_set_checksum(struct ip *, struct udp *);
 extern void tcp_set_checksum(struct ip *, struct tcp *);
 extern void ip_set_checksum(struct ip *);
+extern void tcp_set_checksum_text(struct ip *, struct tcp *, unsigned int);
+
+/*
+ * Incremental checksum update(RFC 1624 eqn. 3): HC' = ~(~HC + ~m + m')
+ * @check and the replaced fields are all taken as stored in the header.
+ */
+static inline unsigned short csum_replace2(unsigned short check,
+		unsigned short old, unsigned short new)
+{
+	unsigned int sum;
+
+	sum = (unsigned short)~check + (unsigned short)~old + new;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+/* for 32-bit fields, e.g. addresses rewritten by nat */
+static inline unsigned short csum_replace4(unsigned short check,
+		unsigned int old, unsigned int new)
+{
+	check = csum_replace2(check, old & 0xffff, new & 0xffff);
+	return csum_replace2(check, old >> 16, new >> 16);
+}
+
+/* checksum implementations, selected by cpu features in checksum_init() */
+struct csum_impl {
+	char *name;
+	unsigned int (*csum)(const void *, int, unsigned int);
+	unsigned int (*csum_copy)(void *, const void *, int, unsigned int);
+	int (*usable)(void);	/* NULL: always usable */
+};
+extern struct csum_impl csum_impls[];
+extern void checksum_init(void);
+extern unsigned int csum_partial(const void *data, int size, unsigned int sum);
+extern unsigned int csum_partial_copy(void *dst, const void *src, int size,
+		unsigned int sum);
 
 #endif	/* lib.h */
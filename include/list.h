@@ -62,6 +62,19 @@ static _inline void list_del_init(struct list_head *list)
 	list->next = list;
 }
 
+/* move all entries of @list to the tail of @head, @list is reinitialised */
+static _inline void list_splice_tail_init(struct list_head *list,
+					struct list_head *head)
+{
+	if (list->next == list)
+		return;
+	list->next->prev = head->prev;
+	head->prev->next = list->next;
+	list->prev->next = head;
+	head->prev = list->prev;
+	list_init(list);
+}
+
 #define LIST_HEAD(name)\
 	struct list_head name = { &name, &name };
 
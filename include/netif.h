@@ -3,6 +3,9 @@
 
 #define NETDEV_ALEN	6
 #define NETDEV_NLEN	16	/* IFNAMSIZ */
+#define NETDEV_RX_BURST	32	/* max frames passed to net_in_burst() */
+
+#include <assert.h>
 
 #include "compile.h"
 #include "list.h"
@@ -24,6 +27,8 @@ struct netdev_ops {
 	int (*xmit)(struct netdev *, struct pkbuf *);
 	int (*init)(struct netdev *);
 	void (*exit)(struct netdev *);
+	/* optional: alloc tx pkbuf in device buffer, which xmit wont copy */
+	struct pkbuf *(*alloc_pkb)(struct netdev *, int);
 };
 
 /* network interface device */
@@ -37,8 +42,20 @@ struct netdev {
 	struct netdev_ops *net_ops;		/* Nic Operation */
 	struct netstats net_stats;		/* protocol independent statistic */
 	struct list_head net_list;		/* net device list */
+	unsigned int net_features;		/* NETIF_F_* */
 	void* priv;
 };
+
+/* net_features */
+#define NETIF_F_GSO	0x1	/* tcp may send segments larger than mtu */
+#define NETIF_F_TSO	0x2	/* device splits them itself, see pk_gso_size */
+#define NETIF_F_GRO	0x4	/* merge received tcp segments of a burst */
+#define NETIF_F_RXCSUM	0x8	/* device verifies rx ip/tcp/udp checksums */
+#define NETIF_F_TX_IP_CSUM	0x10	/* device fills in ipv4 header checksum */
+#define NETIF_F_TX_L4_CSUM	0x20	/* device fills in tcp/udp checksum */
+
+/* largest tcp payload of a gso segment: ip total length is 16 bits */
+#define NETDEV_GSO_MAX	(0xffff - 20 - 20)
 #define LOCALNET(dev) ((dev)->net_ipaddr & (dev)->net_mask)
 
 /* tap device */
@@ -52,13 +69,99 @@ struct pkbuf {
 	struct list_head pk_list;	/* for ip fragment or arp waiting list */
 	unsigned short pk_pro;		/* ethernet packet type ID */
 	unsigned short pk_type;		/* packet hardware address type */
-	int pk_len;
+	unsigned char pk_class;		/* pkbuf pool size class */
+	int pk_len;			/* data length: pk_tail - pk_data */
 	int pk_refcnt;
 	struct netdev *pk_indev;
 	struct rtentry *pk_rtdst;
 	struct sock *pk_sk;
-	unsigned char pk_data[0];
-} __attribute__((packed));
+	unsigned short pk_gso_size;	/* tcp payload per segment, 0: no gso */
+	unsigned char pk_csum;		/* PKB_CSUM_* */
+	unsigned int pk_textsum;	/* csum_partial() of tcp text, 0: unknown */
+	/*
+	 * buffer layout:
+	 *  pk_head     pk_data            pk_tail     pk_end
+	 *     | headroom |  packet data      | tailroom  |
+	 */
+	unsigned char *pk_head;		/* start of buffer */
+	unsigned char *pk_data;		/* start of packet data */
+	unsigned char *pk_tail;		/* end of packet data */
+	unsigned char *pk_end;		/* end of buffer */
+	unsigned char *pk_mh;		/* ether header */
+	unsigned char *pk_nh;		/* ip header */
+	unsigned char pk_cb[32];	/* private data of current layer */
+	/* external buffer(e.g. dpdk mbuf): released when pkbuf is freed */
+	void (*pk_release)(struct pkbuf *);
+	void *pk_ext;			/* owner of external buffer */
+	unsigned char pk_buf[0];
+};
+
+/* pkbuf pool size classes(data room of each class) */
+#define PKB_CLASS_HDR	0	/* header-only packets: arp, tcp control */
+#define PKB_CLASS_MTU	1
+#define PKB_CLASS_JUMBO	2
+#define PKB_CLASS_NR	3
+#define PKB_CLASS_HEAP	0xff	/* oversize packet allocated from heap */
+
+/* pk_csum */
+#define PKB_CSUM_NONE		0	/* rx: to be verified, tx: filled in */
+#define PKB_CSUM_UNNECESSARY	1	/* rx: ip and l4 checksum verified already */
+#define PKB_CSUM_PARTIAL	2	/* tx: l4 checksum left to device or gso */
+
+/*
+ * headroom reserved by alloc_pkb() for ether + ip + tcp/udp/icmp headers,
+ * ip options not included(ip_frag() reserves its own room for them)
+ */
+#define PKB_RESERVE	64
+
+#define PKB_HDR_ROOM	128
+#define PKB_MTU_ROOM	(1536 + PKB_RESERVE)
+#define PKB_JUMBO_ROOM	(9216 + PKB_RESERVE)
+
+static _inline int pkb_headroom(struct pkbuf *pkb)
+{
+	return pkb->pk_data - pkb->pk_head;
+}
+
+static _inline int pkb_tailroom(struct pkbuf *pkb)
+{
+	return pkb->pk_end - pkb->pk_tail;
+}
+
+/* reserve headroom of an empty pkbuf */
+static _inline void pkb_reserve(struct pkbuf *pkb, int len)
+{
+	pkb->pk_data += len;
+	pkb->pk_tail += len;
+}
+
+/* add data to the tail, return the start of added data */
+static _inline unsigned char *pkb_put(struct pkbuf *pkb, int len)
+{
+	unsigned char *tail = pkb->pk_tail;
+	assert(pkb->pk_tail + len <= pkb->pk_end);
+	pkb->pk_tail += len;
+	pkb->pk_len += len;
+	return tail;
+}
+
+/* prepend header in headroom, return the new data */
+static _inline unsigned char *pkb_push(struct pkbuf *pkb, int len)
+{
+	assert(pkb->pk_data - len >= pkb->pk_head);
+	pkb->pk_data -= len;
+	pkb->pk_len += len;
+	return pkb->pk_data;
+}
+
+/* strip header from data, return the new data */
+static _inline unsigned char *pkb_pull(struct pkbuf *pkb, int len)
+{
+	assert(len <= pkb->pk_len);
+	pkb->pk_data += len;
+	pkb->pk_len -= len;
+	return pkb->pk_data;
+}
 
 /* packet hardware address type */
 #define PKT_NONE	0
@@ -96,23 +199,29 @@ extern struct netdev *netdev_alloc(char *dev, struct netdev_ops *, void* priv);
 extern void netdev_free(struct netdev *nd);
 extern void netdev_interrupt(void);
 extern void netdev_exit(void);
+extern struct pkbuf *netdev_alloc_pkb(struct netdev *dev, int size);
 
 extern void net_in(struct netdev *dev, struct pkbuf *pkb);
+extern void net_in_burst(struct netdev *dev, struct pkbuf **pkbs, int n);
 extern void net_timer(void);
 
 extern struct pkbuf *alloc_pkb(int size);
+extern struct pkbuf *alloc_tx_pkb(int size);
 extern struct pkbuf *alloc_netdev_pkb(struct netdev *nd);
+extern struct pkbuf *alloc_ext_pkb(unsigned char *buf, int size,
+				void (*release)(struct pkbuf *), void *ext);
 extern void pkbdbg(struct pkbuf *pkb);
 extern void pkb_trim(struct pkbuf *pkb, int len);
+extern void pkb_pool_stat(void);
 //#define DEBUG_PKB
 #ifdef DEBUG_PKB
 extern void _free_pkb(struct pkbuf *pkb);
-extern void _netdev_tx(struct netdev *nd, struct pkbuf *pkb, int len,
+extern void _netdev_tx(struct netdev *nd, struct pkbuf *pkb,
 				unsigned short proto, unsigned char *dst);
-#define netdev_tx(nd, pkb, len, proto, dst)\
+#define netdev_tx(nd, pkb, proto, dst)\
 do {\
 	dbg("");\
-	_netdev_tx(nd, pkb, len, proto, dst);\
+	_netdev_tx(nd, pkb, proto, dst);\
 } while (0)
 
 #define free_pkb(pkb)\
@@ -122,9 +231,12 @@ do {\
 } while (0)
 #else
 extern void free_pkb(struct pkbuf *pkb);
-extern void netdev_tx(struct netdev *nd, struct pkbuf *pkb, int len,
+extern void netdev_tx(struct netdev *nd, struct pkbuf *pkb,
 				unsigned short proto, unsigned char *dst);
 #endif
+extern void netdev_gso_tx(struct netdev *dev, struct pkbuf *pkb,
+				unsigned short proto, unsigned char *dst);
+extern void net_gro_list(struct list_head *list);
 
 extern int free_pkbs;
 extern int alloc_pkbs;
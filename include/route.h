@@ -11,6 +11,30 @@ struct rtentry {
 	unsigned int rt_flags;		/* route entry flags */
 	int rt_metric;			/* distance metric */
 	struct netdev *rt_dev;		/* output net device or local net device */
+	unsigned int rt_lpm_idx;	/* route index in lpm table */
+};
+
+/* DIR-24-8 longest prefix match table, see ip/route_lpm.c */
+#define LPM_ROUTE_CHUNKS	256
+#define LPM_GROUP_CHUNKS	1024
+
+/* fifo of released route or tbl8 group indexes, grows as needed */
+struct lpm_free {
+	unsigned int *idx;
+	unsigned int size;		/* power of 2, 0 until first release */
+	unsigned int head, tail;
+};
+
+struct rt_lpm {
+	unsigned int *tbl24;
+	unsigned int *tbl8[LPM_GROUP_CHUNKS];	/* tbl8 group chunks */
+	struct rtentry **routes[LPM_ROUTE_CHUNKS];	/* route index chunks */
+	struct rtentry *def;		/* /0 route, kept out of tbl24 */
+	unsigned int route_nr;		/* route indexes handed out */
+	unsigned int group_nr;		/* tbl8 groups allocated */
+	unsigned int group_used;	/* tbl8 groups linked into tbl24 */
+	struct lpm_free route_free;	/* released route indexes */
+	struct lpm_free group_free;	/* released tbl8 groups */
 };
 
 #define RT_NONE		0x00000000
@@ -25,5 +49,22 @@ extern void rt_init(void);
 extern int rt_output(struct pkbuf *);
 extern int rt_input(struct pkbuf *);
 extern void rt_traverse(void);
+extern struct rtentry *rt_alloc(unsigned int, unsigned int, unsigned int,
+			int, unsigned int, struct netdev *);
+
+/* bumped on every route change, see ip/dst_cache.c */
+extern unsigned int rt_genid;
+extern struct rtentry *dst_route(unsigned int daddr);
+extern int dst_hwaddr(unsigned int daddr, struct rtentry *rt,
+			unsigned char *hwaddr);
+extern void dst_set_hwaddr(unsigned int daddr, struct rtentry *rt,
+			unsigned char *hwaddr, unsigned int arpgen);
+
+extern struct rt_lpm *lpm_alloc(void);
+extern void lpm_free(struct rt_lpm *);
+extern int lpm_add(struct rt_lpm *, struct rtentry *);
+extern void lpm_delete(struct rt_lpm *, struct rtentry *, struct rtentry *);
+extern struct rtentry *lpm_lookup(struct rt_lpm *, unsigned int);
+extern int lpm_depth(unsigned int netmask);
 
 #endif	/* route.h */
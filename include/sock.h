@@ -64,6 +64,7 @@ struct sock {
 
 extern void sock_add_hash(struct sock *, struct hlist_head *);
 extern void sock_del_hash(struct sock *);
+extern int sock_unlink_hash(struct sock *);
 #ifdef SOCK_DEBUG
 #define free_sock(sk)\
 	do {\
@@ -47,7 +47,6 @@ struct tcp {
 	unsigned char data[0];
 } __attribute__((packed));
 
-#define pkb2tcp(pkb) ((struct tcp *)((pkb)->pk_data + ETH_HRD_SZ + IP_HRD_SZ))
 #define ip2tcp(ip) ((struct tcp *)ipdata(ip))
 #define TCP_HRD_SZ (sizeof(struct tcp))
 #define TCP_HRD_DOFF (TCP_HRD_SZ >> 2)
@@ -77,6 +76,7 @@ struct tcp_sock {
 	int backlog;			/* size of accept queue */
 	struct list_head listen_queue;	/* waiting for second SYN+ACK of three-way handshake */
 	struct list_head accept_queue;	/* waiting for third ACK of three-way handshake */
+	pthread_mutex_t queue_lock;	/* listen/accept queues, children may arrive on several rx queues */
 	struct list_head list;
 	struct tcp_timer timewait;	/* TIME-WAIT TIMEOUT */
 	struct tapip_wait *wait_accept;
@@ -107,6 +107,7 @@ struct tcp_sock {
 #define TCP_F_PUSH		0x00000001	/* text pushing to user */
 #define TCP_F_ACKNOW		0x00000002	/* ack at right */
 #define TCP_F_ACKDELAY		0x00000004	/* ack at right */
+#define TCP_F_PORTSHARE		0x00000008	/* port from tcp_port_connect() */
 
 /* host-order tcp current segment (RFC 793) */
 struct tcp_segment {
@@ -123,6 +124,7 @@ struct tcp_segment {
 	struct tcp *tcphdr;
 };
 
+/* accept queue helpers: caller holds queue_lock of the listening sock */
 static _inline int tcp_accept_queue_full(struct tcp_sock *tsk)
 {
 	return (tsk->accept_backlog >= tsk->backlog);
@@ -147,6 +149,7 @@ static _inline struct tcp_sock *tcp_accept_dequeue(struct tcp_sock *tsk)
 }
 
 extern void tcp_in(struct pkbuf *);
+extern void tcp_in_list(struct list_head *);
 extern struct sock *tcp_lookup_sock(unsigned int, unsigned int, unsigned int, unsigned int);
 extern void tcp_process(struct pkbuf *, struct tcp_segment *, struct sock *);
 extern struct sock *tcp_alloc_sock(int);
@@ -154,6 +157,8 @@ extern int tcp_hash(struct sock *);
 extern void tcp_unhash(struct sock *);
 extern void tcp_unbhash(struct tcp_sock *);
 extern void tcp_init(void);
+extern void tcp_hash_stat(void);
+extern void tcp_hash_stat_reset(void);
 extern struct tcp_sock *get_tcp_sock(struct tcp_sock *);
 extern void tcp_send_reset(struct tcp_sock *, struct tcp_segment *);
 extern void tcp_send_synack(struct tcp_sock *, struct tcp_segment *);
@@ -3,43 +3,104 @@
 
 #include "sock.h"
 #include "tcp.h"
+#include "jhash.h"
 
-/* How to select hash size? or hash algorithm? */
-#define TCP_EHASH_SIZE	0x40
-#define TCP_EHASH_MASK	(TCP_EHASH_SIZE - 1)
+/*
+ * Tables start small and double once chains average TCP_HASH_LOAD,
+ * halve again when they are mostly empty.
+ */
+#define TCP_EHASH_BITS		6
+#define TCP_EHASH_MAXBITS	20
+#define TCP_LHASH_BITS		5
+#define TCP_LHASH_MAXBITS	12
+#define TCP_BHASH_BITS		8
+#define TCP_BHASH_MAXBITS	16
+#define TCP_HASH_LOAD		2
+#define TCP_HASH_SHRINK		8	/* halve below one entry per 8 buckets */
 
-#define TCP_LHASH_SIZE	0x20
-#define TCP_LHASH_MASK	(TCP_LHASH_SIZE - 1)
-
-#define TCP_BHASH_SIZE	0x100
-#define TCP_BHASH_MASK	(TCP_BHASH_SIZE - 1)
 #define TCP_BPORT_MIN	0x8000
 #define TCP_BPORT_MAX	0xf000
 
-#define tcp_ehash_head(hash) (&tcp_table.etable[hash])
-#define tcp_bhash_head(hash) (&tcp_table.btable[hash])
-#define tcp_lhash_head(hash) (&tcp_table.ltable[hash])
+/* histogram slots: 0, 1, 2-3, 4-7, ... 64+ */
+#define TCP_HIST_NR	8
+
+struct tcp_hbucket {
+	pthread_spinlock_t lock;
+	struct hlist_head head;
+};
+
+/* bucket array, replaced as a whole on resizing */
+struct tcp_hbuckets {
+	unsigned int bits;
+	unsigned long retire;			/* epoch it was replaced in */
+	struct tcp_hbuckets *next;		/* on retired list */
+	struct tcp_hbucket b[0];
+};
+
+/*
+ * Bucket users only take their bucket spinlock. Resizing, serialized by
+ * @lock, takes every bucket lock of the old array before it swaps in the
+ * new one, so a user finding @buckets changed once it has its bucket
+ * locked looks again. Old arrays are freed once no user can be on them.
+ */
+struct tcp_htable {
+	const char *name;
+	struct tcp_hbuckets *buckets;
+	unsigned int bits;			/* of @buckets, for resize checks */
+	unsigned int minbits, maxbits;
+	int count;				/* entries hashed */
+	unsigned int resizes;
+	pthread_mutex_t lock;
+	struct tcp_hbuckets *retired;		/* under @lock */
+	unsigned int (*node_hash)(struct hlist_node *);	/* for rehashing */
+	unsigned long cost[TCP_HIST_NR];	/* entries walked per lookup */
+};
 
 struct tcp_hash_table {
-	struct hlist_head etable[TCP_EHASH_SIZE];	/* establish hash table */
-	struct hlist_head ltable[TCP_LHASH_SIZE];	/* listen hash table */
-	struct hlist_head btable[TCP_BHASH_SIZE];	/* bind hash table */
-	int bfree;					/* [bmin, bmax] */
-	/* FIXME: rw lock */
+	struct tcp_htable etable;	/* establish hash table */
+	struct tcp_htable ltable;	/* listen hash table */
+	struct tcp_htable btable;	/* bind hash table */
+	unsigned int seed;		/* secret, chosen at boot */
 };
 
-/* reference to Linux */
-static __inline unsigned int tcp_ehashfn(unsigned int src, unsigned int dst,
-				unsigned short src_port, unsigned short dst_port)
+extern struct tcp_hash_table tcp_table;
+
+static _inline unsigned int tcp_ehashfn(unsigned int laddr, unsigned int raddr,
+				unsigned short lport, unsigned short rport)
 {
-	unsigned int hash;
-	hash = (src ^ src_port) ^ (dst ^ dst_port);
-	/* make all bits xor to lowest 8 bit */
-	hash ^= hash >> 16;
-	hash ^= hash >> 8;
-	return hash & TCP_EHASH_MASK;
+	return jhash_3words(laddr, raddr, (unsigned int)lport << 16 | rport,
+				tcp_table.seed);
 }
 
+/* listen and bind tables are keyed by local port only */
+static _inline unsigned int tcp_phashfn(unsigned short lport)
+{
+	return jhash_1word(lport, tcp_table.seed);
+}
+
+static _inline int tcp_hist_slot(unsigned int n)
+{
+	int slot = n ? 32 - __builtin_clz(n) : 0;
+	return slot < TCP_HIST_NR ? slot : TCP_HIST_NR - 1;
+}
+
+extern void tcp_htable_init(struct tcp_htable *, const char *,
+		unsigned int, unsigned int, unsigned int (*)(struct hlist_node *));
+extern struct tcp_hbucket *tcp_hbucket_get(struct tcp_htable *, unsigned int);
+extern void tcp_hbucket_put(struct tcp_htable *, struct tcp_hbucket *);
+extern void tcp_htable_added(struct tcp_htable *);
+extern void tcp_htable_removed(struct tcp_htable *);
+extern void tcp_htable_cost(struct tcp_htable *, unsigned int);
+
+extern int tcp_port_ephemeral(unsigned short);
+extern int tcp_port_reserve(unsigned short);
+extern unsigned short tcp_port_pick(void);
+extern void tcp_port_release(unsigned short);
+extern int tcp_port_connect(struct tcp_sock *);
+extern void tcp_port_unshare(struct tcp_sock *);
+extern void tcp_port_init(void);
+extern void tcp_port_stat(void);
+
 static _inline int tcp_ehash_conflict(struct hlist_head *head, struct sock *sk)
 {
 	struct hlist_node *node;
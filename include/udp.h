@@ -22,6 +22,7 @@ struct udp_sock {
 
 extern struct sock *udp_lookup_sock(unsigned short port);
 extern void udp_in(struct pkbuf *pkb);
+extern void udp_in_list(struct list_head *list);
 extern void udp_init(void);
 extern struct sock *udp_alloc_sock(int protocol);
 
@@ -0,0 +1,125 @@
+/*
+ *  Destination cache:
+ *    resolved route and next-hop hardware address per destination ip,
+ *    so sending to a known destination skips route lookup, arp cache
+ *    scan and its mutex.
+ *
+ *  Entries stay valid while rt_genid / arp_genid are unchanged: any route
+ *  or arp change bumps the counter and stale entries are refilled lazily.
+ *  Each slot is guarded by a sequence count, readers copy it without a
+ *  lock and retry nothing: a slot being written is simply a miss.
+ */
+#include "netif.h"
+#include "ether.h"
+#include "arp.h"
+#include "ip.h"
+#include "route.h"
+#include "lib.h"
+
+#define DST_CACHE_SZ	256	/* direct mapped, power of 2 */
+
+struct dst_entry {
+	unsigned int dst_seq;		/* odd while being written */
+	unsigned int dst_addr;		/* destination ip */
+	unsigned int dst_rtgen;		/* rt_genid of dst_rt */
+	unsigned int dst_arpgen;	/* arp_genid of dst_hwaddr, 0: none */
+	struct rtentry *dst_rt;
+	unsigned char dst_hwaddr[ETH_ALEN];	/* next-hop hardware address */
+};
+
+static struct dst_entry dst_cache[DST_CACHE_SZ];
+
+static _inline struct dst_entry *dst_slot(unsigned int daddr)
+{
+	return &dst_cache[(daddr * 2654435761U) >> 24 & (DST_CACHE_SZ - 1)];
+}
+
+/* copy out slot of @daddr, -1 if it is being written or not @daddr's */
+static int dst_read(unsigned int daddr, struct dst_entry *de)
+{
+	struct dst_entry *slot = dst_slot(daddr);
+	unsigned int seq;
+
+	seq = __atomic_load_n(&slot->dst_seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return -1;
+	*de = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->dst_seq, __ATOMIC_RELAXED) != seq ||
+		de->dst_addr != daddr)
+		return -1;
+	return 0;
+}
+
+/* writers never wait: a busy slot is left to whoever is writing it */
+static struct dst_entry *dst_write_begin(unsigned int daddr)
+{
+	struct dst_entry *slot = dst_slot(daddr);
+	unsigned int seq = __atomic_load_n(&slot->dst_seq, __ATOMIC_RELAXED);
+
+	if ((seq & 1) || !__atomic_compare_exchange_n(&slot->dst_seq, &seq,
+			seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return NULL;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return slot;
+}
+
+static void dst_write_end(struct dst_entry *slot)
+{
+	__atomic_store_n(&slot->dst_seq, slot->dst_seq + 1, __ATOMIC_RELEASE);
+}
+
+struct rtentry *dst_route(unsigned int daddr)
+{
+	struct dst_entry de, *slot;
+	struct rtentry *rt;
+	unsigned int gen = __atomic_load_n(&rt_genid, __ATOMIC_ACQUIRE);
+
+	if (dst_read(daddr, &de) == 0 && de.dst_rtgen == gen)
+		return de.dst_rt;
+	/* gen is read before lookup: a racing change leaves entry stale */
+	rt = rt_lookup(daddr);
+	if (!rt)
+		return NULL;
+	slot = dst_write_begin(daddr);
+	if (slot) {
+		if (slot->dst_addr != daddr || slot->dst_rt != rt)
+			slot->dst_arpgen = 0;
+		slot->dst_addr = daddr;
+		slot->dst_rt = rt;
+		slot->dst_rtgen = gen;
+		dst_write_end(slot);
+	}
+	return rt;
+}
+
+/* next-hop hardware address of @daddr sent via @rt, -1 if not cached */
+int dst_hwaddr(unsigned int daddr, struct rtentry *rt, unsigned char *hwaddr)
+{
+	struct dst_entry de;
+
+	if (dst_read(daddr, &de) < 0 || de.dst_rt != rt || !de.dst_arpgen ||
+		de.dst_arpgen != __atomic_load_n(&arp_genid, __ATOMIC_ACQUIRE))
+		return -1;
+	hwacpy(hwaddr, de.dst_hwaddr);
+	return 0;
+}
+
+/* @arpgen: arp_genid read before the arp cache was looked up */
+void dst_set_hwaddr(unsigned int daddr, struct rtentry *rt,
+		unsigned char *hwaddr, unsigned int arpgen)
+{
+	struct dst_entry *slot = dst_write_begin(daddr);
+
+	if (!slot)
+		return;
+	if (slot->dst_addr != daddr || slot->dst_rt != rt) {
+		/* route part is known good only as of now */
+		slot->dst_addr = daddr;
+		slot->dst_rt = rt;
+		slot->dst_rtgen = 0;
+	}
+	hwacpy(slot->dst_hwaddr, hwaddr);
+	slot->dst_arpgen = arpgen;
+	dst_write_end(slot);
+}
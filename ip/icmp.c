@@ -241,18 +241,17 @@ void icmp_send(unsigned char type, unsigned char code,
 	/* ip packet size must be smaller than 576 bytes */
 	if (IP_HRD_SZ + ICMP_HRD_SZ + paylen > 576)
 		paylen = 576 - IP_HRD_SZ - ICMP_HRD_SZ;
-	pkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + ICMP_HRD_SZ + paylen);
-	icmphdr = (struct icmp *)(pkb2ip(pkb)->ip_data);
+	pkb = alloc_pkb(ICMP_HRD_SZ + paylen);
+	memcpy(pkb_put(pkb, paylen), (unsigned char *)iphdr, paylen);
+	icmphdr = (struct icmp *)pkb_push(pkb, ICMP_HRD_SZ);
 	icmphdr->icmp_type = type;
 	icmphdr->icmp_code = code;
 	icmphdr->icmp_cksum = 0;
 	icmphdr->icmp_undata = data;
-	memcpy(icmphdr->icmp_data, (unsigned char *)iphdr, paylen);
 	icmphdr->icmp_cksum =
 		icmp_chksum((unsigned short *)icmphdr, ICMP_HRD_SZ + paylen);
 	icmpdbg("to "IPFMT"(payload %d) [type %d code %d]\n",
 		ipfmt(iphdr->ip_src), paylen, type, code);
-	ip_send_info(pkb, 0, IP_HRD_SZ + ICMP_HRD_SZ + paylen,
-						0, IP_P_ICMP, iphdr->ip_src);
+	ip_send_info(pkb, 0, 0, IP_P_ICMP, iphdr->ip_src);
 }
 
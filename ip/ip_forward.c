@@ -27,9 +27,7 @@ void ip_forward(struct pkbuf *pkb)
 		goto drop_pkb;
 	}
 
-	/* FIXME: ajacent checksum for decreased ttl */
-	iphdr->ip_ttl--;
-	ip_set_checksum(iphdr);
+	ip_decrease_ttl(iphdr);
 
 	/* default route or remote dst */
 	if ((rt->rt_flags & RT_DEFAULT) || rt->rt_metric > 0)
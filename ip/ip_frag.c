@@ -8,6 +8,7 @@
 #include "netcfg.h"
 
 static LIST_HEAD(frag_head);	/* head of datagrams */
+static pthread_mutex_t frag_lock = PTHREAD_MUTEX_INITIALIZER;	/* frag_head */
 
 static inline int full_frag(struct fragment *frag)
 {
@@ -71,20 +72,21 @@ struct pkbuf *reass_frag(struct fragment *frag)
 		goto out;
 	}
 
-	/* copy ether header and ip header */
+	/* copy ip header */
 	fragpkb = list_first_entry(&frag->frag_pkb, struct pkbuf, pk_list);
 	fraghdr = pkb2ip(fragpkb);
 
-	pkb = alloc_pkb(ETH_HRD_SZ + len);
+	pkb = alloc_pkb(len);
 	pkb->pk_pro = ETH_P_IP;
-	p = pkb->pk_data;
-	memcpy(p, fragpkb->pk_data, ETH_HRD_SZ + hlen);
+	p = pkb_put(pkb, len);
+	pkb->pk_nh = p;
+	memcpy(p, fraghdr, hlen);
 
 	/* adjacent ip header */
 	pkb2ip(pkb)->ip_fragoff = 0;
 	pkb2ip(pkb)->ip_len = len;
 
-	p += ETH_HRD_SZ + hlen;
+	p += hlen;
 	list_for_each_entry(fragpkb, &frag->frag_pkb, pk_list) {
 		fraghdr = pkb2ip(fragpkb);
 		memcpy(p, (char *)fraghdr + hlen, fraghdr->ip_len - hlen);
@@ -199,29 +201,40 @@ struct pkbuf *ip_reass(struct pkbuf *pkb)
 			ipoff(iphdr),
 			iphdr->ip_len);
 
+	pthread_mutex_lock(&frag_lock);
 	frag = lookup_frag(iphdr);
 	if (frag == NULL)
 		frag = new_frag(iphdr);
 	if (insert_frag(pkb, frag) < 0)
-		return NULL;
+		pkb = NULL;
 #ifdef ICMP_EXC_FRAGTIME_TEST
-	return NULL;
-#endif
-	if (complete_frag(frag))
+	else
+		pkb = NULL;
+#else
+	else if (complete_frag(frag))
 		pkb = reass_frag(frag);
 	else
 		pkb = NULL;
+#endif
+	pthread_mutex_unlock(&frag_lock);
 
 	return pkb;
 }
 
-struct pkbuf *ip_frag(struct pkbuf *pkb, struct ip *orig, int hlen,
-				int dlen, int off, unsigned short mf_bit)
+/*
+ * Build fragment (@off, @dlen) of @pkb.
+ * Only fragment payload is copied: the new pkbuf reserves headroom,
+ * so ip header and ether header are prepended in place. PKB_RESERVE
+ * does not cover an ip header with options, so room for @hlen is added.
+ */
+static struct pkbuf *ip_frag(struct pkbuf *pkb, struct ip *orig, int hlen,
+				int dlen, int off, unsigned short fragoff)
 {
 	struct pkbuf *fragpkb;
 	struct ip *fraghdr;
 
-	fragpkb = alloc_pkb(ETH_HRD_SZ + hlen + dlen);
+	fragpkb = alloc_pkb(hlen + dlen);
+	pkb_reserve(fragpkb, hlen);
 	/* clone pkb information */
 	fragpkb->pk_pro = pkb->pk_pro;
 	fragpkb->pk_type = pkb->pk_type;
@@ -229,58 +242,77 @@ struct pkbuf *ip_frag(struct pkbuf *pkb, struct ip *orig, int hlen,
 	fragpkb->pk_rtdst = pkb->pk_rtdst;
 
 	/* clone pkb (off) data */
+	memcpy(pkb_put(fragpkb, dlen), (void *)orig + hlen + off, dlen);
+	/* copy head(maybe with options) */
+	fragpkb->pk_nh = pkb_push(fragpkb, hlen);
 	fraghdr = pkb2ip(fragpkb);
-	/* copy head */
 	memcpy(fraghdr, orig, hlen);
-	/* copy data */
-	memcpy((void *)fraghdr + hlen, (void *)orig + hlen + off, dlen);
 	/* adjacent the head */
 	fraghdr->ip_len = _htons(hlen + dlen);
-	mf_bit |= (off >> 3);
-	fraghdr->ip_fragoff = _htons(mf_bit);
+	fraghdr->ip_fragoff = _htons(fragoff);
 	ip_set_checksum(fraghdr);
 	return fragpkb;
 }
 
+/*
+ * Assert @pkb is net-order, and pkb->pk_data is its ip header.
+ * The first fragment reuses @pkb itself(just trims its tail), and the
+ * following ones are built before it is sent, since the lower layer
+ * may free or queue @pkb.
+ */
 void ip_send_frag(struct netdev *dev, struct pkbuf *pkb)
 {
-	struct pkbuf *fragpkb;
+	struct pkbuf *fragpkb, *next;
 	struct ip *iphdr;
-	int dlen, hlen, mlen, off;
+	LIST_HEAD(frag_list);
+	int dlen, hlen, mlen, off, base;
+	unsigned short mf_bit;
 
 	iphdr = pkb2ip(pkb);
 	hlen = iphlen(iphdr);
 	dlen = _ntohs(iphdr->ip_len) - hlen;
 	mlen = (dev->net_mtu - hlen) & ~7;	/* max length */
-	off = 0;
-	while (dlen > mlen) {
+	/* @pkb may be a fragment being forwarded */
+	base = (_ntohs(iphdr->ip_fragoff) & IP_FRAG_OFF) * 8;
+	mf_bit = _ntohs(iphdr->ip_fragoff) & IP_FRAG_MF;
+	off = mlen;
+	while (dlen - off > mlen) {
 		ipdbg(" [f] ip frag: off %d hlen %d dlen %d", off, hlen, mlen);
-		fragpkb = ip_frag(pkb, iphdr, hlen, mlen, off, IP_FRAG_MF);
-
-		ip_send_dev(dev, fragpkb);
-
-		dlen -= mlen;
+		fragpkb = ip_frag(pkb, iphdr, hlen, mlen, off,
+					IP_FRAG_MF | ((base + off) >> 3));
+		list_add_tail(&fragpkb->pk_list, &frag_list);
 		off += mlen;
 	}
-
-	if (dlen) {
-		ipdbg(" [f] ip frag: off %d hlen %d dlen %d", off, hlen, dlen);
-		fragpkb = ip_frag(pkb, iphdr, hlen, dlen, off,
-					iphdr->ip_fragoff & IP_FRAG_MF);
+	ipdbg(" [f] ip frag: off %d hlen %d dlen %d", off, hlen, dlen - off);
+	fragpkb = ip_frag(pkb, iphdr, hlen, dlen - off, off,
+				mf_bit | ((base + off) >> 3));
+	list_add_tail(&fragpkb->pk_list, &frag_list);
+
+	/* first fragment: trim @pkb in place */
+	ipdbg(" [f] ip frag: off 0 hlen %d dlen %d", hlen, mlen);
+	pkb_trim(pkb, hlen + mlen);
+	iphdr->ip_len = _htons(hlen + mlen);
+	iphdr->ip_fragoff = _htons(IP_FRAG_MF | (base >> 3));
+	ip_set_checksum(iphdr);
+	ip_send_dev(dev, pkb);
+
+	list_for_each_entry_safe(fragpkb, next, &frag_list, pk_list) {
+		list_del_init(&fragpkb->pk_list);
 		ip_send_dev(dev, fragpkb);
 	}
-	free_pkb(pkb);
 }
 
 /* FIXME: ip_timer test */
 void ip_timer(int delta)
 {
 	struct fragment *frag, *__safe;
-	/* FIXME: mutex-- for frag_head */
+	LIST_HEAD(expired);
+
 	/*
-	 * delete_frag() will remove list from frag_head,
-	 * so we use safe list traverse macro to avoid corruption.
+	 * Timed out datagrams are unlinked under frag_lock, and icmp is sent
+	 * after it is dropped: the error may loop back into ip_reass().
 	 */
+	pthread_mutex_lock(&frag_lock);
 	list_for_each_entry_safe(frag, __safe, &frag_head, frag_list) {
 #ifndef ICMP_EXC_FRAGTIME_TEST
 		/* condition race */
@@ -289,18 +321,23 @@ void ip_timer(int delta)
 #endif
 		frag->frag_ttl -= delta;
 		if (frag->frag_ttl <= 0) {
-			struct pkbuf *pkb = frag_head_pkb(frag);
-			ip_hton(pkb2ip(pkb));
-			/*
-			 * RFC 792:
-			 * If fragment zero is not available then
-			 * no time exceeded need be sent at all.
-			 *
-			 * And icmp_send() will check the fragment zero.
-			 */
-			icmp_send(ICMP_T_TIMEEXCEED, ICMP_EXC_FRAGTIME, 0, pkb);
-			delete_frag(frag);
+			list_del(&frag->frag_list);
+			list_add_tail(&frag->frag_list, &expired);
 		}
 	}
-	/* mutex++ for frag_head */
+	pthread_mutex_unlock(&frag_lock);
+
+	list_for_each_entry_safe(frag, __safe, &expired, frag_list) {
+		struct pkbuf *pkb = frag_head_pkb(frag);
+		ip_hton(pkb2ip(pkb));
+		/*
+		 * RFC 792:
+		 * If fragment zero is not available then
+		 * no time exceeded need be sent at all.
+		 *
+		 * And icmp_send() will check the fragment zero.
+		 */
+		icmp_send(ICMP_T_TIMEEXCEED, ICMP_EXC_FRAGTIME, 0, pkb);
+		delete_frag(frag);
+	}
 }
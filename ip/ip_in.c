@@ -9,7 +9,12 @@
 #include "route.h"
 #include "lib.h"
 
-void ip_recv_local(struct pkbuf *pkb)
+/*
+ * Deliver local packet, tcp and udp segments are queued on
+ * @tcp_list and @udp_list to be handled per batch.
+ */
+static void ip_recv_local(struct pkbuf *pkb, struct list_head *tcp_list,
+				struct list_head *udp_list)
 {
 	struct ip *iphdr = pkb2ip(pkb);
 
@@ -35,10 +40,10 @@ void ip_recv_local(struct pkbuf *pkb)
 		icmp_in(pkb);
 		break;
 	case IP_P_TCP:
-		tcp_in(pkb);
+		list_add_tail(&pkb->pk_list, tcp_list);
 		break;
 	case IP_P_UDP:
-		udp_in(pkb);
+		list_add_tail(&pkb->pk_list, udp_list);
 		break;
 	default:
 		free_pkb(pkb);
@@ -47,70 +52,103 @@ void ip_recv_local(struct pkbuf *pkb)
 	}
 }
 
-void ip_recv_route(struct pkbuf *pkb)
+/* Leave pkb net-order: forwarded packets are never converted */
+static int ip_in_check(struct pkbuf *pkb)
 {
-	if (rt_input(pkb) < 0)
-		return;
-	/* Is this packet sent to us? */
-	if (pkb->pk_rtdst->rt_flags & RT_LOCALHOST) {
-		ip_recv_local(pkb);
-	} else {
-		ip_hton(pkb2ip(pkb));
-		ip_forward(pkb);
-	}
-}
-
-void ip_in(struct netdev *dev, struct pkbuf *pkb)
-{
-	struct ether *ehdr = (struct ether *)pkb->pk_data;
-	struct ip *iphdr = (struct ip *)ehdr->eth_data;
-	int hlen;
+	struct ip *iphdr = (struct ip *)pkb->pk_data;
+	int hlen, len;
 
+	pkb->pk_nh = pkb->pk_data;
 	/* Fussy sanity check */
 	if (pkb->pk_type == PKT_OTHERHOST) {
 		ipdbg("ip(l2) packet is not for us");
-		goto err_free_pkb;
+		return -1;
 	}
 
-	if (pkb->pk_len < ETH_HRD_SZ + IP_HRD_SZ) {
+	if (pkb->pk_len < IP_HRD_SZ) {
 		ipdbg("ip packet is too small");
-		goto err_free_pkb;
+		return -1;
 	}
 
 	if (ipver(iphdr) != IP_VERSION_4) {
 		ipdbg("ip packet is not version 4");
-		goto err_free_pkb;
+		return -1;
 	}
 
 	hlen = iphlen(iphdr);
 	if (hlen < IP_HRD_SZ) {
 		ipdbg("ip header is too small");
-		goto err_free_pkb;
+		return -1;
 	}
 
-	if (ip_chksum((unsigned short *)iphdr, hlen) != 0) {
+	if (pkb->pk_csum != PKB_CSUM_UNNECESSARY &&
+		ip_chksum((unsigned short *)iphdr, hlen) != 0) {
 		ipdbg("ip checksum is error");
-		goto err_free_pkb;
+		return -1;
 	}
 
-	ip_ntoh(iphdr);
-	if (iphdr->ip_len < hlen ||
-		pkb->pk_len < ETH_HRD_SZ + iphdr->ip_len) {
+	len = _ntohs(iphdr->ip_len);
+	if (len < hlen || pkb->pk_len < len) {
 		ipdbg("ip size is unknown");
-		goto err_free_pkb;
+		return -1;
 	}
 
-	if (pkb->pk_len > ETH_HRD_SZ + iphdr->ip_len)
-		pkb_trim(pkb, ETH_HRD_SZ + iphdr->ip_len);
+	if (pkb->pk_len > len)
+		pkb_trim(pkb, len);
 
 	/* Now, we can take care of the main ip processing safely. */
 	ipdbg(IPFMT " -> " IPFMT "(%d/%d bytes)",
 				ipfmt(iphdr->ip_src), ipfmt(iphdr->ip_dst),
-				hlen, iphdr->ip_len);
-	ip_recv_route(pkb);
-	return;
+				hlen, len);
+	return 0;
+}
 
-err_free_pkb:
-	free_pkb(pkb);
+/*
+ * Handle a list of received ip packets (linked by pk_list).
+ * Packets to the same destination share one route lookup, and
+ * local tcp/udp segments go up as lists.
+ */
+void ip_in_list(struct netdev *dev, struct list_head *list)
+{
+	struct pkbuf *pkb, *next;
+	struct rtentry *rt = NULL;
+	unsigned int rtdst = 0;
+	LIST_HEAD(tcp_list);
+	LIST_HEAD(udp_list);
+
+	list_for_each_entry_safe(pkb, next, list, pk_list) {
+		list_del(&pkb->pk_list);
+		if (ip_in_check(pkb) < 0) {
+			free_pkb(pkb);
+			continue;
+		}
+		if (rt && pkb2ip(pkb)->ip_dst == rtdst) {
+			pkb->pk_rtdst = rt;
+		} else {
+			rt = NULL;
+			rtdst = pkb2ip(pkb)->ip_dst;
+			if (rt_input(pkb) < 0)
+				continue;
+			rt = pkb->pk_rtdst;
+		}
+		/* Is this packet sent to us? */
+		if (rt->rt_flags & RT_LOCALHOST) {
+			ip_ntoh(pkb2ip(pkb));
+			ip_recv_local(pkb, &tcp_list, &udp_list);
+		} else {
+			ip_forward(pkb);
+		}
+	}
+	if (!list_empty(&udp_list))
+		udp_in_list(&udp_list);
+	if (!list_empty(&tcp_list))
+		tcp_in_list(&tcp_list);
 }
 
+void ip_in(struct netdev *dev, struct pkbuf *pkb)
+{
+	LIST_HEAD(list);
+
+	list_add_tail(&pkb->pk_list, &list);
+	ip_in_list(dev, &list);
+}
@@ -2,6 +2,8 @@
 #include "ether.h"
 #include "arp.h"
 #include "ip.h"
+#include "tcp.h"
+#include "udp.h"
 #include "raw.h"
 #include "icmp.h"
 #include "route.h"
@@ -9,14 +11,13 @@
 
 void ip_send_dev(struct netdev *dev, struct pkbuf *pkb)
 {
-	struct arpentry *ae;
-	unsigned int dst;
+	unsigned int dst, arpgen;
 	struct rtentry *rt = pkb->pk_rtdst;
+	unsigned char hwaddr[ETH_ALEN];
 
 	if (rt->rt_flags & RT_LOCALHOST) {
 		ipdbg("To loopback");
-		netdev_tx(dev, pkb, pkb->pk_len - ETH_HRD_SZ,
-					ETH_P_IP, dev->net_hwaddr);
+		netdev_tx(dev, pkb, ETH_P_IP, dev->net_hwaddr);
 		return;
 	}
 
@@ -26,59 +27,72 @@ void ip_send_dev(struct netdev *dev, struct pkbuf *pkb)
 	else
 		dst = pkb2ip(pkb)->ip_dst;
 
-	ae = arp_lookup(ETH_P_IP, dst);
-	if (!ae) {
-		arpdbg("not found arp cache");
-		ae = arp_alloc();
-		if (!ae) {
-			ipdbg("arp cache is full");
-			free_pkb(pkb);
-			return;
-		}
-		ae->ae_ipaddr = dst;
-		ae->ae_dev = dev;
-		list_add_tail(&pkb->pk_list, &ae->ae_list);
-		arp_request(ae);
-	} else if (ae->ae_state == ARP_WAITING) {
-		arpdbg("arp entry is waiting");
-		list_add_tail(&pkb->pk_list, &ae->ae_list);
-	} else {
-		netdev_tx(dev, pkb, pkb->pk_len - ETH_HRD_SZ,
-				ETH_P_IP, ae->ae_hwaddr);
+	if (dst_hwaddr(pkb2ip(pkb)->ip_dst, rt, hwaddr) == 0) {
+		netdev_tx(dev, pkb, ETH_P_IP, hwaddr);
+		return;
+	}
+	arpgen = __atomic_load_n(&arp_genid, __ATOMIC_ACQUIRE);
+	/* otherwise pkb waits in arp cache for the reply */
+	if (arp_resolve(dev, dst, pkb, hwaddr) == 0) {
+		dst_set_hwaddr(pkb2ip(pkb)->ip_dst, rt, hwaddr, arpgen);
+		netdev_tx(dev, pkb, ETH_P_IP, hwaddr);
 	}
 }
 
+/* fill in tcp/udp checksum left to the device */
+static void ip_l4_checksum(struct pkbuf *pkb)
+{
+	struct ip *iphdr = pkb2ip(pkb);
+
+	if (iphdr->ip_pro == IP_P_TCP)
+		tcp_set_checksum(iphdr, ip2tcp(iphdr));
+	else if (iphdr->ip_pro == IP_P_UDP)
+		udp_set_checksum(iphdr, ip2udp(iphdr));
+	pkb->pk_csum = PKB_CSUM_NONE;
+}
+
 /* Assert pkb is net-order & pkb->pk_pro == ETH_P_IP */
 void ip_send_out(struct pkbuf *pkb)
 {
 	struct ip *iphdr = pkb2ip(pkb);
+	struct netdev *dev;
 	pkb->pk_pro = ETH_P_IP;
 	if (!pkb->pk_rtdst && rt_output(pkb) < 0) {
 		free_pkb(pkb);
 		return;
 	}
-	ip_set_checksum(iphdr);
+	dev = pkb->pk_rtdst->rt_dev;
+	/* rx verdict of a reused pkbuf says nothing about what is sent */
+	if (pkb->pk_csum == PKB_CSUM_UNNECESSARY)
+		pkb->pk_csum = PKB_CSUM_NONE;
+	if (!(dev->net_features & NETIF_F_TX_IP_CSUM))
+		ip_set_checksum(iphdr);
 	ipdbg(IPFMT " -> " IPFMT "(%d/%d bytes)",
 			ipfmt(iphdr->ip_src), ipfmt(iphdr->ip_dst),
 			iphlen(iphdr), _ntohs(iphdr->ip_len));
-	/* ip fragment */
-	if (_ntohs(iphdr->ip_len) > pkb->pk_rtdst->rt_dev->net_mtu)
-		ip_send_frag(pkb->pk_rtdst->rt_dev, pkb);
-	else
-		ip_send_dev(pkb->pk_rtdst->rt_dev, pkb);
+	/* ip fragment, gso segments are split by tcp header at device */
+	if (!pkb->pk_gso_size && _ntohs(iphdr->ip_len) > dev->net_mtu) {
+		/* device cannot checksum l4 data spread over fragments */
+		if (pkb->pk_csum == PKB_CSUM_PARTIAL)
+			ip_l4_checksum(pkb);
+		ip_send_frag(dev, pkb);
+	} else {
+		ip_send_dev(dev, pkb);
+	}
 }
 
 static unsigned short ipid = 0;
-void ip_send_info(struct pkbuf *pkb, unsigned char tos, unsigned short len,
+/* Assert pkb->pk_data is L4 data, which ip header is prepended before */
+void ip_send_info(struct pkbuf *pkb, unsigned char tos,
 		unsigned char ttl, unsigned char pro, unsigned int dst)
 {
-	struct ip *iphdr = pkb2ip(pkb);
+	struct ip *iphdr = pkb_push_ip(pkb);
 	/* fill header information */
 	iphdr->ip_ver = IP_VERSION_4;
 	iphdr->ip_hlen = IP_HRD_SZ / 4;
 	iphdr->ip_tos = tos;
-	iphdr->ip_len = _htons(len);
-	iphdr->ip_id = _htons(ipid++);
+	iphdr->ip_len = _htons(pkb->pk_len);
+	iphdr->ip_id = _htons(__atomic_fetch_add(&ipid, 1, __ATOMIC_RELAXED));
 	iphdr->ip_fragoff = 0;
 	iphdr->ip_ttl = ttl;
 	iphdr->ip_pro = pro;
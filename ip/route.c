@@ -7,16 +7,31 @@
 
 #include "netcfg.h"
 
+/*
+ * rt_head keeps all routes in netmask descend-order for the control path,
+ * lookups go to the lpm table without taking rt_mutex.
+ */
 static LIST_HEAD(rt_head);
+static struct rt_lpm *rt_table;
+static pthread_mutex_t rt_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int rt_genid = 1;
 
 struct rtentry *rt_lookup(unsigned int ipaddr)
 {
-	struct rtentry *rt;
-	/* FIXME: lock found route entry, which may be deleted */
-	list_for_each_entry(rt, &rt_head, rt_list) {
-		if ((rt->rt_netmask & ipaddr) ==
-			(rt->rt_netmask & rt->rt_net))
-			return rt;
+	if (!rt_table)
+		return NULL;
+	return lpm_lookup(rt_table, ipaddr);
+}
+
+/* route which takes over @rt's prefix: first one covering it in rt_head */
+static struct rtentry *rt_cover(struct rtentry *rt)
+{
+	struct rtentry *rte;
+
+	list_for_each_entry(rte, &rt_head, rt_list) {
+		if (lpm_depth(rte->rt_netmask) <= lpm_depth(rt->rt_netmask) &&
+			((rte->rt_net ^ rt->rt_net) & rte->rt_netmask) == 0)
+			return rte;
 	}
 	return NULL;
 }
@@ -24,14 +39,19 @@ struct rtentry *rt_lookup(unsigned int ipaddr)
 void rt_delete(unsigned int ip, unsigned int mask)
 {
 	struct rtentry *rt;
-	/* FIXME: lock found route entry, which may be deleted */
+
+	pthread_mutex_lock(&rt_mutex);
 	list_for_each_entry(rt, &rt_head, rt_list) {
 		if ((rt->rt_netmask == mask) && (rt->rt_net == ip))
 		{
 			list_del(&rt->rt_list);
-			return;
+			lpm_delete(rt_table, rt, rt_cover(rt));
+			__atomic_add_fetch(&rt_genid, 1, __ATOMIC_RELEASE);
+			/* FIXME: not freed, sockets and packets may still hold it */
+			break;
 		}
 	}
+	pthread_mutex_unlock(&rt_mutex);
 }
 
 struct rtentry *rt_alloc(unsigned int net, unsigned int netmask,
@@ -56,6 +76,15 @@ void rt_add(unsigned int net, unsigned int netmask, unsigned int gw,
 	struct list_head *l;
 
 	rt = rt_alloc(net, netmask, gw, metric, flags, dev);
+	pthread_mutex_lock(&rt_mutex);
+	if (!rt_table)
+		rt_table = lpm_alloc();
+	if (lpm_add(rt_table, rt) < 0) {
+		pthread_mutex_unlock(&rt_mutex);
+		ferr("route table is full\n");
+		free(rt);
+		return;
+	}
 	/* insert according to netmask descend-order */
 	l = &rt_head;
 	list_for_each_entry(rte, &rt_head, rt_list) {
@@ -66,6 +95,8 @@ void rt_add(unsigned int net, unsigned int netmask, unsigned int gw,
 	}
 	/* if not found or the list is empty, insert to prev of head*/
 	list_add_tail(&rt->rt_list, l);
+	__atomic_add_fetch(&rt_genid, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rt_mutex);
 }
 
 void rt_init(void)
@@ -85,11 +116,11 @@ void rt_init(void)
 	dbg("route table init");
 }
 
-/* Assert pkb is host-order */
+/* Assert pkb is net-order */
 int rt_input(struct pkbuf *pkb)
 {
 	struct ip *iphdr = pkb2ip(pkb);
-	struct rtentry *rt = rt_lookup(iphdr->ip_dst);
+	struct rtentry *rt = dst_route(iphdr->ip_dst);
 	if (!rt) {
 #ifndef CONFIG_TOP1
 		/*
@@ -100,7 +131,6 @@ int rt_input(struct pkbuf *pkb)
 		 * Destination Unreachable, Code 0 (Network Unreachable) ICMP
 		 * message.
 		 */
-		ip_hton(iphdr);
 		icmp_send(ICMP_T_DESTUNREACH, ICMP_NET_UNREACH, 0, pkb);
 #endif
 		free_pkb(pkb);
@@ -114,7 +144,7 @@ int rt_input(struct pkbuf *pkb)
 int rt_output(struct pkbuf *pkb)
 {
 	struct ip *iphdr = pkb2ip(pkb);
-	struct rtentry *rt = rt_lookup(iphdr->ip_dst);
+	struct rtentry *rt = dst_route(iphdr->ip_dst);
 	if (!rt) {
 		/* FIXME: icmp dest unreachable to localhost */
 		ipdbg("No route entry to "IPFMT, ipfmt(iphdr->ip_dst));
@@ -131,8 +161,11 @@ void rt_traverse(void)
 {
 	struct rtentry *rt;
 
-	if (list_empty(&rt_head))
+	pthread_mutex_lock(&rt_mutex);
+	if (list_empty(&rt_head)) {
+		pthread_mutex_unlock(&rt_mutex);
 		return;
+	}
 	printf("Destination     Gateway         Genmask         Metric Iface\n");
 	list_for_each_entry(rt, &rt_head, rt_list) {
 		if (rt->rt_flags & RT_LOCALHOST)
@@ -149,5 +182,6 @@ void rt_traverse(void)
 		printf("%-7d", rt->rt_metric);
 		printf("%s\n", rt->rt_dev->net_name);
 	}
+	pthread_mutex_unlock(&rt_mutex);
 }
 
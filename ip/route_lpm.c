@@ -0,0 +1,310 @@
+/*
+ *  DIR-24-8 longest prefix match table:
+ *    tbl24 is indexed by the top 24 bits of the address. Prefixes longer
+ *    than /24 hang a 256-entry tbl8 group off their tbl24 entry, indexed
+ *    by the last byte. So a lookup is one or two memory reads.
+ *
+ *  Writers are serialized by the caller. Readers take no lock: tbl8 groups
+ *  are filled before they are linked and entries are published with
+ *  release stores, so a reader sees the old or the new route, never a
+ *  half-made one.
+ */
+#include <sys/mman.h>
+#include "lib.h"
+#include "ip.h"
+#include "route.h"
+
+#define LPM_TBL24_NR	(1 << 24)
+#define LPM_TBL8_SZ	256
+
+/* table entry: valid | ext | depth(6 bits) | route or tbl8 group index */
+#define LPM_E_VALID	0x80000000
+#define LPM_E_EXT	0x40000000
+#define LPM_E(idx, depth)	(LPM_E_VALID | (depth) << 24 | (idx))
+#define LPM_E_DEPTH(e)	(((e) >> 24) & 0x3f)
+#define LPM_E_IDX(e)	((e) & 0xffffff)
+
+#define LPM_ROUTE_CHUNK	65536	/* route pointers per chunk */
+#define LPM_GROUP_CHUNK	256	/* tbl8 groups per chunk */
+#define LPM_ROUTE_MAX	(LPM_ROUTE_CHUNKS * LPM_ROUTE_CHUNK)
+#define LPM_GROUP_MAX	(LPM_GROUP_CHUNKS * LPM_GROUP_CHUNK)
+/*
+ * released route indexes and groups wait behind this many others before
+ * reuse, so a reader that loaded one before its release is long done
+ */
+#define LPM_FREE_DELAY	64
+
+#define lpm_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define lpm_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+
+static _inline unsigned int *lpm_group(struct rt_lpm *lpm, unsigned int g)
+{
+	return lpm->tbl8[g / LPM_GROUP_CHUNK] + (g % LPM_GROUP_CHUNK) * LPM_TBL8_SZ;
+}
+
+static _inline struct rtentry *lpm_route(struct rt_lpm *lpm, unsigned int idx)
+{
+	return lpm_load(&lpm->routes[idx / LPM_ROUTE_CHUNK][idx % LPM_ROUTE_CHUNK]);
+}
+
+static _inline unsigned int lpm_mask(int depth)
+{
+	return depth ? ~0U << (32 - depth) : 0;
+}
+
+int lpm_depth(unsigned int netmask)
+{
+	return __builtin_popcount(netmask);
+}
+
+struct rt_lpm *lpm_alloc(void)
+{
+	struct rt_lpm *lpm = xzalloc(sizeof(*lpm));
+
+	/* 64MB, only pages covered by routes are ever touched */
+	lpm->tbl24 = mmap(NULL, LPM_TBL24_NR * sizeof(unsigned int),
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (lpm->tbl24 == MAP_FAILED)
+		perrx("mmap lpm tbl24");
+	return lpm;
+}
+
+/* Assert no reader is left: routes themselves belong to the caller */
+void lpm_free(struct rt_lpm *lpm)
+{
+	int i;
+
+	munmap(lpm->tbl24, LPM_TBL24_NR * sizeof(unsigned int));
+	for (i = 0; i < LPM_GROUP_CHUNKS; i++)
+		free(lpm->tbl8[i]);
+	for (i = 0; i < LPM_ROUTE_CHUNKS; i++)
+		free(lpm->routes[i]);
+	free(lpm->route_free.idx);
+	free(lpm->group_free.idx);
+	free(lpm);
+}
+
+static void lpm_free_put(struct lpm_free *f, unsigned int idx)
+{
+	unsigned int *nidx, i;
+
+	if (f->tail - f->head == f->size) {
+		nidx = xmalloc((f->size ? f->size * 2 : 64) * sizeof(unsigned int));
+		for (i = 0; i < f->size; i++)
+			nidx[i] = f->idx[(f->head + i) & (f->size - 1)];
+		free(f->idx);
+		f->idx = nidx;
+		f->head = 0;
+		f->tail = f->size;
+		f->size = f->size ? f->size * 2 : 64;
+	}
+	f->idx[f->tail++ & (f->size - 1)] = idx;
+}
+
+/* oldest released index, -1 while it has not waited long enough */
+static int lpm_free_get(struct lpm_free *f)
+{
+	if (f->tail - f->head <= LPM_FREE_DELAY)
+		return -1;
+	return f->idx[f->head++ & (f->size - 1)];
+}
+
+static int lpm_route_alloc(struct rt_lpm *lpm, struct rtentry *rt)
+{
+	int idx = lpm_free_get(&lpm->route_free);
+
+	if (idx < 0) {
+		if (lpm->route_nr >= LPM_ROUTE_MAX)
+			return -1;
+		idx = lpm->route_nr++;
+		if (!lpm->routes[idx / LPM_ROUTE_CHUNK])
+			lpm->routes[idx / LPM_ROUTE_CHUNK] = xmalloc(
+				LPM_ROUTE_CHUNK * sizeof(struct rtentry *));
+	}
+	/* a reader late on the old route checks the prefix of what it gets */
+	lpm_store(&lpm->routes[idx / LPM_ROUTE_CHUNK][idx % LPM_ROUTE_CHUNK],
+			rt);
+	rt->rt_lpm_idx = idx;
+	return idx;
+}
+
+static int lpm_group_alloc(struct rt_lpm *lpm)
+{
+	int g = lpm_free_get(&lpm->group_free);
+
+	if (g < 0) {
+		if (lpm->group_nr >= LPM_GROUP_MAX)
+			return -1;
+		g = lpm->group_nr;
+		if (!lpm->tbl8[g / LPM_GROUP_CHUNK])
+			lpm->tbl8[g / LPM_GROUP_CHUNK] = xmalloc(LPM_GROUP_CHUNK *
+					LPM_TBL8_SZ * sizeof(unsigned int));
+		lpm->group_nr++;
+	}
+	lpm->group_used++;
+	return g;
+}
+
+static void lpm_group_release(struct rt_lpm *lpm, unsigned int g)
+{
+	lpm_free_put(&lpm->group_free, g);
+	lpm->group_used--;
+}
+
+/* fold tbl8 group back into tbl24 if all of it is one /24-or-shorter route */
+static void lpm_group_collapse(struct rt_lpm *lpm, unsigned int i)
+{
+	unsigned int g = LPM_E_IDX(lpm->tbl24[i]);
+	unsigned int *group = lpm_group(lpm, g);
+	unsigned int e = group[0];
+	int j;
+
+	if ((e & LPM_E_VALID) && LPM_E_DEPTH(e) > 24)
+		return;
+	for (j = 1; j < LPM_TBL8_SZ; j++)
+		if (group[j] != e)
+			return;
+	lpm_store(&lpm->tbl24[i], e);
+	lpm_group_release(lpm, g);
+}
+
+/* set entries of [start, start + n) not covered by a longer prefix */
+static void lpm_fill(unsigned int *tbl, unsigned int start, unsigned int n,
+		unsigned int e)
+{
+	unsigned int i;
+
+	for (i = start; i < start + n; i++)
+		if (!(tbl[i] & LPM_E_VALID) ||
+			LPM_E_DEPTH(tbl[i]) <= LPM_E_DEPTH(e))
+			lpm_store(&tbl[i], e);
+}
+
+/* replace entries of [start, start + n) equal to @old */
+static void lpm_replace(unsigned int *tbl, unsigned int start, unsigned int n,
+		unsigned int old, unsigned int new)
+{
+	unsigned int i;
+
+	for (i = start; i < start + n; i++)
+		if (tbl[i] == old)
+			lpm_store(&tbl[i], new);
+}
+
+/* Assert rt->rt_netmask is contiguous, newer routes hide older equal ones */
+int lpm_add(struct rt_lpm *lpm, struct rtentry *rt)
+{
+	int depth = lpm_depth(rt->rt_netmask);
+	unsigned int key = _ntohl(rt->rt_net) & lpm_mask(depth);
+	unsigned int e, t, i, j;
+	int idx, g;
+
+	if (depth == 0) {
+		lpm_store(&lpm->def, rt);
+		return 0;
+	}
+	idx = lpm_route_alloc(lpm, rt);
+	if (idx < 0)
+		return -1;
+	e = LPM_E(idx, depth);
+
+	if (depth <= 24) {
+		for (i = key >> 8; i < (key >> 8) + (1 << (24 - depth)); i++) {
+			t = lpm->tbl24[i];
+			if (t & LPM_E_EXT)
+				lpm_fill(lpm_group(lpm, LPM_E_IDX(t)), 0,
+						LPM_TBL8_SZ, e);
+			else
+				lpm_fill(lpm->tbl24, i, 1, e);
+		}
+	} else {
+		i = key >> 8;
+		t = lpm->tbl24[i];
+		if (!(t & LPM_E_EXT)) {
+			g = lpm_group_alloc(lpm);
+			if (g < 0) {
+				/* never linked, no reader can know it */
+				lpm_free_put(&lpm->route_free, idx);
+				return -1;
+			}
+			/* the group inherits the /24-or-shorter route */
+			for (j = 0; j < LPM_TBL8_SZ; j++)
+				lpm_group(lpm, g)[j] = t;
+			lpm_store(&lpm->tbl24[i], LPM_E_EXT | g);
+			t = LPM_E_EXT | g;
+		}
+		lpm_fill(lpm_group(lpm, LPM_E_IDX(t)), key & 0xff,
+				1 << (32 - depth), e);
+	}
+	return 0;
+}
+
+/*
+ * @repl: the route now matching @rt's prefix, which is an equal older one
+ *        or the longest shorter one covering it, NULL for none.
+ * @rt's index is reused only after LPM_FREE_DELAY others are released.
+ */
+void lpm_delete(struct rt_lpm *lpm, struct rtentry *rt, struct rtentry *repl)
+{
+	int depth = lpm_depth(rt->rt_netmask);
+	unsigned int key = _ntohl(rt->rt_net) & lpm_mask(depth);
+	unsigned int old, new = 0;
+	unsigned int t, i;
+
+	if (depth == 0) {
+		if (lpm->def == rt)
+			lpm_store(&lpm->def, repl);
+		return;
+	}
+	old = LPM_E(rt->rt_lpm_idx, depth);
+	/* a default route is found in lpm->def, not in the table */
+	if (repl && repl->rt_netmask)
+		new = LPM_E(repl->rt_lpm_idx, lpm_depth(repl->rt_netmask));
+
+	if (depth <= 24) {
+		for (i = key >> 8; i < (key >> 8) + (1 << (24 - depth)); i++) {
+			t = lpm->tbl24[i];
+			if (t & LPM_E_EXT) {
+				lpm_replace(lpm_group(lpm, LPM_E_IDX(t)), 0,
+						LPM_TBL8_SZ, old, new);
+				lpm_group_collapse(lpm, i);
+			} else {
+				lpm_replace(lpm->tbl24, i, 1, old, new);
+			}
+		}
+	} else {
+		i = key >> 8;
+		t = lpm->tbl24[i];
+		if (t & LPM_E_EXT) {
+			lpm_replace(lpm_group(lpm, LPM_E_IDX(t)), key & 0xff,
+					1 << (32 - depth), old, new);
+			lpm_group_collapse(lpm, i);
+		}
+	}
+	lpm_free_put(&lpm->route_free, rt->rt_lpm_idx);
+}
+
+struct rtentry *lpm_lookup(struct rt_lpm *lpm, unsigned int ipaddr)
+{
+	unsigned int key = _ntohl(ipaddr);
+	struct rtentry *rt;
+	unsigned int e, t;
+
+	for (;;) {
+		e = t = lpm_load(&lpm->tbl24[key >> 8]);
+		if (t & LPM_E_EXT)
+			e = lpm_load(&lpm_group(lpm, LPM_E_IDX(t))[key & 0xff]);
+		if (!(e & LPM_E_VALID)) {
+			/* a miss in a reused group is no miss either */
+			if ((t & LPM_E_EXT) &&
+				lpm_load(&lpm->tbl24[key >> 8]) != t)
+				continue;
+			return lpm_load(&lpm->def);
+		}
+		rt = lpm_route(lpm, LPM_E_IDX(e));
+		/* tbl8 group released and reused under us: look again */
+		if (((ipaddr ^ rt->rt_net) & rt->rt_netmask) == 0)
+			return rt;
+	}
+}
@@ -4,25 +4,293 @@
 #include "udp.h"
 #include "tcp.h"
 
-static _inline unsigned int sum(unsigned short *data, int size,
-		unsigned int origsum)
+#if defined(__x86_64__) || defined(__i386__)
+#define CSUM_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Partial internet checksum: the 16-bit one's complement sum of data
+ * added to @origsum, returned unfolded in 32 bits.
+ * 32-bit words are summed into a 64-bit accumulator, whose carries are
+ * folded back once at the end, which is equivalent to summing 16-bit words.
+ */
+static _inline unsigned int csum_fold32(unsigned long long sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return sum;
+}
+
+/* last (size < 4) bytes, copied to @dst if it is not NULL */
+static _inline unsigned long long csum_tail(unsigned char *dst,
+		const unsigned char *data, int size, unsigned long long sum)
 {
+	unsigned short w;
+
+	if (dst)
+		memcpy(dst, data, size);
 	while (size > 1) {
-		origsum += *data++;
+		memcpy(&w, data, 2);
+		sum += w;
+		data += 2;
 		size -= 2;
 	}
 	if (size)
-		origsum += _ntohs(((*(unsigned char *)data) & 0xff) << 8);
-	return origsum;
+		sum += _ntohs((*data & 0xff) << 8);
+	return sum;
+}
+
+/* reference: one 16-bit word per iteration */
+static unsigned int csum_word(const void *data, int size, unsigned int origsum)
+{
+	const unsigned short *p = data;
+	unsigned long long sum = origsum;
+
+	while (size > 1) {
+		sum += *p++;
+		size -= 2;
+	}
+	if (size)
+		sum += _ntohs(((*(unsigned char *)p) & 0xff) << 8);
+	return csum_fold32(sum);
+}
+
+static unsigned int csum_copy_word(void *dst, const void *src, int size,
+		unsigned int origsum)
+{
+	memcpy(dst, src, size);
+	return csum_word(dst, size, origsum);
+}
+
+static unsigned int csum_64(const void *data, int size, unsigned int origsum)
+{
+	const unsigned char *p = data;
+	unsigned long long sum = origsum;
+	unsigned long long v;
+	unsigned int w;
+
+	while (size >= 8) {
+		memcpy(&v, p, 8);
+		sum += v & 0xffffffff;
+		sum += v >> 32;
+		p += 8;
+		size -= 8;
+	}
+	if (size >= 4) {
+		memcpy(&w, p, 4);
+		sum += w;
+		p += 4;
+		size -= 4;
+	}
+	return csum_fold32(csum_tail(NULL, p, size, sum));
+}
+
+static unsigned int csum_copy_64(void *dst, const void *src, int size,
+		unsigned int origsum)
+{
+	const unsigned char *p = src;
+	unsigned char *d = dst;
+	unsigned long long sum = origsum;
+	unsigned long long v;
+	unsigned int w;
+
+	while (size >= 8) {
+		memcpy(&v, p, 8);
+		memcpy(d, &v, 8);
+		sum += v & 0xffffffff;
+		sum += v >> 32;
+		p += 8;
+		d += 8;
+		size -= 8;
+	}
+	if (size >= 4) {
+		memcpy(&w, p, 4);
+		memcpy(d, &w, 4);
+		sum += w;
+		p += 4;
+		d += 4;
+		size -= 4;
+	}
+	return csum_fold32(csum_tail(d, p, size, sum));
+}
+
+#ifdef CSUM_X86
+/* shorter data(e.g. headers) is not worth the vector setup and reduction */
+#define CSUM_VEC_MIN	64
+
+/* 32-bit lanes are widened to 64-bit lanes, so the vector sums never wrap */
+__attribute__((target("sse2")))
+static unsigned int csum_sse2(const void *data, int size, unsigned int origsum)
+{
+	const unsigned char *p = data;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	__m128i v;
+	unsigned long long lane[2];
+
+	if (size < CSUM_VEC_MIN)
+		return csum_64(data, size, origsum);
+	while (size >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		p += 16;
+		size -= 16;
+	}
+	_mm_storeu_si128((__m128i *)lane, acc);
+	return csum_64(p, size, csum_fold32((unsigned long long)origsum +
+				csum_fold32(lane[0]) + csum_fold32(lane[1])));
+}
+
+__attribute__((target("sse2")))
+static unsigned int csum_copy_sse2(void *dst, const void *src, int size,
+		unsigned int origsum)
+{
+	const unsigned char *p = src;
+	unsigned char *d = dst;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	__m128i v;
+	unsigned long long lane[2];
+
+	if (size < CSUM_VEC_MIN)
+		return csum_copy_64(dst, src, size, origsum);
+	while (size >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		_mm_storeu_si128((__m128i *)d, v);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		p += 16;
+		d += 16;
+		size -= 16;
+	}
+	_mm_storeu_si128((__m128i *)lane, acc);
+	return csum_copy_64(d, p, size, csum_fold32((unsigned long long)origsum +
+				csum_fold32(lane[0]) + csum_fold32(lane[1])));
+}
+
+__attribute__((target("avx2")))
+static unsigned int csum_avx2(const void *data, int size, unsigned int origsum)
+{
+	const unsigned char *p = data;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	__m256i v0, v1;
+	unsigned long long lane[4];
+
+	/* two independent accumulators keep both vector adders busy */
+	if (size < CSUM_VEC_MIN)
+		return csum_64(data, size, origsum);
+	while (size >= 64) {
+		v0 = _mm256_loadu_si256((const __m256i *)p);
+		v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+		p += 64;
+		size -= 64;
+	}
+	_mm256_storeu_si256((__m256i *)lane, _mm256_add_epi64(acc0, acc1));
+	return csum_64(p, size, csum_fold32((unsigned long long)origsum +
+				csum_fold32(lane[0]) + csum_fold32(lane[1]) +
+				csum_fold32(lane[2]) + csum_fold32(lane[3])));
+}
+
+__attribute__((target("avx2")))
+static unsigned int csum_copy_avx2(void *dst, const void *src, int size,
+		unsigned int origsum)
+{
+	const unsigned char *p = src;
+	unsigned char *d = dst;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	__m256i v0, v1;
+	unsigned long long lane[4];
+
+	if (size < CSUM_VEC_MIN)
+		return csum_copy_64(dst, src, size, origsum);
+	while (size >= 64) {
+		v0 = _mm256_loadu_si256((const __m256i *)p);
+		v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		_mm256_storeu_si256((__m256i *)d, v0);
+		_mm256_storeu_si256((__m256i *)(d + 32), v1);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+		p += 64;
+		d += 64;
+		size -= 64;
+	}
+	_mm256_storeu_si256((__m256i *)lane, _mm256_add_epi64(acc0, acc1));
+	return csum_copy_64(d, p, size, csum_fold32((unsigned long long)origsum +
+				csum_fold32(lane[0]) + csum_fold32(lane[1]) +
+				csum_fold32(lane[2]) + csum_fold32(lane[3])));
+}
+
+static int csum_has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int csum_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif	/* CSUM_X86 */
+
+/* slowest first: checksum_init() picks the last usable one */
+struct csum_impl csum_impls[] = {
+	{ "word", csum_word, csum_copy_word, NULL },
+	{ "64bit", csum_64, csum_copy_64, NULL },
+#ifdef CSUM_X86
+	{ "sse2", csum_sse2, csum_copy_sse2, csum_has_sse2 },
+	{ "avx2", csum_avx2, csum_copy_avx2, csum_has_avx2 },
+#endif
+	{ NULL, NULL, NULL, NULL }
+};
+
+/* usable before checksum_init() too */
+static struct csum_impl *csum_cur = &csum_impls[1];
+
+void checksum_init(void)
+{
+	struct csum_impl *impl;
+
+#ifdef CSUM_X86
+	__builtin_cpu_init();
+#endif
+	for (impl = csum_impls; impl->name; impl++)
+		if (!impl->usable || impl->usable())
+			csum_cur = impl;
+	dbg("checksum: %s", csum_cur->name);
+}
+
+unsigned int csum_partial(const void *data, int size, unsigned int sum)
+{
+	return csum_cur->csum(data, size, sum);
+}
+
+/* copy @size bytes from @src to @dst and sum them on the way */
+unsigned int csum_partial_copy(void *dst, const void *src, int size,
+		unsigned int sum)
+{
+	return csum_cur->csum_copy(dst, src, size, sum);
+}
+
+static _inline unsigned short csum_fold(unsigned int sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (~sum & 0xffff);
 }
 
 static _inline unsigned short checksum(unsigned short *data, int size,
 					unsigned int origsum)
 {
-	origsum = sum(data, size, origsum);
-	origsum = (origsum & 0xffff) + (origsum >> 16);
-	origsum = (origsum & 0xffff) + (origsum >> 16);
-	return (~origsum & 0xffff);
+	return csum_fold(csum_partial(data, size, origsum));
 }
 
 unsigned short ip_chksum(unsigned short *data, int size)
@@ -38,13 +306,13 @@ unsigned short icmp_chksum(unsigned short *data, int size)
 static _inline unsigned short tcp_udp_chksum(unsigned int src, unsigned int dst,
 		unsigned short proto, unsigned short len, unsigned short *data)
 {
-	unsigned int sum;
+	unsigned long long sum;
 	/* caculate sum of tcp pseudo header */
 	sum = _htons(proto) + _htons(len);
 	sum += src;	/* checksum will move high short to low short */
-	sum += dst;
+	sum += dst;	/* 64 bits: src + dst must not lose its carry */
 	/* caculate sum of tcp data(tcp head and data) */
-	return checksum(data, len, sum);
+	return checksum(data, len, csum_fold32(sum));
 }
 
 unsigned short tcp_chksum(unsigned int src, unsigned int dst,
@@ -80,6 +348,26 @@ void tcp_set_checksum(struct ip *iphdr, struct tcp *tcphdr)
 		IP_P_TCP, ipndlen(iphdr), (unsigned short *)tcphdr);
 }
 
+/* @textsum: csum_partial() of the text after tcp header, 0 if not known */
+void tcp_set_checksum_text(struct ip *iphdr, struct tcp *tcphdr,
+		unsigned int textsum)
+{
+	unsigned short len = ipndlen(iphdr);
+	unsigned long long sum;
+
+	if (!textsum) {
+		tcp_set_checksum(iphdr, tcphdr);
+		return;
+	}
+	tcphdr->checksum = 0;
+	sum = _htons(IP_P_TCP) + _htons(len);
+	sum += iphdr->ip_src;
+	sum += iphdr->ip_dst;
+	/* header length is a multiple of 4: text sum keeps its byte order */
+	sum = csum_partial(tcphdr, tcphdr->doff * 4, csum_fold32(sum));
+	tcphdr->checksum = csum_fold(csum_fold32(sum + textsum));
+}
+
 void ip_set_checksum(struct ip *iphdr)
 {
 	iphdr->ip_cksum = 0;
@@ -0,0 +1,104 @@
+/*
+ * Epoch based reclamation:
+ *  Each reader thread publishes the global epoch it entered in, in a
+ *  record of its own, so entering writes no shared cache line.
+ *  epoch_safe() advances the global epoch and returns the oldest epoch
+ *  a reader is still in: nothing stamped before it can be reached.
+ */
+#include "lib.h"
+#include "list.h"
+#include "epoch.h"
+
+struct epoch_reader {
+	unsigned long epoch;		/* entered in, 0 while outside */
+	int depth;			/* nested epoch_enter() */
+	struct list_head list;		/* node of epoch_readers */
+} __attribute__((aligned(64)));
+
+static unsigned long epoch_now = 1;
+static LIST_HEAD(epoch_readers);
+static pthread_mutex_t epoch_readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_reader_key;
+static pthread_once_t epoch_reader_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_reader *epoch_treader;
+
+/* thread exit: it is outside for good */
+static void epoch_reader_release(void *arg)
+{
+	struct epoch_reader *r = arg;
+
+	pthread_mutex_lock(&epoch_readers_mutex);
+	list_del(&r->list);
+	pthread_mutex_unlock(&epoch_readers_mutex);
+	free(r);
+}
+
+static void epoch_reader_key_init(void)
+{
+	if (pthread_key_create(&epoch_reader_key, epoch_reader_release))
+		perrx("pthread_key_create");
+}
+
+static struct epoch_reader *epoch_reader_create(void)
+{
+	struct epoch_reader *r;
+
+	pthread_once(&epoch_reader_once, epoch_reader_key_init);
+	/* records of different threads must not share a cache line */
+	if (posix_memalign((void **)&r, sizeof(*r), sizeof(*r)))
+		perrx("posix_memalign");
+	r->epoch = 0;
+	r->depth = 0;
+	pthread_mutex_lock(&epoch_readers_mutex);
+	list_add_tail(&r->list, &epoch_readers);
+	pthread_mutex_unlock(&epoch_readers_mutex);
+	pthread_setspecific(epoch_reader_key, r);
+	epoch_treader = r;
+	return r;
+}
+
+void epoch_enter(void)
+{
+	struct epoch_reader *r = epoch_treader;
+
+	if (!r)
+		r = epoch_reader_create();
+	if (r->depth++)
+		return;
+	__atomic_store_n(&r->epoch,
+		__atomic_load_n(&epoch_now, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	/* published before any shared pointer is read */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+	struct epoch_reader *r = epoch_treader;
+
+	if (--r->depth == 0)
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* stamp for an object just unlinked: read after the unlink is visible */
+unsigned long epoch_stamp(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&epoch_now, __ATOMIC_RELAXED);
+}
+
+/* objects stamped below the returned epoch can be freed */
+unsigned long epoch_safe(void)
+{
+	struct epoch_reader *r;
+	unsigned long safe, e;
+
+	safe = __atomic_add_fetch(&epoch_now, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&epoch_readers_mutex);
+	list_for_each_entry(r, &epoch_readers, list) {
+		e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (e && e < safe)
+			safe = e;
+	}
+	pthread_mutex_unlock(&epoch_readers_mutex);
+	return safe;
+}
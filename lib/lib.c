@@ -1,5 +1,6 @@
 #include "lib.h"
 #include "ip.h"
+#include <time.h>
 
 void perrx(char *str)
 {
@@ -26,6 +27,24 @@ void *xzalloc(int size)
 	return p;
 }
 
+/* secret material for hash seeds, never fails */
+void get_random_bytes(void *buf, int len)
+{
+	int fd, n = 0;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, buf, len);
+		close(fd);
+		if (n < 0)
+			n = 0;
+	}
+	/* last resort: weak, but still differs from run to run */
+	for (; n < len; n++)
+		((unsigned char *)buf)[n] = (getpid() ^ time(NULL) ^
+				(unsigned long)buf >> n) >> (n % 4 * 8);
+}
+
 /* format and print mlen-max-size data (spaces will fill the buf) */
 static char *_space = "                                              ";
 void printfs(int mlen, const char *fmt, ...)
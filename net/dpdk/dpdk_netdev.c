@@ -47,6 +47,7 @@
 #include <rte_mbuf.h>
 #include <rte_ip.h>
 #include <rte_udp.h>
+#include <rte_tcp.h>
 
 #if RTE_VER_RELEASE < 18
 	// for compatibility
@@ -56,6 +57,7 @@
 	#define rte_ipv4_hdr ipv4_hdr
 	#define RTE_IPV4 IPv4
 	#define rte_udp_hdr udp_hdr
+	#define rte_tcp_hdr tcp_hdr
 	#define RTE_ETHER_TYPE_IPV4 ETHER_TYPE_IPv4
 #endif
 
@@ -82,12 +84,24 @@ struct ethernet_rx_t
 	// for stats
 	uint64_t pktcount;
 	uint64_t bytes;
+	uint64_t copied;	// frames copied instead of wrapped (mempool low or chained mbuf)
 };
 
+// Received mbufs are handed to the stack without copy, and stay out of the
+// mempool until the stack drops them. Below this many free mbufs, frames are
+// copied so that sockets holding packets cannot starve the rx queue.
+#define RX_ZEROCOPY_MIN_FREE_MBUFS	1024
+
+#define TX_RING_BATCH	32
+
 struct ethernet_tx_t
 {
 	struct rte_eth_dev_tx_buffer* tx_buffer;
-    struct rte_ring* tx_ring;
+	struct rte_ring* tx_ring;	// frames sent by threads other than the owner lcore
+	// pipeline mode: frames the owner lcore sent during this burst, put on
+	// tx_ring with one enqueue at the end of the burst
+	struct rte_mbuf* pending[TX_RING_BATCH];
+	uint16_t nb_pending;
 	struct rte_ether_addr target_mac;
 	uint32_t payload_length;
 	// for stats
@@ -96,6 +110,35 @@ struct ethernet_tx_t
 	uint64_t dropped;	// failure
 };
 
+#define DPDK_MAX_QUEUES	16
+
+// One rx/tx queue pair of the port, owned by one worker lcore: only that
+// lcore polls the rx queue and touches the NIC tx queue. RSS keeps each
+// flow on one queue, so its TCP/UDP processing stays on one lcore.
+struct dpdk_queue_t
+{
+	struct netdev* dev;
+	uint16_t queue_id;
+	unsigned int lcore_id;
+	struct ethernet_rx_t rx;
+	struct ethernet_tx_t tx;
+	struct netstats stats;	// not yet added to dev->net_stats
+};
+
+// queue owned by the current lcore, NULL on other threads
+static __thread struct dpdk_queue_t* cur_queue;
+
+enum dpdk_mode_t
+{
+	// each worker lcore sends on its own NIC tx queue, flushed after each burst
+	DPDK_MODE_RTC,
+	// workers hand frames over tx rings to one dedicated tx lcore
+	DPDK_MODE_PIPELINE,
+};
+
+// pipeline tx lcore drains the NIC tx buffers at least this often
+#define BURST_TX_DRAIN_US	100
+
 struct stat_reporter_t
 {
 	uint64_t last_pktcount;
@@ -112,8 +155,9 @@ enum operation_mode_t
 
 struct ethernet_rw_t
 {
-	struct ethernet_rx_t rx;
-	struct ethernet_tx_t tx;
+	enum dpdk_mode_t mode;
+	uint16_t nb_queues;
+	struct dpdk_queue_t queues[DPDK_MAX_QUEUES];
 	struct stat_reporter_t stat;
 	enum operation_mode_t op;
 	volatile int exit;	// signal handler sets it to 1
@@ -137,7 +181,6 @@ void create_udp_packet(struct rte_mbuf* m,
 					uint32_t src_ip,
 					uint16_t src_port,
 					uint16_t payload_length);
-int ethernet_tx_loop(void* arg);
 void ethernet_rw_init(struct ethernet_rw_t* rw);
 bool string_to_mac(const char* s, struct rte_ether_addr* mac);
 void* stat_thread(void* arg);
@@ -197,39 +240,6 @@ void stat_show(struct stat_reporter_t* stat, uint64_t pktcount, uint64_t bytes,
 }
 
 
-int ethernet_tx_loop(void* arg)
-{
-	printf("TX loop\n");
-
-	struct ethernet_rw_t* rw = arg;
-	struct ethernet_tx_t* tx = &rw->tx;
-	
-	while (!rw->exit)
-	{
-		// construct a few packets
-		// send it
-		struct rte_mbuf* m;
-        if (rte_ring_dequeue(tx->tx_ring, (void**)&m) == 0)
-        {
-            uint16_t ret;
-            ret = rte_eth_tx_buffer(rw->worker_port_id,
-                            0,
-                            rw->tx.tx_buffer,
-                            m);
-
-            tx->pktcount += ret;
-            tx->bytes += ret * m->data_len;
-        }
-		else
-        {
-            // flush
-            rte_eth_tx_buffer_flush(rw->worker_port_id, 0, rw->tx.tx_buffer);
-			usleep(50);
-        }
-	}
-	return 0;
-}
-
 void ethernet_rw_init(struct ethernet_rw_t* rw)
 {
 	const int NB_MBUFS = 8192;
@@ -249,10 +259,19 @@ void ethernet_rw_init(struct ethernet_rw_t* rw)
 	};
 
 	int ret;
+	uint16_t q;
+	char name[RTE_RING_NAMESIZE];
 
-	// init mempool
+	// get dev info
+	rte_eth_dev_info_get(rw->worker_port_id, &rw->dev_info);
+	if (rw->nb_queues > rw->dev_info.max_rx_queues)
+		rw->nb_queues = rw->dev_info.max_rx_queues;
+	if (rw->nb_queues > rw->dev_info.max_tx_queues)
+		rw->nb_queues = rw->dev_info.max_tx_queues;
+
+	// init mempool, each rx queue keeps nb_rxd mbufs posted
 	rw->mempool = rte_pktmbuf_pool_create("mbuf_pool", 
-										NB_MBUFS, 
+										NB_MBUFS * rw->nb_queues,
 										MEMPOOL_CACHE_SIZE,
 										0, 
 										RTE_MBUF_DEFAULT_BUF_SIZE,
@@ -260,12 +279,6 @@ void ethernet_rw_init(struct ethernet_rw_t* rw)
 	if (rw->mempool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
 
-    // create the ring
-    rw->tx.tx_ring = rte_ring_create("tx_ring", 512, rw->worker_socket_id, RING_F_SC_DEQ);
-
-	// get dev info
-	rte_eth_dev_info_get(rw->worker_port_id, &rw->dev_info);
-
 	// dev configure
 	port_conf.txmode.offloads = rw->dev_info.tx_offload_capa;
 	port_conf.rxmode.offloads = rw->dev_info.default_rxconf.offloads;
@@ -273,12 +286,24 @@ void ethernet_rw_init(struct ethernet_rw_t* rw)
 	{
 		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;	
 	}
+	// let the NIC verify rx checksums, see dpdk_mbuf_to_pkb()
+	port_conf.rxmode.offloads |= (DEV_RX_OFFLOAD_IPV4_CKSUM | DEV_RX_OFFLOAD_TCP_CKSUM |
+			DEV_RX_OFFLOAD_UDP_CKSUM) & rw->dev_info.rx_offload_capa;
+	if (rw->nb_queues > 1)
+	{
+		// spread flows over the rx queues by their 5-tuple
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+		port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+		port_conf.rx_adv_conf.rss_conf.rss_hf = (ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) &
+				rw->dev_info.flow_type_rss_offloads;
+	}
 
-	printf("TX offloads %08lx, RX offloads %08lx\n", 
+	printf("TX offloads %08lx, RX offloads %08lx, %u queues\n", 
 			port_conf.txmode.offloads,
-			port_conf.rxmode.offloads);
+			port_conf.rxmode.offloads,
+			rw->nb_queues);
 
-	ret = rte_eth_dev_configure(rw->worker_port_id, 1, 1, &port_conf);
+	ret = rte_eth_dev_configure(rw->worker_port_id, rw->nb_queues, rw->nb_queues, &port_conf);
 	if (ret < 0)
 	rte_exit(EXIT_FAILURE, "Cannot configure device: err=%d, port=%d\n", 
 			ret,
@@ -295,49 +320,59 @@ void ethernet_rw_init(struct ethernet_rw_t* rw)
 	// enable promiscuous mode
 	rte_eth_promiscuous_enable(rw->worker_port_id);
 
-	// rx queue setup
-	struct ethernet_rx_t* rx = &rw->rx;
 	struct rte_eth_rxconf rxconf = rw->dev_info.default_rxconf;
 	rxconf.offloads = 0;
-
-	ret = rte_eth_rx_queue_setup(rw->worker_port_id,
-								0,
-								nb_rxd,
-								rw->worker_socket_id,
-								&rxconf,
-								rw->mempool);
-	if (ret < 0)
-		rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup failed: err=%d\n", ret);
-	rx->pktcount = 0;
-	struct ethernet_tx_t* tx = &rw->tx;
-
 	struct rte_eth_txconf txconf = rw->dev_info.default_txconf;
 	txconf.offloads = port_conf.txmode.offloads;
 
-	ret = rte_eth_tx_queue_setup(rw->worker_port_id, 
-								0, 
-								nb_txd, 
-								rw->worker_socket_id, 
-								&txconf);
-	if (ret < 0)
-		rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup: err=%d, port=%d\n",
-				ret, rw->worker_port_id);
-	
-	// init tx buffers
-	tx->tx_buffer = rte_zmalloc_socket("tx_buffer", 
-											RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST),
-											0,
-											rw->worker_socket_id);
-	if (tx->tx_buffer == NULL)
-		rte_exit(EXIT_FAILURE, "Failed to alloc tx buffer\n");
-	rte_eth_tx_buffer_init(tx->tx_buffer, MAX_PKT_BURST);
-	// stat for failure
-	ret = rte_eth_tx_buffer_set_err_callback(tx->tx_buffer,
-			rte_eth_tx_buffer_count_callback,
-			&tx->dropped);
-	if (ret < 0)
-		rte_exit(EXIT_FAILURE,
-				"Cannot set error callback for tx buffer on port\n");
+	for (q = 0; q < rw->nb_queues; q++)
+	{
+		struct dpdk_queue_t* queue = &rw->queues[q];
+		struct ethernet_tx_t* tx = &queue->tx;
+
+		queue->queue_id = q;
+
+		// rx queue setup
+		ret = rte_eth_rx_queue_setup(rw->worker_port_id,
+									q,
+									nb_rxd,
+									rw->worker_socket_id,
+									&rxconf,
+									rw->mempool);
+		if (ret < 0)
+			rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup failed: err=%d\n", ret);
+
+		ret = rte_eth_tx_queue_setup(rw->worker_port_id, 
+									q, 
+									nb_txd, 
+									rw->worker_socket_id, 
+									&txconf);
+		if (ret < 0)
+			rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup: err=%d, port=%d\n",
+					ret, rw->worker_port_id);
+
+		// any thread may enqueue, the owner lcore dequeues
+		snprintf(name, sizeof(name), "tx_ring_%u", q);
+		tx->tx_ring = rte_ring_create(name, 512, rw->worker_socket_id, RING_F_SC_DEQ);
+		if (tx->tx_ring == NULL)
+			rte_exit(EXIT_FAILURE, "Failed to create %s\n", name);
+
+		// init tx buffers
+		tx->tx_buffer = rte_zmalloc_socket("tx_buffer", 
+												RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST),
+												0,
+												rw->worker_socket_id);
+		if (tx->tx_buffer == NULL)
+			rte_exit(EXIT_FAILURE, "Failed to alloc tx buffer\n");
+		rte_eth_tx_buffer_init(tx->tx_buffer, MAX_PKT_BURST);
+		// stat for failure
+		ret = rte_eth_tx_buffer_set_err_callback(tx->tx_buffer,
+				rte_eth_tx_buffer_count_callback,
+				&tx->dropped);
+		if (ret < 0)
+			rte_exit(EXIT_FAILURE,
+					"Cannot set error callback for tx buffer on port\n");
+	}
 
 	// start the device
 	ret = rte_eth_dev_start(rw->worker_port_id);
@@ -350,42 +385,265 @@ void* stat_thread(void* arg)
 	struct ethernet_rw_t* rw = (struct ethernet_rw_t*)arg;
 	while (!rw->exit)
 	{
-		if (rw->op == OPERATION_RX)
-		{
-			struct ethernet_rx_t* rx = &rw->rx;
-			stat_show(&rw->stat, rx->pktcount, rx->bytes, true);
-		}
-		else
+		uint64_t pktcount = 0, bytes = 0;
+		uint16_t q;
+
+		for (q = 0; q < rw->nb_queues; q++)
 		{
-			struct ethernet_tx_t* tx = &rw->tx;
-			stat_show(&rw->stat, tx->pktcount, tx->bytes, true);
+			if (rw->op == OPERATION_RX)
+			{
+				pktcount += rw->queues[q].rx.pktcount;
+				bytes += rw->queues[q].rx.bytes;
+			}
+			else
+			{
+				pktcount += rw->queues[q].tx.pktcount;
+				bytes += rw->queues[q].tx.bytes;
+			}
 		}
+		stat_show(&rw->stat, pktcount, bytes, true);
 		sleep(1);
 	}
 	return 0;
 }
 
+// add counters gathered by an lcore to the device, shared by all lcores
+static void dpdk_stats_fold(struct netdev* d, struct netstats* stats)
+{
+    unsigned long* from = (unsigned long*)stats;
+    unsigned long* to = (unsigned long*)&d->net_stats;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(*stats) / sizeof(unsigned long); i++)
+    {
+        if (from[i])
+        {
+            __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+            from[i] = 0;
+        }
+    }
+}
+
+// pkbuf release callback: give the wrapped mbuf back to mempool
+static void dpdk_mbuf_release(struct pkbuf* pkb)
+{
+    rte_pktmbuf_free((struct rte_mbuf*)pkb->pk_ext);
+}
+
+// tx pkbuf built in mbuf storage, so that xmit can send the mbuf itself
+static struct pkbuf* dpdk_dev_alloc_pkb(struct netdev* d, int size)
+{
+    struct ethernet_rw_t* rw = d->priv;
+    struct rte_mbuf* m;
+    struct pkbuf* pkb;
+
+    // tso super-segments do not fit, leave them to the heap without
+    // taking an mbuf first
+    if (RTE_PKTMBUF_HEADROOM + size > rte_pktmbuf_data_room_size(rw->mempool))
+        return NULL;
+    m = rte_pktmbuf_alloc(rw->mempool);
+    if (m == NULL)
+        return NULL;
+    // L2-L4 headers are pushed into the mbuf headroom
+    if (m->data_off < PKB_RESERVE || rte_pktmbuf_tailroom(m) < size)
+    {
+        rte_pktmbuf_free(m);
+        return NULL;
+    }
+    pkb = alloc_ext_pkb((unsigned char*)m->buf_addr, m->buf_len, dpdk_mbuf_release, m);
+    pkb_reserve(pkb, m->data_off);
+    // same as alloc_tx_pkb(): only the headroom starts zeroed
+    memset(pkb->pk_data - PKB_RESERVE, 0, PKB_RESERVE);
+    return pkb;
+}
+
+// tx queue for frames sent outside the worker lcores, one per flow
+static uint16_t dpdk_tx_queue_pick(struct ethernet_rw_t* rw, struct rte_mbuf* m)
+{
+    struct rte_ether_hdr* eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+    struct rte_ipv4_hdr* ip;
+    uint32_t h;
+
+    if (rw->nb_queues == 1 || m->data_len < sizeof(*eth) + sizeof(*ip) ||
+        eth->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+        return 0;
+    ip = (struct rte_ipv4_hdr*)(eth + 1);
+    h = (ip->src_addr * 0x9e3779b1) ^ ip->dst_addr ^ ip->next_proto_id;
+    h *= 0x9e3779b1;
+    return (h ^ (h >> 16)) % rw->nb_queues;
+}
+
+// copy the frame into an mbuf chain, gso frames span several mbufs
+static struct rte_mbuf* dpdk_pkb_copy(struct ethernet_rw_t* rw, struct pkbuf* b)
+{
+    struct rte_mbuf* head = NULL;
+    struct rte_mbuf* m;
+    int off, chunk;
+
+    for (off = 0; off < b->pk_len; off += chunk)
+    {
+        m = rte_pktmbuf_alloc(rw->mempool);
+        if (m == NULL)
+            goto err;
+        chunk = RTE_MIN(b->pk_len - off, (int)rte_pktmbuf_tailroom(m));
+        memcpy(rte_pktmbuf_append(m, chunk), b->pk_data + off, chunk);
+        if (head == NULL)
+        {
+            head = m;
+        }
+        else if (rte_pktmbuf_chain(head, m) < 0)
+        {
+            rte_pktmbuf_free(m);
+            goto err;
+        }
+    }
+    return head;
+err:
+    if (head)
+        rte_pktmbuf_free(head);
+    return NULL;
+}
+
+// let the NIC cut the tcp super-segment into @mss sized segments
+static void dpdk_tx_tso(struct rte_mbuf* m, uint16_t mss)
+{
+    struct rte_ipv4_hdr* ip;
+    struct rte_tcp_hdr* tcp;
+
+    ip = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr*, sizeof(struct rte_ether_hdr));
+    m->l2_len = sizeof(struct rte_ether_hdr);
+    m->l3_len = (ip->version_ihl & 0x0f) * 4;
+    tcp = (struct rte_tcp_hdr*)((char*)ip + m->l3_len);
+    m->l4_len = (tcp->data_off >> 4) * 4;
+    m->tso_segsz = mss;
+    m->ol_flags = PKT_TX_TCP_SEG | PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+    // NIC fills in ip checksum, and adds the text to the pseudo header sum
+    ip->hdr_checksum = 0;
+    tcp->cksum = rte_ipv4_phdr_cksum(ip, m->ol_flags);
+}
+
+// fill in the checksums the stack left to the NIC (NETIF_F_TX_*_CSUM)
+static void dpdk_tx_csum(struct netdev* d, struct rte_mbuf* m, struct pkbuf* b)
+{
+    struct rte_ether_hdr* eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+    struct rte_ipv4_hdr* ip;
+    char* l4;
+
+    if (eth->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+        return;
+    ip = (struct rte_ipv4_hdr*)(eth + 1);
+    m->l2_len = sizeof(*eth);
+    m->l3_len = (ip->version_ihl & 0x0f) * 4;
+    m->ol_flags |= PKT_TX_IPV4;
+    if (d->net_features & NETIF_F_TX_IP_CSUM)
+    {
+        m->ol_flags |= PKT_TX_IP_CKSUM;
+        ip->hdr_checksum = 0;
+    }
+    if (b->pk_csum != PKB_CSUM_PARTIAL)
+        return;
+    // NIC adds the l4 data to the pseudo header sum
+    l4 = (char*)ip + m->l3_len;
+    if (ip->next_proto_id == IPPROTO_TCP)
+    {
+        m->ol_flags |= PKT_TX_TCP_CKSUM;
+        ((struct rte_tcp_hdr*)l4)->cksum = rte_ipv4_phdr_cksum(ip, m->ol_flags);
+    }
+    else if (ip->next_proto_id == IPPROTO_UDP)
+    {
+        m->ol_flags |= PKT_TX_UDP_CKSUM;
+        ((struct rte_udp_hdr*)l4)->dgram_cksum = rte_ipv4_phdr_cksum(ip, m->ol_flags);
+    }
+}
+
+// pipeline mode: hand the frames the owner lcore collected to the tx lcore
+static void dpdk_tx_ring_flush(struct dpdk_queue_t* q)
+{
+    struct ethernet_tx_t* tx = &q->tx;
+    uint64_t bytes = 0;
+    unsigned int i, n;
+
+    // the tx lcore may free them once enqueued, account them first
+    for (i = 0; i < tx->nb_pending; i++)
+        bytes += tx->pending[i]->pkt_len;
+    n = rte_ring_enqueue_burst(tx->tx_ring, (void**)tx->pending, tx->nb_pending, NULL);
+    // ring is full: drop the rest
+    for (i = n; i < tx->nb_pending; i++)
+    {
+        bytes -= tx->pending[i]->pkt_len;
+        rte_pktmbuf_free(tx->pending[i]);
+    }
+    q->stats.tx_packets += n;
+    q->stats.tx_bytes += bytes;
+    q->stats.tx_errors += tx->nb_pending - n;
+    tx->nb_pending = 0;
+}
+
 int dpdk_dev_xmit(struct netdev* d, struct pkbuf* b)
 {
     struct ethernet_rw_t* rw = d->priv;
+    struct dpdk_queue_t* q = cur_queue;
+    struct rte_mbuf* m;
+    int len = b->pk_len;
+
+    if (b->pk_release == dpdk_mbuf_release && b->pk_refcnt == 1)
+    {
+        // frame already lives in an mbuf (built by dpdk_dev_alloc_pkb or
+        // received and reused in place): take it over from the pkbuf
+        m = b->pk_ext;
+        b->pk_release = NULL;
+        b->pk_ext = NULL;
+        m->data_off = b->pk_data - (unsigned char*)m->buf_addr;
+        m->data_len = len;
+        m->pkt_len = len;
+        m->ol_flags = 0;
+    }
+    else
+    {
+        m = dpdk_pkb_copy(rw, b);
+        if (m == NULL)
+        {
+            __atomic_fetch_add(&d->net_stats.tx_errors, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    // only handed over with NETIF_F_TSO
+    if (b->pk_gso_size)
+        dpdk_tx_tso(m, b->pk_gso_size);
+    else
+        dpdk_tx_csum(d, m, b);
 
-    struct rte_mbuf* m = rte_pktmbuf_alloc(rw->mempool);
-    memcpy(rte_pktmbuf_mtod(m, void*), b->pk_data, b->pk_len);
-    m->pkt_len = b->pk_len;
-    m->next = 0;
-    m->data_len = b->pk_len;
-    m->nb_segs = 1;
+    if (q && q->dev == d)
+    {
+        // owner lcore: straight to its NIC tx queue, flushed at the end of the burst
+        if (rw->mode == DPDK_MODE_RTC)
+        {
+            q->tx.pktcount++;
+            q->tx.bytes += len;
+            q->stats.tx_packets++;
+            q->stats.tx_bytes += len;
+            rte_eth_tx_buffer(rw->worker_port_id, q->queue_id, q->tx.tx_buffer, m);
+            return len;
+        }
+        // pipeline: batched for the tx lcore, enqueued at the end of the burst
+        if (q->tx.nb_pending == TX_RING_BATCH)
+            dpdk_tx_ring_flush(q);
+        q->tx.pending[q->tx.nb_pending++] = m;
+        return len;
+    }
 
-    // put it in the ring
-    if (rte_ring_enqueue(rw->tx.tx_ring, m) == 0)
+    // other threads: put it in the ring of a worker lcore, or of the tx
+    // lcore in pipeline mode
+    q = &rw->queues[dpdk_tx_queue_pick(rw, m)];
+    if (rte_ring_enqueue(q->tx.tx_ring, m) == 0)
     {
-        d->net_stats.tx_packets++;
-        d->net_stats.tx_bytes += b->pk_len;
-        return b->pk_len;
+        __atomic_fetch_add(&d->net_stats.tx_packets, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->net_stats.tx_bytes, len, __ATOMIC_RELAXED);
+        return len;
     }
     else
     {
-        d->net_stats.tx_errors++;
+        __atomic_fetch_add(&d->net_stats.tx_errors, 1, __ATOMIC_RELAXED);
         rte_pktmbuf_free(m);
         return 0;
     }
@@ -416,55 +674,185 @@ void dpdk_dev_exit(struct netdev* d)
 	rte_eth_dev_close(rw->worker_port_id);
 }
 
-static int dpdk_rx_thread(void* x)
+static struct pkbuf* dpdk_mbuf_to_pkb(struct dpdk_queue_t* q, struct rte_mbuf* m, bool zero_copy)
+{
+    struct pkbuf* pkb;
+    // NIC checked both ip header and tcp/udp checksum
+    bool csum_ok = (m->ol_flags & PKT_RX_IP_CKSUM_MASK) == PKT_RX_IP_CKSUM_GOOD &&
+                    (m->ol_flags & PKT_RX_L4_CKSUM_MASK) == PKT_RX_L4_CKSUM_GOOD;
+
+    if (zero_copy && m->nb_segs == 1)
+    {
+        // pkbuf data is the mbuf data room, mbuf headroom is kept as pkbuf headroom
+        pkb = alloc_ext_pkb((unsigned char*)m->buf_addr, m->buf_len, dpdk_mbuf_release, m);
+        pkb_reserve(pkb, m->data_off);
+        pkb_put(pkb, m->data_len);
+        if (csum_ok)
+            pkb->pk_csum = PKB_CSUM_UNNECESSARY;
+        return pkb;
+    }
+
+    q->rx.copied++;
+    pkb = alloc_netdev_pkb(q->dev);
+    if (m->pkt_len > pkb_tailroom(pkb))
+    {
+        free_pkb(pkb);
+        rte_pktmbuf_free(m);
+        return NULL;
+    }
+    if (csum_ok)
+        pkb->pk_csum = PKB_CSUM_UNNECESSARY;
+    // rte_pktmbuf_read() only copies into dst if the data spans segments
+    void* dst = pkb_put(pkb, m->pkt_len);
+    const void* src = rte_pktmbuf_read(m, 0, m->pkt_len, dst);
+    if (src != dst)
+        memcpy(dst, src, m->pkt_len);
+    rte_pktmbuf_free(m);
+    return pkb;
+}
+
+// queue frames of the ring to its NIC tx queue, return how many
+static unsigned int dpdk_tx_ring_drain(struct ethernet_rw_t* dpdk, struct dpdk_queue_t* q)
 {
-    struct netdev* dev = x;
-    struct ethernet_rw_t* dpdk = dev->priv;
 	const uint16_t MAX_PKT_BURST = 32;
-	struct ethernet_rx_t* rx = &dpdk->rx;
-	struct rte_mbuf* pkts_burst[MAX_PKT_BURST];
+	struct ethernet_tx_t* tx = &q->tx;
+	struct rte_mbuf* pkts[MAX_PKT_BURST];
+	unsigned int nb_tx, i;
+
+	nb_tx = rte_ring_dequeue_burst(tx->tx_ring, (void**)pkts, MAX_PKT_BURST, NULL);
+	for (i = 0; i < nb_tx; i++)
+	{
+		// m may be freed by tx_buffer, account it first
+		tx->bytes += pkts[i]->pkt_len;
+		rte_eth_tx_buffer(dpdk->worker_port_id, q->queue_id, tx->tx_buffer, pkts[i]);
+	}
+	tx->pktcount += nb_tx;
+	return nb_tx;
+}
 
-	printf("RX loop\n");
+// pipeline mode: the only lcore touching the NIC tx queues
+static int dpdk_tx_loop(void* x)
+{
+	struct ethernet_rw_t* dpdk = x;
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * BURST_TX_DRAIN_US;
+	uint64_t prev_tsc = rte_rdtsc();
+	unsigned int nb_tx;
+	uint16_t q;
 
+	printf("TX loop\n");
 	while (!dpdk->exit)
 	{
-		uint16_t nb_rx = rte_eth_rx_burst(dpdk->worker_port_id, 0, pkts_burst, MAX_PKT_BURST);
-		if (nb_rx == 0)
+		nb_tx = 0;
+		for (q = 0; q < dpdk->nb_queues; q++)
+			nb_tx += dpdk_tx_ring_drain(dpdk, &dpdk->queues[q]);
+
+		// flush when idle, or when the buffered frames are getting old
+		uint64_t cur_tsc = rte_rdtsc();
+		if (nb_tx == 0 || cur_tsc - prev_tsc > drain_tsc)
 		{
-			usleep(50);
-			continue;
+			for (q = 0; q < dpdk->nb_queues; q++)
+				rte_eth_tx_buffer_flush(dpdk->worker_port_id, q, dpdk->queues[q].tx.tx_buffer);
+			prev_tsc = cur_tsc;
 		}
-		
-		rx->pktcount += nb_rx;
+		if (nb_tx == 0)
+			usleep(50);
+	}
+	return 0;
+}
 
-		uint16_t i;
-		for (i = 0; i < nb_rx; i++)
-		{
-			struct rte_mbuf* m = pkts_burst[i];
-			rx->bytes += m->data_len;
+/*
+ * Worker of one queue pair: receives a burst, runs it through the stack
+ * to completion on this lcore, then sends the replies and the frames
+ * other threads queued for it. In pipeline mode the sending is left to
+ * the tx lcore.
+ */
+static int dpdk_queue_loop(void* x)
+{
+    struct dpdk_queue_t* q = x;
+    struct netdev* dev = q->dev;
+    struct ethernet_rw_t* dpdk = dev->priv;
+	const uint16_t MAX_PKT_BURST = 32;
+	struct ethernet_rx_t* rx = &q->rx;
+	struct rte_mbuf* pkts_burst[MAX_PKT_BURST];
+	struct pkbuf* pkbs[MAX_PKT_BURST];
 
-            struct pkbuf *pkb = alloc_netdev_pkb(dev);
-            pkb->pk_len = m->data_len;
-            memcpy(pkb->pk_data, rte_pktmbuf_mtod(m, void*), pkb->pk_len);
+	printf("Queue %u loop on lcore %u\n", q->queue_id, q->lcore_id);
+	cur_queue = q;
 
-            dev->net_stats.rx_packets++;
-            dev->net_stats.rx_bytes += pkb->pk_len;
+	// Frames this lcore sends while handling a burst (echo replies, acks,
+	// forwarded packets) go to the NIC tx buffer of its queue directly,
+	// which is flushed at the end of the burst.
+	while (!dpdk->exit)
+	{
+		uint16_t nb_rx = rte_eth_rx_burst(dpdk->worker_port_id, q->queue_id,
+										pkts_burst, MAX_PKT_BURST);
+		if (nb_rx)
+		{
+			rx->pktcount += nb_rx;
+
+			// checked once per burst, it walks the per-lcore caches
+			bool zero_copy = rte_mempool_avail_count(dpdk->mempool) >
+							RX_ZEROCOPY_MIN_FREE_MBUFS;
+
+			uint16_t i;
+			int n = 0;
+			for (i = 0; i < nb_rx; i++)
+			{
+				struct rte_mbuf* m = pkts_burst[i];
+				rx->bytes += m->pkt_len;
+
+				struct pkbuf *pkb = dpdk_mbuf_to_pkb(q, m, zero_copy);
+				if (pkb == NULL)
+				{
+					q->stats.rx_errors++;
+					continue;
+				}
+
+				q->stats.rx_packets++;
+				q->stats.rx_bytes += pkb->pk_len;
+				pkbs[n++] = pkb;
+			}
+
+			// the mbufs are freed by free_pkb() in the stack
+			net_in_burst(dev, pkbs, n);
+		}
 
-			rte_pktmbuf_free(m);
-            net_in(dev, pkb);
+		unsigned int nb_tx = 0;
+		if (dpdk->mode == DPDK_MODE_RTC)
+		{
+			// frames sent by other threads
+			nb_tx = dpdk_tx_ring_drain(dpdk, q);
+			// replies of this burst and ring frames leave together
+			rte_eth_tx_buffer_flush(dpdk->worker_port_id, q->queue_id, q->tx.tx_buffer);
 		}
+		else if (q->tx.nb_pending)
+		{
+			// replies of this burst go to the tx lcore in one enqueue
+			dpdk_tx_ring_flush(q);
+		}
+		dpdk_stats_fold(dev, &q->stats);
+
+		if (nb_rx == 0 && nb_tx == 0)
+			usleep(50);
 	}
 
+	cur_queue = NULL;
     return 0;
 }
 
-struct netdev* dpdk_dev_create(char* coremask, char* ipstr, int maskbits)
+/*
+ * Every lcore of @coremask but the main one owns a queue pair of the
+ * port, the port gets as many queues (up to what it supports).
+ * With @pipeline, the last lcore is the tx lcore and owns no queue.
+ */
+struct netdev* dpdk_dev_create(char* coremask, char* ipstr, int maskbits, int pipeline)
 {
     struct netdev* dev;
     static struct netdev_ops dpdk_ops = {
         .init = dpdk_dev_init,
         .xmit = dpdk_dev_xmit,
         .exit = dpdk_dev_exit,
+        .alloc_pkb = dpdk_dev_alloc_pkb,
     };
     struct ethernet_rw_t* rw = malloc(sizeof(struct ethernet_rw_t));
     memset(rw, 0, sizeof(*rw));
@@ -481,12 +869,16 @@ struct netdev* dpdk_dev_create(char* coremask, char* ipstr, int maskbits)
 		rte_exit(EXIT_FAILURE, "Invalid EAL arguments\n");
 	printf("Finished rte_eal_init\n");
 
-	// check lcore mask
+	// check lcore mask: the main lcore runs the shell
     int lcore_count = rte_lcore_count();
-	if (lcore_count != 3)
+	int min_lcores = pipeline ? 3 : 2;
+	if (lcore_count < min_lcores)
 	{
-		rte_exit(EXIT_FAILURE, "Expected 3 lcores, but %d provided\n", lcore_count);
+		rte_exit(EXIT_FAILURE, "Expected at least %d lcores, but %d provided\n",
+				min_lcores, lcore_count);
 	}
+	rw->mode = pipeline ? DPDK_MODE_PIPELINE : DPDK_MODE_RTC;
+	rw->nb_queues = RTE_MIN(lcore_count - min_lcores + 1, DPDK_MAX_QUEUES);
 	// check port count
 	// this program just handles one single port
 	uint16_t ethdev_count = rte_eth_dev_count_avail();
@@ -515,15 +907,37 @@ struct netdev* dpdk_dev_create(char* coremask, char* ipstr, int maskbits)
     dev = netdev_alloc("dpdk", &dpdk_ops, rw);
     dev->net_mtu = 1500;
     memcpy(dev->net_hwaddr, rw->mac.addr_bytes, 6);
+    // tx offloads are all enabled by ethernet_rw_init()
+    if (rw->dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO)
+        dev->net_features |= NETIF_F_GSO | NETIF_F_TSO;
+    if (rw->dev_info.tx_offload_capa & DEV_TX_OFFLOAD_IPV4_CKSUM)
+        dev->net_features |= NETIF_F_TX_IP_CSUM;
+    if ((rw->dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_CKSUM) &&
+        (rw->dev_info.tx_offload_capa & DEV_TX_OFFLOAD_UDP_CKSUM))
+        dev->net_features |= NETIF_F_TX_L4_CSUM;
+    if ((rw->dev_info.rx_offload_capa & DEV_RX_OFFLOAD_IPV4_CKSUM) &&
+        (rw->dev_info.rx_offload_capa & DEV_RX_OFFLOAD_TCP_CKSUM) &&
+        (rw->dev_info.rx_offload_capa & DEV_RX_OFFLOAD_UDP_CKSUM))
+        dev->net_features |= NETIF_F_RXCSUM;
 
     str2ip(ipstr, &dev->net_ipaddr);
     dev->net_mask = htonl(~((1<<(32-maskbits)) - 1));
     dev->priv = rw;
     
-    int lcore_id = rte_get_next_lcore(-1, 1, 0);
-    rte_eal_remote_launch(ethernet_tx_loop, rw, lcore_id);
-    lcore_id = rte_get_next_lcore(lcore_id, 1, 0);
-    rte_eal_remote_launch(dpdk_rx_thread, dev, lcore_id);
+    unsigned int lcore_id = -1;
+    uint16_t q;
+    for (q = 0; q < rw->nb_queues; q++)
+    {
+        lcore_id = rte_get_next_lcore(lcore_id, 1, 0);
+        rw->queues[q].dev = dev;
+        rw->queues[q].lcore_id = lcore_id;
+        rte_eal_remote_launch(dpdk_queue_loop, &rw->queues[q], lcore_id);
+    }
+    if (rw->mode == DPDK_MODE_PIPELINE)
+    {
+        lcore_id = rte_get_next_lcore(lcore_id, 1, 0);
+        rte_eal_remote_launch(dpdk_tx_loop, rw, lcore_id);
+    }
     
     return dev;
 }
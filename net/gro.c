@@ -0,0 +1,153 @@
+/*
+ *  Generic receive offload:
+ *    in-order tcp segments of one flow received back to back in a
+ *    burst are merged into one segment before the ip layer, so that
+ *    ip, route, socket lookup and wakeup run once for all of them
+ */
+#include "netif.h"
+#include "ether.h"
+#include "ip.h"
+#include "tcp.h"
+#include "lib.h"
+#include "list.h"
+
+/* merged ip packet, with ether header and headroom, fits in a jumbo pkbuf */
+#define GRO_MAX_SIZE	(PKB_JUMBO_ROOM - PKB_RESERVE - ETH_HRD_SZ)
+
+/* pk_nh is not set yet: ip header follows the pulled ether header */
+#define gro_ip(pkb) ((struct ip *)(pkb)->pk_data)
+
+/*
+ * Tcp text length of @pkb if it can be merged, or -1.
+ * Only plain ACK(/PSH) segments with text and without ip/tcp
+ * options are merged, ip header is still in network order.
+ * Segments in transit are left alone: a merged one would be forwarded
+ * with a stale tcp checksum, and likely over the mtu.
+ */
+static int gro_tcp_len(struct pkbuf *pkb)
+{
+	struct ip *iphdr = (struct ip *)pkb->pk_data;
+	struct tcp *tcphdr = ip2tcp(iphdr);
+	int len;
+
+	if (pkb->pk_type != PKT_LOCALHOST ||
+		pkb->pk_len < IP_HRD_SZ + TCP_HRD_SZ)
+		return -1;
+	if (ipver(iphdr) != IP_VERSION_4 || iphlen(iphdr) != IP_HRD_SZ ||
+		iphdr->ip_pro != IP_P_TCP ||
+		(iphdr->ip_fragoff & _htons(IP_FRAG_OFF | IP_FRAG_MF)))
+		return -1;
+	if (!iphdr->ip_dst || !local_address(iphdr->ip_dst))
+		return -1;
+	len = _ntohs(iphdr->ip_len);
+	if (len > pkb->pk_len || len <= IP_HRD_SZ + TCP_HRD_SZ)
+		return -1;
+	if (tcphdr->doff != TCP_HRD_DOFF || !tcphdr->ack || tcphdr->syn ||
+		tcphdr->fin || tcphdr->rst || tcphdr->urg)
+		return -1;
+	return len - IP_HRD_SZ - TCP_HRD_SZ;
+}
+
+/* Does @pkb continue the segment in @head? */
+static int gro_tcp_follows(struct pkbuf *head, struct pkbuf *pkb)
+{
+	struct ip *hiphdr = gro_ip(head), *iphdr = gro_ip(pkb);
+	struct tcp *htcphdr = ip2tcp(hiphdr), *tcphdr = ip2tcp(iphdr);
+	int hlen = _ntohs(hiphdr->ip_len) - IP_HRD_SZ - TCP_HRD_SZ;
+
+	return hiphdr->ip_src == iphdr->ip_src &&
+		hiphdr->ip_dst == iphdr->ip_dst &&
+		htcphdr->src == tcphdr->src &&
+		htcphdr->dst == tcphdr->dst &&
+		htcphdr->ackn == tcphdr->ackn &&
+		!htcphdr->psh &&
+		_ntohl(htcphdr->seq) + hlen == _ntohl(tcphdr->seq);
+}
+
+static int gro_csum_ok(struct pkbuf *pkb)
+{
+	struct ip *iphdr = gro_ip(pkb);
+
+	if (pkb->pk_csum == PKB_CSUM_UNNECESSARY)
+		return 1;
+	return ip_chksum((unsigned short *)pkb->pk_data, IP_HRD_SZ) == 0 &&
+		tcp_chksum(iphdr->ip_src, iphdr->ip_dst,
+			_ntohs(iphdr->ip_len) - IP_HRD_SZ,
+			(unsigned short *)ip2tcp(iphdr)) == 0;
+}
+
+/* Move @pkb into a pkbuf with room for a merged segment, in its place */
+static struct pkbuf *gro_expand(struct pkbuf *pkb)
+{
+	struct pkbuf *npkb;
+
+	/* whole frame is copied in, nothing to zero */
+	npkb = alloc_tx_pkb(ETH_HRD_SZ + GRO_MAX_SIZE);
+	/* keep ether header: upper layers may look at it */
+	memcpy(pkb_put(npkb, ETH_HRD_SZ + pkb->pk_len),
+		pkb->pk_data - ETH_HRD_SZ, ETH_HRD_SZ + pkb->pk_len);
+	npkb->pk_mh = npkb->pk_data;
+	pkb_pull(npkb, ETH_HRD_SZ);
+	npkb->pk_pro = pkb->pk_pro;
+	npkb->pk_type = pkb->pk_type;
+	npkb->pk_indev = pkb->pk_indev;
+	npkb->pk_csum = pkb->pk_csum;
+	list_add(&npkb->pk_list, &pkb->pk_list);
+	list_del(&pkb->pk_list);
+	free_pkb(pkb);
+	return npkb;
+}
+
+/* Append text of @pkb to @head and drop @pkb, return the merged head */
+static struct pkbuf *gro_merge(struct pkbuf *head, struct pkbuf *pkb, int len)
+{
+	struct ip *iphdr = gro_ip(pkb);
+	struct tcp *tcphdr = ip2tcp(iphdr);
+	struct ip *hiphdr;
+	struct tcp *htcphdr;
+
+	/* drop ethernet padding of short frames */
+	pkb_trim(head, _ntohs(gro_ip(head)->ip_len));
+	if (pkb_tailroom(head) < len)
+		head = gro_expand(head);
+	memcpy(pkb_put(head, len), tcphdr->data, len);
+
+	hiphdr = gro_ip(head);
+	htcphdr = ip2tcp(hiphdr);
+	hiphdr->ip_len = _htons(head->pk_len);
+	ip_set_checksum(hiphdr);
+	htcphdr->window = tcphdr->window;
+	htcphdr->psh = tcphdr->psh;
+	/* tcp checksum is stale now, both parts were verified */
+	head->pk_csum = PKB_CSUM_UNNECESSARY;
+
+	list_del(&pkb->pk_list);
+	free_pkb(pkb);
+	return head;
+}
+
+/*
+ * Merge runs of in-order segments of one flow in @list (received
+ * ip packets linked by pk_list) in place. Any other packet ends a run,
+ * so the order of packets in @list is kept.
+ */
+void net_gro_list(struct list_head *list)
+{
+	struct pkbuf *pkb, *next, *head = NULL;
+	int len;
+
+	list_for_each_entry_safe(pkb, next, list, pk_list) {
+		len = gro_tcp_len(pkb);
+		if (len < 0) {
+			head = NULL;
+			continue;
+		}
+		if (head && gro_tcp_follows(head, pkb) &&
+			_ntohs(gro_ip(head)->ip_len) + len <= GRO_MAX_SIZE &&
+			gro_csum_ok(head) && gro_csum_ok(pkb)) {
+			head = gro_merge(head, pkb, len);
+			continue;
+		}
+		head = pkb;
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ *  Generic segmentation offload:
+ *    tcp hands one super-segment down the stack, which is cut
+ *    into mtu-sized segments just before the device
+ */
+#include "netif.h"
+#include "ether.h"
+#include "ip.h"
+#include "tcp.h"
+#include "lib.h"
+
+/* Assert pkb->pk_data is ip header of a tcp segment with pk_gso_size set */
+void netdev_gso_tx(struct netdev *dev, struct pkbuf *pkb,
+		unsigned short proto, unsigned char *dst)
+{
+	struct ip *iphdr = (struct ip *)pkb->pk_data;
+	struct tcp *tcphdr = ip2tcp(iphdr);
+	int hlen = iphlen(iphdr) + tcphdr->doff * 4;
+	int dlen = _ntohs(iphdr->ip_len) - hlen;
+	unsigned int seq = _ntohl(tcphdr->seq);
+	unsigned short id = _ntohs(iphdr->ip_id);
+	unsigned char *text = (unsigned char *)iphdr + hlen;
+	struct pkbuf *seg;
+	struct ip *siphdr;
+	struct tcp *stcphdr;
+	unsigned int textsum;
+	int off, len;
+
+	for (off = 0; off < dlen; off += len) {
+		len = min(dlen - off, (int)pkb->pk_gso_size);
+		seg = netdev_alloc_pkb(dev, hlen + len);
+		seg->pk_pro = pkb->pk_pro;
+		seg->pk_rtdst = pkb->pk_rtdst;
+		/* same headers, then this segment's share of the text */
+		siphdr = (struct ip *)pkb_put(seg, hlen + len);
+		memcpy(siphdr, iphdr, hlen);
+		textsum = 0;
+		if (dev->net_features & NETIF_F_TX_L4_CSUM)
+			memcpy((unsigned char *)siphdr + hlen, text + off, len);
+		else
+			textsum = csum_partial_copy((unsigned char *)siphdr +
+						hlen, text + off, len, 0);
+		seg->pk_nh = (unsigned char *)siphdr;
+		stcphdr = ip2tcp(siphdr);
+		siphdr->ip_len = _htons(hlen + len);
+		siphdr->ip_id = _htons(id++);
+		stcphdr->seq = _htonl(seq + off);
+		/* PSH and FIN belong to the last segment only */
+		if (off + len < dlen) {
+			stcphdr->psh = 0;
+			stcphdr->fin = 0;
+		}
+		if (dev->net_features & NETIF_F_TX_L4_CSUM)
+			seg->pk_csum = PKB_CSUM_PARTIAL;
+		else
+			tcp_set_checksum_text(siphdr, stcphdr, textsum);
+		if (!(dev->net_features & NETIF_F_TX_IP_CSUM))
+			ip_set_checksum(siphdr);
+		netdev_tx(dev, seg, proto, dst);
+	}
+	free_pkb(pkb);
+}
@@ -29,12 +29,14 @@ static void loop_recv(struct netdev *dev, struct pkbuf *pkb)
 
 static int loop_xmit(struct netdev *dev, struct pkbuf *pkb)
 {
+	/* net_in() will pull headers off the shared pkb */
+	int len = pkb->pk_len;
 	get_pkb(pkb);
 	/* loop back to itself */
 	loop_recv(dev, pkb);
 	dev->net_stats.tx_packets++;
-	dev->net_stats.tx_bytes += pkb->pk_len;
-	return pkb->pk_len;
+	dev->net_stats.tx_bytes += len;
+	return len;
 }
 
 static struct netdev_ops loop_ops = {
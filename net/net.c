@@ -35,35 +35,59 @@ static struct ether *eth_init(struct netdev *dev, struct pkbuf *pkb)
 	}
 	/* packet protocol */
 	pkb->pk_pro = _ntohs(ehdr->eth_pro);
+	/* L3 data follows ether header */
+	pkb->pk_mh = (unsigned char *)ehdr;
+	pkb_pull(pkb, ETH_HRD_SZ);
 	return ehdr;
 }
 
-/* L2 protocol parsing */
-void net_in(struct netdev *dev, struct pkbuf *pkb)
+/*
+ * L2 protocol parsing of @n received frames:
+ * ip packets are handed to ip layer as one list.
+ */
+void net_in_burst(struct netdev *dev, struct pkbuf **pkbs, int n)
 {
-	struct ether *ehdr = eth_init(dev, pkb);
-	if (!ehdr)
-		return;
-	l2dbg(MACFMT " -> " MACFMT "(%s)",
-				macfmt(ehdr->eth_src),
-				macfmt(ehdr->eth_dst),
-				ethpro(pkb->pk_pro));
-	pkb->pk_indev = dev;
-	switch (pkb->pk_pro) {
-	case ETH_P_RARP:
-//		rarp_in(dev, pkb);
-		break;
-	case ETH_P_ARP:
-		arp_in(dev, pkb);
-		break;
-	case ETH_P_IP:
-		ip_in(dev, pkb);
-		break;
-	default:
-		l2dbg("drop unkown-type packet");
-		free_pkb(pkb);
-		break;
+	struct ether *ehdr;
+	struct pkbuf *pkb;
+	LIST_HEAD(ip_list);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		pkb = pkbs[i];
+		ehdr = eth_init(dev, pkb);
+		if (!ehdr)
+			continue;
+		l2dbg(MACFMT " -> " MACFMT "(%s)",
+					macfmt(ehdr->eth_src),
+					macfmt(ehdr->eth_dst),
+					ethpro(pkb->pk_pro));
+		pkb->pk_indev = dev;
+		switch (pkb->pk_pro) {
+		case ETH_P_RARP:
+//			rarp_in(dev, pkb);
+			break;
+		case ETH_P_ARP:
+			arp_in(dev, pkb);
+			break;
+		case ETH_P_IP:
+			list_add_tail(&pkb->pk_list, &ip_list);
+			break;
+		default:
+			l2dbg("drop unkown-type packet");
+			free_pkb(pkb);
+			break;
+		}
 	}
+	if (!list_empty(&ip_list)) {
+		if (n > 1 && (dev->net_features & NETIF_F_GRO))
+			net_gro_list(&ip_list);
+		ip_in_list(dev, &ip_list);
+	}
+}
+
+void net_in(struct netdev *dev, struct pkbuf *pkb)
+{
+	net_in_burst(dev, &pkb, 1);
 }
 
 void net_timer(void)
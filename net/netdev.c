@@ -28,6 +28,8 @@ struct netdev *netdev_alloc(char *devstr, struct netdev_ops *netops, void* priv)
 	dev->net_name[NETDEV_NLEN - 1] = '\0';
 	strncpy((char *)dev->net_name, devstr, NETDEV_NLEN - 1);
 	dev->net_ops = netops;
+	/* NETIF_F_GSO only comes with NETIF_F_TSO, set by the driver */
+	dev->net_features = NETIF_F_GRO;
 	dev->priv = priv;
 	if (netops && netops->init)
 		netops->init(dev);
@@ -62,14 +64,24 @@ void netdev_exit(void)
 }
 
 #ifdef DEBUG_PKB
-void _netdev_tx(struct netdev *dev, struct pkbuf *pkb, int len,
+void _netdev_tx(struct netdev *dev, struct pkbuf *pkb,
 		unsigned short proto, unsigned char *dst)
 #else
-void netdev_tx(struct netdev *dev, struct pkbuf *pkb, int len,
+void netdev_tx(struct netdev *dev, struct pkbuf *pkb,
 		unsigned short proto, unsigned char *dst)
 #endif
 {
-	struct ether *ehdr = (struct ether *)pkb->pk_data;
+	struct ether *ehdr;
+
+	/* tcp super-segment: cut into mtu-sized frames unless device does */
+	if (pkb->pk_gso_size && !(dev->net_features & NETIF_F_TSO)) {
+		netdev_gso_tx(dev, pkb, proto, dst);
+		return;
+	}
+
+	/* prepend ether header before L3 data */
+	ehdr = (struct ether *)pkb_push(pkb, ETH_HRD_SZ);
+	pkb->pk_mh = (unsigned char *)ehdr;
 
 	/* first copy to eth_dst, maybe eth_src will be copied to eth_dst */
 	ehdr->eth_pro = _htons(proto);
@@ -81,12 +93,27 @@ void netdev_tx(struct netdev *dev, struct pkbuf *pkb, int len,
 				macfmt(ehdr->eth_dst),
 				ethpro(proto));
 
-	pkb->pk_len = len + ETH_HRD_SZ;
 	/* real transmit packet */
 	dev->net_ops->xmit(dev, pkb);
 	free_pkb(pkb);
 }
 
+/*
+ * Alloc pkbuf for @size bytes of L4 data to be sent via @dev,
+ * maybe backed by device tx buffer. Same as alloc_tx_pkb(): the caller
+ * writes all of the L4 data, only the headroom is zeroed.
+ */
+struct pkbuf *netdev_alloc_pkb(struct netdev *dev, int size)
+{
+	struct pkbuf *pkb;
+	if (dev && dev->net_ops && dev->net_ops->alloc_pkb) {
+		pkb = dev->net_ops->alloc_pkb(dev, size);
+		if (pkb)
+			return pkb;
+	}
+	return alloc_tx_pkb(size);
+}
+
 int local_address(unsigned int addr)
 {
 	struct netdev *dev;
@@ -6,7 +6,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
+#include <sys/mman.h>
 #include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -15,17 +16,153 @@
 #define DEVICE_NAME_LEN 16
 #define ETH_P_ALL 0x0003
 
+// PACKET_MMAP defaults for "attach_dev ... mmap"
+#define PETH_RING_BLOCK_SIZE	(1 << 20)
+#define PETH_RING_BLOCK_NR	16
+#define PETH_RING_FRAME_SIZE	2048
+#define PETH_RING_BLOCK_TOV	1	/* ms before a partly filled rx block is retired */
+
+// tx frame data follows the tpacket3 header, without the sockaddr_ll
+#define PETH_TX_DATA_OFF	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
 struct physical_eth_dev
 {
     int fd;
     unsigned int ip;
     unsigned int mask;
     char device_name[DEVICE_NAME_LEN];
+
+    // TPACKET_V3 rings, used when req.tp_block_nr != 0:
+    // req.tp_block_nr rx blocks followed by the same amount of tx blocks
+    struct tpacket_req3 req;
+    unsigned char* ring;
+    size_t ring_size;
+    unsigned int rx_block;	// next rx block to check
+    unsigned int tx_frame;	// next tx frame to fill
+    unsigned int tx_frame_nr;
+    unsigned int tx_pending;	// frames filled since the last kick
+    pthread_mutex_t tx_lock;
 };
 
+// set in the rx thread: frames it sends are kicked once per rx burst
+static __thread struct netdev* peth_rx_dev;
+
+static int physical_eth_ring_setup(struct physical_eth_dev* priv, int mtu)
+{
+    struct tpacket_req3* req = &priv->req;
+    int ver = TPACKET_V3;
+
+    if (req->tp_block_size % getpagesize() ||
+        req->tp_frame_size % TPACKET_ALIGNMENT ||
+        req->tp_block_size % req->tp_frame_size ||
+        req->tp_frame_size < PETH_TX_DATA_OFF + mtu + ETH_HRD_SZ)
+    {
+        printf("bad ring size: block %u frame %u\n",
+                req->tp_block_size, req->tp_frame_size);
+        return -1;
+    }
+    req->tp_frame_nr = req->tp_block_size / req->tp_frame_size * req->tp_block_nr;
+    if (setsockopt(priv->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+    {
+        perror("PACKET_VERSION");
+        return -1;
+    }
+
+    // rx: the kernel fills whole blocks and retires them by timeout
+    req->tp_retire_blk_tov = PETH_RING_BLOCK_TOV;
+    if (setsockopt(priv->fd, SOL_PACKET, PACKET_RX_RING, req, sizeof(*req)) < 0)
+    {
+        perror("PACKET_RX_RING");
+        return -1;
+    }
+    // tx: frames of tp_frame_size, no block timer
+    req->tp_retire_blk_tov = 0;
+    if (setsockopt(priv->fd, SOL_PACKET, PACKET_TX_RING, req, sizeof(*req)) < 0)
+    {
+        perror("PACKET_TX_RING");
+        return -1;
+    }
+    req->tp_retire_blk_tov = PETH_RING_BLOCK_TOV;
+
+    priv->ring_size = (size_t)req->tp_block_size * req->tp_block_nr * 2;
+    priv->ring = mmap(NULL, priv->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_LOCKED | MAP_POPULATE, priv->fd, 0);
+    if (priv->ring == MAP_FAILED)
+    {
+        perror("mmap packet ring");
+        priv->ring = NULL;
+        return -1;
+    }
+    priv->rx_block = 0;
+    priv->tx_frame = 0;
+    priv->tx_frame_nr = req->tp_frame_nr;
+    priv->tx_pending = 0;
+    pthread_mutex_init(&priv->tx_lock, NULL);
+    printf("peth: mmap ring %u blocks x %u bytes, frame %u\n",
+            req->tp_block_nr, req->tp_block_size, req->tp_frame_size);
+    return 0;
+}
+
+static _inline struct tpacket3_hdr* physical_eth_tx_frame(struct physical_eth_dev* priv, unsigned int i)
+{
+    return (struct tpacket3_hdr*)(priv->ring +
+            (size_t)priv->req.tp_block_size * priv->req.tp_block_nr +
+            (size_t)priv->req.tp_frame_size * i);
+}
+
+// ask the kernel to send all frames marked TP_STATUS_SEND_REQUEST
+static void physical_eth_tx_kick(struct physical_eth_dev* priv)
+{
+    if (sendto(priv->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS)
+        devdbg("tx ring kick");
+    priv->tx_pending = 0;
+}
+
+static int physical_eth_ring_xmit(struct netdev* d, struct pkbuf* b)
+{
+    struct physical_eth_dev* priv = (struct physical_eth_dev*)d->priv;
+    struct tpacket3_hdr* hdr;
+    int l = b->pk_len;
+
+    pthread_mutex_lock(&priv->tx_lock);
+    hdr = physical_eth_tx_frame(priv, priv->tx_frame);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE && priv->tx_pending)
+    {
+        // ring is full of frames not kicked yet
+        physical_eth_tx_kick(priv);
+    }
+    __sync_synchronize();
+    if (hdr->tp_status != TP_STATUS_AVAILABLE ||
+        l > priv->req.tp_frame_size - PETH_TX_DATA_OFF)
+    {
+        pthread_mutex_unlock(&priv->tx_lock);
+        d->net_stats.tx_errors++;
+        return 0;
+    }
+    memcpy((unsigned char*)hdr + PETH_TX_DATA_OFF, b->pk_data, l);
+    hdr->tp_len = l;
+    hdr->tp_snaplen = l;
+    hdr->tp_next_offset = 0;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    priv->tx_frame = (priv->tx_frame + 1) % priv->tx_frame_nr;
+    priv->tx_pending++;
+    // the rx thread kicks after its burst, other senders kick now
+    if (peth_rx_dev != d)
+        physical_eth_tx_kick(priv);
+    pthread_mutex_unlock(&priv->tx_lock);
+
+    d->net_stats.tx_packets++;
+    d->net_stats.tx_bytes += l;
+    return l;
+}
+
 int physical_eth_dev_xmit(struct netdev* d, struct pkbuf* b)
 {
     struct physical_eth_dev* priv = (struct physical_eth_dev*)d->priv;
+    if (priv->ring)
+        return physical_eth_ring_xmit(d, b);
     int l = write(priv->fd, b->pk_data, b->pk_len);
     if ( l != b->pk_len) {
         dbg("write not complete");
@@ -89,12 +226,23 @@ int physical_eth_dev_init(struct netdev* d)
 
     d->net_ipaddr = priv->ip;
     d->net_mask = priv->mask;
+
+    if (priv->req.tp_block_nr && physical_eth_ring_setup(priv, d->net_mtu) < 0)
+    {
+        printf("peth: PACKET_MMAP unavailable, use read()/write()\n");
+        // socket with a half set up ring cannot be used for read(), reopen it
+        close(priv->fd);
+        memset(&priv->req, 0, sizeof(priv->req));
+        return physical_eth_dev_init(d);
+    }
     return 0;
 }
 
 void physical_eth_dev_exit(struct netdev* d)
 {
     struct physical_eth_dev* priv = (struct physical_eth_dev*)d->priv;
+    if (priv->ring)
+        munmap(priv->ring, priv->ring_size);
     close(priv->fd);
     free(priv);
     d->priv = 0;
@@ -102,7 +250,13 @@ void physical_eth_dev_exit(struct netdev* d)
 
 extern void* physical_eth_poll(void* x);
 
-struct netdev* physical_eth_init(const char* device, char* ipstr, int maskbits)
+/*
+ * @ring == 0: read()/write() one frame per syscall,
+ * otherwise use TPACKET_V3 rx/tx rings of @block_nr blocks each
+ * (0 for default sizes).
+ */
+struct netdev* physical_eth_init(const char* device, char* ipstr, int maskbits,
+                int ring, unsigned int block_size, unsigned int block_nr, unsigned int frame_size)
 {
     struct netdev* peth;
     static struct netdev_ops peth_ops = {
@@ -112,7 +266,13 @@ struct netdev* physical_eth_init(const char* device, char* ipstr, int maskbits)
     };
 
     struct physical_eth_dev* priv = (struct physical_eth_dev*)malloc(sizeof(struct physical_eth_dev));
-    priv->fd = 0;
+    memset(priv, 0, sizeof(*priv));
+    if (ring)
+    {
+        priv->req.tp_block_nr = block_nr ? block_nr : PETH_RING_BLOCK_NR;
+        priv->req.tp_block_size = block_size ? block_size : PETH_RING_BLOCK_SIZE;
+        priv->req.tp_frame_size = frame_size ? frame_size : PETH_RING_FRAME_SIZE;
+    }
     strncpy(priv->device_name, device, DEVICE_NAME_LEN);
     str2ip(ipstr, &priv->ip);
     priv->mask = htonl(~((1<<(32-maskbits)) - 1));
@@ -125,36 +285,120 @@ struct netdev* physical_eth_init(const char* device, char* ipstr, int maskbits)
     return peth;
 }
 
-static int physical_eth_recv(struct netdev* dev, struct pkbuf *pkb)
+static int physical_eth_recv(struct netdev* dev, struct pkbuf *pkb, int flags)
 {
     struct physical_eth_dev* priv = (struct physical_eth_dev*)dev->priv;
 	int l;
-	l = read(priv->fd, pkb->pk_data, pkb->pk_len);
+	l = recv(priv->fd, pkb->pk_data, pkb_tailroom(pkb), flags);
 	if (l <= 0) {
+		/* MSG_DONTWAIT: nothing more queued */
+		if (l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
 		devdbg("read net dev");
 		dev->net_stats.rx_errors++;
 	} else {
 		devdbg("read net dev size: %d\n", l);
 		dev->net_stats.rx_packets++;
 		dev->net_stats.rx_bytes += l;
-		pkb->pk_len = l;
+		pkb_put(pkb, l);
 	}
 	return l;
 }
 
 
+// walk one retired rx block, frames are passed up in bursts
+static void physical_eth_rx_block(struct netdev* dev, struct tpacket_block_desc* bd)
+{
+    struct pkbuf* pkbs[NETDEV_RX_BURST];
+    struct tpacket3_hdr* ppd;
+    struct sockaddr_ll* sll;
+    unsigned int i;
+    int n = 0;
+
+    ppd = (struct tpacket3_hdr*)((unsigned char*)bd + bd->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < bd->hdr.bh1.num_pkts; i++,
+            ppd = (struct tpacket3_hdr*)((unsigned char*)ppd + ppd->tp_next_offset))
+    {
+        // our own frames are looped back to packet sockets
+        sll = (struct sockaddr_ll*)((unsigned char*)ppd + TPACKET_ALIGN(sizeof(*ppd)));
+        if (sll->sll_pkttype == PACKET_OUTGOING)
+            continue;
+        // copy out: the block goes back to the kernel right after the walk
+        struct pkbuf* pkb = alloc_netdev_pkb(dev);
+        if (ppd->tp_snaplen > pkb_tailroom(pkb))
+        {
+            free_pkb(pkb);
+            dev->net_stats.rx_errors++;
+            continue;
+        }
+        memcpy(pkb_put(pkb, ppd->tp_snaplen), (unsigned char*)ppd + ppd->tp_mac, ppd->tp_snaplen);
+        dev->net_stats.rx_packets++;
+        dev->net_stats.rx_bytes += ppd->tp_snaplen;
+        pkbs[n++] = pkb;
+        if (n == NETDEV_RX_BURST)
+        {
+            net_in_burst(dev, pkbs, n);
+            n = 0;
+        }
+    }
+    if (n)
+        net_in_burst(dev, pkbs, n);
+}
+
+static void physical_eth_ring_poll(struct netdev* dev)
+{
+    struct physical_eth_dev* priv = (struct physical_eth_dev*)dev->priv;
+    struct pollfd pfd = { .fd = priv->fd, .events = POLLIN | POLLERR };
+    struct tpacket_block_desc* bd;
+
+    peth_rx_dev = dev;
+    while (1) {
+        bd = (struct tpacket_block_desc*)(priv->ring +
+                (size_t)priv->rx_block * priv->req.tp_block_size);
+        if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+        {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        __sync_synchronize();
+        physical_eth_rx_block(dev, bd);
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        priv->rx_block = (priv->rx_block + 1) % priv->req.tp_block_nr;
+
+        // send the replies queued while handling the block
+        pthread_mutex_lock(&priv->tx_lock);
+        if (priv->tx_pending)
+            physical_eth_tx_kick(priv);
+        pthread_mutex_unlock(&priv->tx_lock);
+    }
+}
+
 void* physical_eth_poll(void* x)
 {
     struct netdev* dev = x;
+    struct physical_eth_dev* priv = (struct physical_eth_dev*)dev->priv;
+    struct pkbuf* pkbs[NETDEV_RX_BURST];
+
+    if (priv->ring)
+    {
+        physical_eth_ring_poll(dev);
+        return 0;
+    }
 	
 	while (1) {
-		/* get a packet and handle it */
-            
-        struct pkbuf *pkb = alloc_netdev_pkb(dev);
-        if (physical_eth_recv(dev, pkb) > 0)
-            net_in(dev, pkb);	/* pass to upper */
-        else
-            free_pkb(pkb);
+		/* wait for a packet, then take what else is queued */
+        int n = 0;
+        while (n < NETDEV_RX_BURST) {
+            struct pkbuf *pkb = alloc_netdev_pkb(dev);
+            if (physical_eth_recv(dev, pkb, n ? MSG_DONTWAIT : 0) <= 0) {
+                free_pkb(pkb);
+                break;
+            }
+            pkbs[n++] = pkb;
+        }
+        if (n)
+            net_in_burst(dev, pkbs, n);	/* pass to upper */
 	}
     return 0;
 }
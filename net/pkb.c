@@ -17,44 +17,373 @@ do {\
 	}\
 } while (0)
 
+/*
+ * pkbuf pool:
+ *  Every pkbuf comes from one of the fixed size classes below.
+ *  Each thread keeps a small free cache per class, which is refilled
+ *  from (or drained to) the global class free list in batches.
+ *  The global list only grows by whole slabs, so after warming up,
+ *  packet allocation and release never touch the heap.
+ *  Packets larger than the biggest class still use the heap.
+ */
+#define PKB_CACHE_SZ	64	/* max pkbufs cached by one thread per class */
+#define PKB_CACHE_BATCH	32	/* pkbufs moved by one refill/drain */
+#define PKB_SLAB_SZ	(128 * 1024)	/* memory grown by the global pool once */
+
+struct pkb_pool {
+	pthread_mutex_t mutex;
+	struct pkbuf *free;		/* global free list(linked by pk_list.next) */
+	int nr_free;
+	int size;			/* data room of this class */
+	const char *name;
+	/* statistics, protected by mutex */
+	unsigned long slabs;
+	unsigned long total;		/* pkbufs owned by the pool */
+	unsigned long refills;
+	unsigned long drains;
+	unsigned long allocs;		/* folded from exited thread caches */
+	unsigned long frees;
+};
+
+/* per-thread free cache */
+struct pkb_cache {
+	struct pkbuf *free[PKB_CLASS_NR][PKB_CACHE_SZ];
+	int count[PKB_CLASS_NR];
+	unsigned long allocs[PKB_CLASS_NR];
+	unsigned long frees[PKB_CLASS_NR];
+	struct list_head list;		/* node of pkb_caches */
+};
+
+#define PKB_POOL_INIT(_size, _name)\
+{\
+	.mutex = PTHREAD_MUTEX_INITIALIZER,\
+	.size = (_size),\
+	.name = (_name),\
+}
+
+static struct pkb_pool pkb_pools[PKB_CLASS_NR] = {
+	[PKB_CLASS_HDR] = PKB_POOL_INIT(PKB_HDR_ROOM, "header"),
+	[PKB_CLASS_MTU] = PKB_POOL_INIT(PKB_MTU_ROOM, "mtu"),
+	[PKB_CLASS_JUMBO] = PKB_POOL_INIT(PKB_JUMBO_ROOM, "jumbo"),
+};
+
+/* oversize packets(e.g. reassembled ip datagram) */
+static unsigned long pkb_heap_allocs;
+static unsigned long pkb_heap_frees;
+
+static LIST_HEAD(pkb_caches);
+static pthread_mutex_t pkb_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pkb_cache_key;
+static pthread_once_t pkb_cache_once = PTHREAD_ONCE_INIT;
+static __thread struct pkb_cache *pkb_tcache;
+
+static _inline int pkb_class(int size)
+{
+	if (size <= PKB_HDR_ROOM)
+		return PKB_CLASS_HDR;
+	if (size <= PKB_MTU_ROOM)
+		return PKB_CLASS_MTU;
+	if (size <= PKB_JUMBO_ROOM)
+		return PKB_CLASS_JUMBO;
+	return PKB_CLASS_HEAP;
+}
+
+static _inline int pkb_objsize(struct pkb_pool *pool)
+{
+	/* round every pkbuf in a slab up to whole cache lines */
+	return (sizeof(struct pkbuf) + pool->size + 63) & ~63;
+}
+
+/* Assert pool->mutex is held */
+static void pkb_pool_grow(struct pkb_pool *pool, int cls)
+{
+	struct pkbuf *pkb;
+	char *slab;
+	int objsize, nr, i;
+
+	objsize = pkb_objsize(pool);
+	nr = PKB_SLAB_SZ / objsize;
+	if (nr < PKB_CACHE_BATCH)
+		nr = PKB_CACHE_BATCH;
+	slab = xmalloc(nr * objsize);
+	for (i = 0; i < nr; i++) {
+		pkb = (struct pkbuf *)(slab + i * objsize);
+		pkb->pk_class = cls;
+		pkb->pk_list.next = (struct list_head *)pool->free;
+		pool->free = pkb;
+	}
+	pool->nr_free += nr;
+	pool->total += nr;
+	pool->slabs++;
+}
+
+static void pkb_cache_refill(struct pkb_cache *cache, int cls)
+{
+	struct pkb_pool *pool = &pkb_pools[cls];
+	struct pkbuf *pkb;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->nr_free < PKB_CACHE_BATCH)
+		pkb_pool_grow(pool, cls);
+	while (cache->count[cls] < PKB_CACHE_BATCH) {
+		pkb = pool->free;
+		pool->free = (struct pkbuf *)pkb->pk_list.next;
+		cache->free[cls][cache->count[cls]++] = pkb;
+	}
+	pool->nr_free -= PKB_CACHE_BATCH;
+	pool->refills++;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void pkb_cache_drain(struct pkb_cache *cache, int cls, int nr)
+{
+	struct pkb_pool *pool = &pkb_pools[cls];
+	struct pkbuf *pkb;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < nr; i++) {
+		pkb = cache->free[cls][--cache->count[cls]];
+		pkb->pk_list.next = (struct list_head *)pool->free;
+		pool->free = pkb;
+	}
+	pool->nr_free += nr;
+	pool->drains++;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* thread exit: give cached pkbufs back to global pools */
+static void pkb_cache_release(void *arg)
+{
+	struct pkb_cache *cache = arg;
+	int cls;
+
+	pthread_mutex_lock(&pkb_caches_mutex);
+	list_del(&cache->list);
+	pthread_mutex_unlock(&pkb_caches_mutex);
+	for (cls = 0; cls < PKB_CLASS_NR; cls++) {
+		if (cache->count[cls])
+			pkb_cache_drain(cache, cls, cache->count[cls]);
+		pthread_mutex_lock(&pkb_pools[cls].mutex);
+		pkb_pools[cls].allocs += cache->allocs[cls];
+		pkb_pools[cls].frees += cache->frees[cls];
+		pthread_mutex_unlock(&pkb_pools[cls].mutex);
+	}
+	free(cache);
+}
+
+static void pkb_cache_key_init(void)
+{
+	if (pthread_key_create(&pkb_cache_key, pkb_cache_release))
+		perrx("pthread_key_create");
+}
+
+static struct pkb_cache *pkb_cache_create(void)
+{
+	struct pkb_cache *cache;
+
+	pthread_once(&pkb_cache_once, pkb_cache_key_init);
+	cache = xzalloc(sizeof(*cache));
+	pthread_mutex_lock(&pkb_caches_mutex);
+	list_add_tail(&cache->list, &pkb_caches);
+	pthread_mutex_unlock(&pkb_caches_mutex);
+	pthread_setspecific(pkb_cache_key, cache);
+	pkb_tcache = cache;
+	return cache;
+}
+
+static _inline struct pkb_cache *pkb_cache_get(void)
+{
+	if (!pkb_tcache)
+		return pkb_cache_create();
+	return pkb_tcache;
+}
+
+static struct pkbuf *pkb_pool_get(int size)
+{
+	struct pkb_cache *cache;
+	struct pkbuf *pkb;
+	int cls;
+
+	cls = pkb_class(size);
+	if (cls == PKB_CLASS_HEAP) {
+		pkb = xmalloc(sizeof(*pkb) + size);
+		pkb->pk_class = PKB_CLASS_HEAP;
+		__sync_fetch_and_add(&pkb_heap_allocs, 1);
+		return pkb;
+	}
+	cache = pkb_cache_get();
+	if (!cache->count[cls])
+		pkb_cache_refill(cache, cls);
+	cache->allocs[cls]++;
+	return cache->free[cls][--cache->count[cls]];
+}
+
+static void pkb_pool_put(struct pkbuf *pkb)
+{
+	struct pkb_cache *cache;
+	int cls = pkb->pk_class;
+
+	if (cls == PKB_CLASS_HEAP) {
+		__sync_fetch_and_add(&pkb_heap_frees, 1);
+		free(pkb);
+		return;
+	}
+	cache = pkb_cache_get();
+	if (cache->count[cls] >= PKB_CACHE_SZ)
+		pkb_cache_drain(cache, cls, PKB_CACHE_BATCH);
+	cache->frees[cls]++;
+	cache->free[cls][cache->count[cls]++] = pkb;
+}
+
+void pkb_pool_stat(void)
+{
+	struct pkb_cache *cache;
+	struct pkb_pool *pool;
+	unsigned long allocs, frees;
+	int cls, cached;
+
+	printf("[pkbuf pool information]\n"
+		" class  room   slabs  total    free     cached   allocs       frees        refills    drains\n");
+	for (cls = 0; cls < PKB_CLASS_NR; cls++) {
+		pool = &pkb_pools[cls];
+		pthread_mutex_lock(&pkb_caches_mutex);
+		pthread_mutex_lock(&pool->mutex);
+		allocs = pool->allocs;
+		frees = pool->frees;
+		cached = 0;
+		/* thread caches are read without their owners' consent */
+		list_for_each_entry(cache, &pkb_caches, list) {
+			allocs += cache->allocs[cls];
+			frees += cache->frees[cls];
+			cached += cache->count[cls];
+		}
+		printf(" %-7s%-7d%-7lu%-9lu%-9d%-9d%-13lu%-13lu%-11lu%lu\n",
+			pool->name, pool->size, pool->slabs, pool->total,
+			pool->nr_free, cached, allocs, frees,
+			pool->refills, pool->drains);
+		pthread_mutex_unlock(&pool->mutex);
+		pthread_mutex_unlock(&pkb_caches_mutex);
+	}
+	printf(" %-7s%-7s%-7s%-9s%-9s%-9s%-13lu%lu\n", "heap", "-", "-", "-",
+		"-", "-", pkb_heap_allocs, pkb_heap_frees);
+}
+
 /* referred from linux-2.6: handing packet l2 padding */
 void pkb_trim(struct pkbuf *pkb, int len)
 {
 	pkb->pk_len = len;
-	if (realloc(pkb, sizeof(*pkb) + len) == NULL)
-		perrx("realloc");
+	pkb->pk_tail = pkb->pk_data + len;
 }
 
-struct pkbuf *alloc_pkb(int size)
+/* alloc an empty pkbuf whose buffer holds at least @size bytes */
+static _inline struct pkbuf *__alloc_pkb(int size)
 {
 	struct pkbuf *pkb;
-	pkb = xzalloc(sizeof(*pkb) + size);
-	pkb->pk_len = size;
+	pkb = pkb_pool_get(size);
+	pkb->pk_len = 0;
 	pkb->pk_pro = 0xffff;
 	pkb->pk_type = 0;
 	pkb->pk_refcnt = 1;
 	pkb->pk_indev = NULL;
 	pkb->pk_rtdst = NULL;
+	pkb->pk_sk = NULL;
+	pkb->pk_gso_size = 0;
+	pkb->pk_csum = PKB_CSUM_NONE;
+	pkb->pk_textsum = 0;
+	pkb->pk_head = pkb->pk_buf;
+	pkb->pk_data = pkb->pk_buf;
+	pkb->pk_tail = pkb->pk_buf;
+	if (pkb->pk_class == PKB_CLASS_HEAP)
+		pkb->pk_end = pkb->pk_buf + size;
+	else
+		pkb->pk_end = pkb->pk_buf + pkb_pools[pkb->pk_class].size;
+	pkb->pk_mh = NULL;
+	pkb->pk_nh = NULL;
+	pkb->pk_release = NULL;
+	pkb->pk_ext = NULL;
 	list_init(&pkb->pk_list);
 	alloc_pkbs++;
 	pkb_safe();
 	return pkb;
 }
 
+/*
+ * Alloc pkbuf for @size bytes of L4 data.
+ * Headers of lower layers are pkb_push()ed into the reserved headroom.
+ */
+struct pkbuf *alloc_pkb(int size)
+{
+	struct pkbuf *pkb;
+	pkb = __alloc_pkb(PKB_RESERVE + size);
+	/* protocol builders rely on zeroed headers */
+	memset(pkb->pk_head, 0, PKB_RESERVE + size);
+	pkb_reserve(pkb, PKB_RESERVE);
+	return pkb;
+}
+
+/*
+ * Alloc pkbuf for @size bytes of L4 data that the caller writes in full,
+ * e.g. copied payload: only the headroom for lower headers is zeroed.
+ */
+struct pkbuf *alloc_tx_pkb(int size)
+{
+	struct pkbuf *pkb;
+	pkb = __alloc_pkb(PKB_RESERVE + size);
+	memset(pkb->pk_head, 0, PKB_RESERVE);
+	pkb_reserve(pkb, PKB_RESERVE);
+	return pkb;
+}
+
+/*
+ * Received frame overwrites the buffer, so it is not zeroed.
+ * Driver reads frame into pk_data(at most pkb_tailroom()), then pkb_put()s it.
+ */
 struct pkbuf *alloc_netdev_pkb(struct netdev *nd)
 {
-	return alloc_pkb(nd->net_mtu + ETH_HRD_SZ);
+	return __alloc_pkb(nd->net_mtu + ETH_HRD_SZ);
+}
+
+/*
+ * Wrap external buffer @buf(@size bytes) into an empty pkbuf without copy.
+ * @release(pkb) gives the buffer back to its owner @ext when the last
+ * reference of pkbuf is dropped.
+ */
+struct pkbuf *alloc_ext_pkb(unsigned char *buf, int size,
+			void (*release)(struct pkbuf *), void *ext)
+{
+	struct pkbuf *pkb;
+	/* only the pkbuf head is used */
+	pkb = __alloc_pkb(0);
+	pkb->pk_head = buf;
+	pkb->pk_data = buf;
+	pkb->pk_tail = buf;
+	pkb->pk_end = buf + size;
+	pkb->pk_release = release;
+	pkb->pk_ext = ext;
+	return pkb;
 }
 
 struct pkbuf *copy_pkb(struct pkbuf *pkb)
 {
 	struct pkbuf *cpkb;
-	cpkb = xmalloc(pkb->pk_len);
-	memcpy(cpkb, pkb, pkb->pk_len);
-	cpkb->pk_refcnt = 1;
-	list_init(&cpkb->pk_list);
-	alloc_pkbs++;
-	pkb_safe();
+	cpkb = __alloc_pkb(pkb->pk_end - pkb->pk_head);
+	cpkb->pk_pro = pkb->pk_pro;
+	cpkb->pk_type = pkb->pk_type;
+	cpkb->pk_indev = pkb->pk_indev;
+	cpkb->pk_rtdst = pkb->pk_rtdst;
+	cpkb->pk_sk = pkb->pk_sk;
+	cpkb->pk_gso_size = pkb->pk_gso_size;
+	cpkb->pk_csum = pkb->pk_csum;
+	cpkb->pk_textsum = pkb->pk_textsum;
+	/* keep the same layout, so header pointers are still valid */
+	memcpy(cpkb->pk_head, pkb->pk_head, pkb->pk_tail - pkb->pk_head);
+	pkb_reserve(cpkb, pkb_headroom(pkb));
+	pkb_put(cpkb, pkb->pk_len);
+	if (pkb->pk_mh)
+		cpkb->pk_mh = cpkb->pk_head + (pkb->pk_mh - pkb->pk_head);
+	if (pkb->pk_nh)
+		cpkb->pk_nh = cpkb->pk_head + (pkb->pk_nh - pkb->pk_head);
 	return cpkb;
 }
 
@@ -66,15 +395,17 @@ void _free_pkb(struct pkbuf *pkb)
 void free_pkb(struct pkbuf *pkb)
 {
 #endif
-	if (--pkb->pk_refcnt <= 0) {
+	if (__atomic_sub_fetch(&pkb->pk_refcnt, 1, __ATOMIC_ACQ_REL) <= 0) {
 		free_pkbs++;
-		free(pkb);
+		if (pkb->pk_release)
+			pkb->pk_release(pkb);
+		pkb_pool_put(pkb);
 	}
 }
 
 void get_pkb(struct pkbuf *pkb)
 {
-	pkb->pk_refcnt++;
+	__atomic_fetch_add(&pkb->pk_refcnt, 1, __ATOMIC_RELAXED);
 }
 
 void pkbdbg(struct pkbuf *pkb)
@@ -107,4 +438,3 @@ void pkbdbg(struct pkbuf *pkb)
 	if ((i % 16) != 0)
 		ferr("\n");
 }
-
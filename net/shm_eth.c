@@ -1,21 +1,33 @@
 #include "shm_eth.h"
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 
-#define SHM_SIZE (2*1024*1024)
-#define SHM_MAGIC 0xd00ddaaa
-#define CB_CAPACITY ((SHM_SIZE - sizeof(struct shmeth_internal_t))/2 - sizeof(CB_T))
+#define SHM_MAGIC 0xd00ddaad
+#define SHM_BUF_SIZE 2048
+
+// used ring entry: buffer id, frame offset and length in the buffer
+#define SHM_DESC(id, off, len) (((uint64_t)(id) << 32) | ((uint64_t)(off) << 16) | (len))
+#define SHM_DESC_ID(d) ((uint32_t)((d) >> 32))
+#define SHM_DESC_OFF(d) ((uint32_t)((d) >> 16) & 0xffff)
+#define SHM_DESC_LEN(d) ((uint32_t)(d) & 0xffff)
 
 struct shmeth_internal_t
 {
     uint32_t magic;
+    uint32_t queue_nr;
+    uint64_t shm_size;
     uint8_t mac_a[6];
     uint8_t mac_b[6];
-};
+} __attribute__((aligned(SHM_RING_CACHELINE)));
 
 static void gen_random_mac(uint8_t* mac)
 {
@@ -34,63 +46,233 @@ static uint32_t string_hash(const char* cp)
     return hash;
 }
 
+// bytes of one direction with @buf_nr buffers: free ring, used rings, buffers
+static size_t shm_queue_size(uint32_t buf_nr, uint32_t queue_nr)
+{
+    return (1 + queue_nr) * SHM_RING_SIZE(buf_nr) + (size_t)buf_nr * SHM_BUF_SIZE;
+}
+
+// largest power-of-two buffer count of a direction fitting in @size bytes
+static uint32_t shm_queue_bufs_fit(size_t size, uint32_t queue_nr)
+{
+    uint32_t n = 1;
+    while (shm_queue_size(n * 2, queue_nr) <= size)
+        n *= 2;
+    return n;
+}
+
+// set up process-local pointers of the direction at @addr, init it if @init
+static void shm_queue_attach(struct shmeth_queue_t* q, uint8_t* addr, uint32_t buf_nr,
+                uint32_t queue_nr, bool init)
+{
+    uint32_t i;
 
-SHMETH_T* shmeth_open(const char* name, SHMETH_SIDE_T side)
+    q->free = (SHM_RING_T*)addr;
+    for (i = 0; i < queue_nr; i++)
+        q->used[i] = (SHM_RING_T*)(addr + (1 + i) * SHM_RING_SIZE(buf_nr));
+    q->bufs = addr + (1 + queue_nr) * SHM_RING_SIZE(buf_nr);
+    q->buf_nr = buf_nr;
+    q->buf_size = SHM_BUF_SIZE;
+    if (!init)
+        return;
+    // used rings have room for every buffer, so posting never fails;
+    // only their receivers sleep, nobody waits for free buffers
+    for (i = 0; i < queue_nr; i++)
+        shm_ring_init(q->used[i], buf_nr, true);
+    shm_ring_init(q->free, buf_nr, false);
+    for (i = 0; i < buf_nr; i++)
+    {
+        uint64_t id = i;
+        shm_ring_enqueue_burst(q->free, &id, 1);
+    }
+}
+
+// System V segment keyed by a hash of @name, in 4K pages
+static void* shm_map_sysv(SHMETH_T* shmeth, const char* name, size_t* size)
 {
+    struct shmid_ds ds;
     key_t shm_key = (key_t)string_hash(name);
-    int shm_id = shmget(shm_key, SHM_SIZE, IPC_CREAT | 0666);
+    void* addr;
+
+    int shm_id = shmget(shm_key, *size, IPC_CREAT | 0666);
     if (shm_id == -1)
     {
+        // exists with another size: attach it as it is
         printf("shmget failed: %d\n", errno);
-        shm_id = shmget(shm_key, SHM_SIZE, 0666);
-        if (shm_id != -1)
-        {
-            printf("Good. Crated.\n");
-        }
-        else
+        shm_id = shmget(shm_key, 0, 0666);
+        if (shm_id == -1)
         {
             printf("Still failed: %d\n", errno);
             return NULL;
         }
     }
-    void* shm_addr = shmat(shm_id, NULL, SHM_RND);
-    
-    
-    struct shmeth_internal_t* shmint = shm_addr;
+    if (shmctl(shm_id, IPC_STAT, &ds) == -1)
+        return NULL;
+    addr = shmat(shm_id, NULL, SHM_RND);
+    if (addr == (void*)-1)
+        return NULL;
+    shmeth->shm_id = shm_id;
+    shmeth->shm_fd = -1;
+    *size = ds.shm_segsz;
+    return addr;
+}
 
-    uint8_t* cb_atob_addr = (uint8_t*)shm_addr + sizeof(struct shmeth_internal_t);
-    uint8_t* cb_btoa_addr = cb_atob_addr + CB_SIZE(CB_CAPACITY);
+/*
+ * Segment in the file at @path. On hugetlbfs (e.g. /dev/hugepages/x) it
+ * is backed by huge pages and rounded up to the huge page size, so rings
+ * of many megabytes only take a few TLB entries.
+ */
+static void* shm_map_file(SHMETH_T* shmeth, const char* path, size_t* size)
+{
+    struct statfs fs;
+    struct stat st;
+    void* addr;
 
-    if (shmint->magic != SHM_MAGIC)
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
     {
-        // not initialized yet.
-        shmint->magic = SHM_MAGIC;
-        gen_random_mac(shmint->mac_a);
-        gen_random_mac(shmint->mac_b);
+        printf("shmeth: open %s failed: %d\n", path, errno);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || fstatfs(fd, &fs) == -1)
+        goto err;
+    if (st.st_size > 0)
+    {
+        // created by the peer
+        *size = st.st_size;
+    }
+    else
+    {
+        // f_bsize is the huge page size on hugetlbfs, the page size elsewhere
+        *size = (*size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+        if (ftruncate(fd, *size) == -1)
+            goto err;
+    }
+    addr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        printf("shmeth: mmap %s failed: %d\n", path, errno);
+        goto err;
+    }
+    shmeth->shm_id = -1;
+    shmeth->shm_fd = fd;
+    shmeth->shm_path = strdup(path);
+    return addr;
+err:
+    close(fd);
+    return NULL;
+}
 
-        cb_init((struct circular_buffer_t*)cb_atob_addr, CB_CAPACITY);
-        cb_init((struct circular_buffer_t*)cb_btoa_addr, CB_CAPACITY);
+// detach from the segment, leaving it to the peer
+static void shmeth_detach(SHMETH_T* shmeth)
+{
+    if (shmeth->shm_fd >= 0)
+    {
+        munmap(shmeth->shm_addr, shmeth->shm_size);
+        close(shmeth->shm_fd);
+        free(shmeth->shm_path);
     }
+    else
+    {
+        shmdt(shmeth->shm_addr);
+    }
+    free(shmeth);
+}
 
-    SHMETH_T* shmeth = malloc(sizeof(SHMETH_T));
-    shmeth->side = side;
-    shmeth->cb_atob = (CB_T*)cb_atob_addr;
-    shmeth->cb_btoa = (CB_T*)cb_btoa_addr;
+/*
+ * A @name starting with '/' is a file to map (see shm_map_file()),
+ * anything else names a System V segment.
+ * @queue_nr and @shm_size only apply to the side creating the segment,
+ * the other side takes them from the segment header.
+ */
+SHMETH_T* shmeth_open(const char* name, SHMETH_SIDE_T side, uint32_t queue_nr, size_t shm_size)
+{
+    SHMETH_T* shmeth;
+    void* shm_addr;
+    size_t map_size = shm_size;
+
+    if (queue_nr < 1 || queue_nr > SHMETH_MAX_QUEUES)
+    {
+        printf("shmeth: queue number must be 1..%d\n", SHMETH_MAX_QUEUES);
+        return NULL;
+    }
+    shmeth = calloc(1, sizeof(SHMETH_T));
+    if (name[0] == '/')
+        shm_addr = shm_map_file(shmeth, name, &map_size);
+    else
+        shm_addr = shm_map_sysv(shmeth, name, &map_size);
+    if (!shm_addr)
+    {
+        free(shmeth);
+        return NULL;
+    }
     shmeth->shm_addr = shm_addr;
-    shmeth->shm_id = shm_id;
+    shmeth->shm_size = map_size;
 
-    pthread_mutex_init(&shmeth->mutex, 0);
+    struct shmeth_internal_t* shmint = shm_addr;
+    bool init = __atomic_load_n(&shmint->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC;
+
+    if (init)
+    {
+        shm_size = map_size;
+    }
+    else
+    {
+        if (shmint->queue_nr != queue_nr || shmint->shm_size != shm_size)
+            printf("shmeth: using %u queues, %lu bytes of existing segment\n",
+                    shmint->queue_nr, (unsigned long)shmint->shm_size);
+        queue_nr = shmint->queue_nr;
+        shm_size = shmint->shm_size;
+    }
+
+    // the two directions split the segment evenly
+    size_t dir_bytes = (shm_size - sizeof(struct shmeth_internal_t)) / 2;
+    uint32_t buf_nr = shm_queue_bufs_fit(dir_bytes, queue_nr);
+    uint8_t* atob_addr = (uint8_t*)shm_addr + sizeof(struct shmeth_internal_t);
+    uint8_t* btoa_addr = atob_addr + shm_queue_size(buf_nr, queue_nr);
+
+    if (shm_queue_size(buf_nr, queue_nr) > dir_bytes)
+    {
+        printf("shmeth: segment of %lu bytes too small\n", (unsigned long)shm_size);
+        // it may be the peer's segment: do not remove it
+        shmeth_detach(shmeth);
+        return NULL;
+    }
+
+    shmeth->side = side;
+    shmeth->queue_nr = queue_nr;
+    shm_queue_attach(side == SHMETH_SIDE_A ? &shmeth->tx : &shmeth->rx, atob_addr, buf_nr,
+                        queue_nr, init);
+    shm_queue_attach(side == SHMETH_SIDE_A ? &shmeth->rx : &shmeth->tx, btoa_addr, buf_nr,
+                        queue_nr, init);
+    if (init)
+    {
+        // not initialized yet.
+        gen_random_mac(shmint->mac_a);
+        gen_random_mac(shmint->mac_b);
+        shmint->queue_nr = queue_nr;
+        shmint->shm_size = shm_size;
+        __atomic_store_n(&shmint->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    shmeth->spin_us = SHMETH_DEFAULT_SPIN_US;
+    shmeth->zero_copy = false;
 
     return shmeth;
 }
 
 void shmeth_close(SHMETH_T* shmeth)
 {
-    shmdt(shmeth->shm_addr);
-    // mark the memory to be deleted
-    shmctl(shmeth->shm_id, IPC_RMID, NULL);
-    pthread_mutex_destroy(&shmeth->mutex);
-    free(shmeth);
+    if (shmeth->shm_fd >= 0)
+    {
+        // freed once the peer unmaps it too
+        unlink(shmeth->shm_path);
+    }
+    else
+    {
+        // mark the memory to be deleted
+        shmctl(shmeth->shm_id, IPC_RMID, NULL);
+    }
+    shmeth_detach(shmeth);
 }
 
 void shmeth_get_mac(SHMETH_T* shmeth, SHMETH_SIDE_T side, uint8_t* buf)
@@ -108,17 +290,113 @@ void shmeth_get_mac(SHMETH_T* shmeth, SHMETH_SIDE_T side, uint8_t* buf)
     
 }
 
-bool shmeth_write_packet(SHMETH_T* shmeth, void* data, uint32_t len)
+// take a free buffer of tx.buf_size bytes, NULL if the peer holds them all
+uint8_t* shmeth_tx_alloc(SHMETH_T* shmeth, uint32_t* id)
+{
+    uint64_t ent;
+    if (shm_ring_dequeue_burst(shmeth->tx.free, &ent, 1) != 1)
+        return NULL;
+    *id = (uint32_t)ent;
+    return shmeth->tx.bufs + (size_t)*id * shmeth->tx.buf_size;
+}
+
+// give back a buffer which was not sent
+void shmeth_tx_free(SHMETH_T* shmeth, uint32_t id)
+{
+    uint64_t ent = id;
+    shm_ring_enqueue_burst(shmeth->tx.free, &ent, 1);
+}
+
+// pass the frame at @off of buffer @id to the peer, which frees the buffer
+bool shmeth_tx_send(SHMETH_T* shmeth, uint32_t queue, uint32_t id, uint32_t off, uint32_t len)
+{
+    uint64_t ent = SHM_DESC(id, off, len);
+    return shm_ring_enqueue_burst(shmeth->tx.used[queue], &ent, 1) == 1;
+}
+
+// must be called by one receiver thread per queue only
+uint32_t shmeth_rx_burst(SHMETH_T* shmeth, uint32_t queue, struct shmeth_frame_t* frames, uint32_t n)
 {
-    CB_T* cb = shmeth->side == SHMETH_SIDE_A? shmeth->cb_atob: shmeth->cb_btoa;
-    pthread_mutex_lock(&shmeth->mutex);
-    bool result = cb_put_packet(cb, data, len);
-    pthread_mutex_unlock(&shmeth->mutex);
-    return result;
+    uint64_t ents[n];
+    uint32_t i;
+
+    n = shm_ring_dequeue_burst(shmeth->rx.used[queue], ents, n);
+    for (i = 0; i < n; i++)
+    {
+        frames[i].id = SHM_DESC_ID(ents[i]);
+        frames[i].len = SHM_DESC_LEN(ents[i]);
+        frames[i].data = shmeth->rx.bufs + (size_t)frames[i].id * shmeth->rx.buf_size +
+                            SHM_DESC_OFF(ents[i]);
+    }
+    return n;
+}
+
+// done with a received frame, any thread may call it
+void shmeth_rx_free(SHMETH_T* shmeth, uint32_t id)
+{
+    uint64_t ent = id;
+    shm_ring_enqueue_burst(shmeth->rx.free, &ent, 1);
+}
+
+// buffers the peer can still send with
+uint32_t shmeth_rx_free_count(SHMETH_T* shmeth)
+{
+    return shm_ring_count(shmeth->rx.free);
 }
 
-bool shmeth_read_packet(SHMETH_T* shmeth, void* buf, uint32_t buflen, uint32_t* pktlen)
+// senders of this side may be many threads, the rings take care of it
+bool shmeth_write_packet(SHMETH_T* shmeth, uint32_t queue, void* data, uint32_t len)
 {
-    CB_T* cb = shmeth->side == SHMETH_SIDE_B? shmeth->cb_atob: shmeth->cb_btoa;
-    return cb_get_packet(cb, buf, buflen, pktlen);
+    return shmeth_write_burst(shmeth, queue, &data, &len, 1) == 1;
+}
+
+// must be called by one receiver thread per queue only
+bool shmeth_read_packet(SHMETH_T* shmeth, uint32_t queue, void* buf, uint32_t buflen, uint32_t* pktlen)
+{
+    return shmeth_read_burst(shmeth, queue, &buf, buflen, pktlen, 1) == 1;
+}
+
+// block the receiver thread of @queue until the peer sends something
+void shmeth_wait_packet(SHMETH_T* shmeth, uint32_t queue)
+{
+    shm_ring_cons_wait(shmeth->rx.used[queue], shmeth->spin_us, SHMETH_SLEEP_MS);
+}
+
+uint32_t shmeth_write_burst(SHMETH_T* shmeth, uint32_t queue, void* const* data,
+                const uint32_t* lens, uint32_t n)
+{
+    uint32_t i, id;
+    uint8_t* buf;
+
+    for (i = 0; i < n; i++)
+    {
+        if (lens[i] > shmeth->tx.buf_size)
+            break;
+        buf = shmeth_tx_alloc(shmeth, &id);
+        if (!buf)
+            break;
+        memcpy(buf, data[i], lens[i]);
+        shmeth_tx_send(shmeth, queue, id, 0, lens[i]);
+    }
+    return i;
+}
+
+/*
+ * Copy up to @n frames into @bufs of @buflen bytes each.
+ * Frames longer than @buflen are dropped with lens[i] = 0.
+ */
+uint32_t shmeth_read_burst(SHMETH_T* shmeth, uint32_t queue, void* const* bufs, uint32_t buflen,
+                uint32_t* lens, uint32_t n)
+{
+    struct shmeth_frame_t frames[n];
+    uint32_t i;
+
+    n = shmeth_rx_burst(shmeth, queue, frames, n);
+    for (i = 0; i < n; i++)
+    {
+        lens[i] = frames[i].len <= buflen ? frames[i].len : 0;
+        memcpy(bufs[i], frames[i].data, lens[i]);
+        shmeth_rx_free(shmeth, frames[i].id);
+    }
+    return n;
 }
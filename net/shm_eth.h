@@ -2,7 +2,7 @@
 #define _SHM_ETH_H_
 
 // A simulated ethernet interface using shared memory
-#include "fast_pipe.h"
+#include "shm_ring.h"
 #include "pthread.h"
 
 enum shmeth_side_t
@@ -13,23 +13,70 @@ enum shmeth_side_t
 
 typedef enum shmeth_side_t SHMETH_SIDE_T;
 
+// receiver busy-polls this long before sleeping on the ring futex
+#define SHMETH_DEFAULT_SPIN_US 50
+#define SHMETH_SLEEP_MS 100
+
+#define SHMETH_DEFAULT_SHM_SIZE (2*1024*1024)
+#define SHMETH_MAX_QUEUES 16
+
+/*
+ * One direction of the link: frames live in buffers of a shared pool,
+ * and are passed on one of the used rings, each drained by its own
+ * receiver thread.
+ */
+struct shmeth_queue_t
+{
+    SHM_RING_T* used[SHMETH_MAX_QUEUES];    // descriptors of sent frames, to the receiver
+    SHM_RING_T* free;   // ids of free buffers, back to the sender
+    uint8_t* bufs;
+    uint32_t buf_nr;
+    uint32_t buf_size;
+};
+
+// received frame, still in the shared buffer @id
+struct shmeth_frame_t
+{
+    uint32_t id;
+    uint32_t len;
+    uint8_t* data;
+};
+
 struct shmeth_t
 {
     SHMETH_SIDE_T side;
-    CB_T* cb_atob;
-    CB_T* cb_btoa;
-    int shm_id;
-    pthread_mutex_t mutex;
+    struct shmeth_queue_t tx;   // queue of this side
+    struct shmeth_queue_t rx;   // queue of the peer
+    uint32_t queue_nr;  // queue pairs in the segment
+    int shm_id;         // System V segment, or -1
+    int shm_fd;         // mapped file, or -1
+    char* shm_path;
     void* shm_addr;
+    size_t shm_size;
+    uint32_t spin_us;
+    bool zero_copy;     // netdev hands shared buffers out as pkbufs
 };
 
 typedef struct shmeth_t SHMETH_T;
 
-SHMETH_T* shmeth_open(const char* name, SHMETH_SIDE_T side);
+SHMETH_T* shmeth_open(const char* name, SHMETH_SIDE_T side, uint32_t queue_nr, size_t shm_size);
 void shmeth_close(SHMETH_T* shmeth);
 
 void shmeth_get_mac(SHMETH_T* shmeth, SHMETH_SIDE_T side, uint8_t* buf);
-bool shmeth_write_packet(SHMETH_T* shmeth, void* data, uint32_t len);
-bool shmeth_read_packet(SHMETH_T* shmeth, void* buf, uint32_t buflen, uint32_t* pktlen);
+bool shmeth_write_packet(SHMETH_T* shmeth, uint32_t queue, void* data, uint32_t len);
+bool shmeth_read_packet(SHMETH_T* shmeth, uint32_t queue, void* buf, uint32_t buflen, uint32_t* pktlen);
+void shmeth_wait_packet(SHMETH_T* shmeth, uint32_t queue);
+uint32_t shmeth_write_burst(SHMETH_T* shmeth, uint32_t queue, void* const* data,
+                const uint32_t* lens, uint32_t n);
+uint32_t shmeth_read_burst(SHMETH_T* shmeth, uint32_t queue, void* const* bufs, uint32_t buflen,
+                uint32_t* lens, uint32_t n);
+
+// zero copy: frames are built in / read from the shared buffers directly
+uint8_t* shmeth_tx_alloc(SHMETH_T* shmeth, uint32_t* id);
+void shmeth_tx_free(SHMETH_T* shmeth, uint32_t id);
+bool shmeth_tx_send(SHMETH_T* shmeth, uint32_t queue, uint32_t id, uint32_t off, uint32_t len);
+uint32_t shmeth_rx_burst(SHMETH_T* shmeth, uint32_t queue, struct shmeth_frame_t* frames, uint32_t n);
+void shmeth_rx_free(SHMETH_T* shmeth, uint32_t id);
+uint32_t shmeth_rx_free_count(SHMETH_T* shmeth);
 
 #endif
@@ -0,0 +1,145 @@
+#include "shm_ring.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+void shm_ring_init(SHM_RING_T* r, uint32_t size, bool waitable)
+{
+    r->prod_head = 0;
+    r->prod_tail = 0;
+    r->cons_head = 0;
+    r->cons_tail = 0;
+    r->sleeping = 0;
+    r->wake_seq = 0;
+    r->size = size;
+    r->mask = size - 1;
+    r->waitable = waitable;
+}
+
+uint32_t shm_ring_count(SHM_RING_T* r)
+{
+    return __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) -
+            __atomic_load_n(&r->cons_head, __ATOMIC_RELAXED);
+}
+
+/*
+ * Both ends reserve a range [head, head + n) with a CAS on their head index,
+ * copy entries, then publish the range by moving their tail index in
+ * reservation order, the way rte_ring does it.
+ */
+static inline void shm_ring_publish(uint32_t* tail, uint32_t head, uint32_t n)
+{
+    // earlier reservations of other threads are published first
+    while (__atomic_load_n(tail, __ATOMIC_RELAXED) != head)
+        cpu_relax();
+    // pairs with the acquire of the other end: entries are visible / free
+    __atomic_store_n(tail, head + n, __ATOMIC_RELEASE);
+}
+
+uint32_t shm_ring_enqueue_burst(SHM_RING_T* r, const uint64_t* ents, uint32_t n)
+{
+    uint32_t head, free_ents, i;
+
+    head = __atomic_load_n(&r->prod_head, __ATOMIC_RELAXED);
+    do
+    {
+        free_ents = r->size - (head - __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE));
+        if (n > free_ents)
+            n = free_ents;
+        if (n == 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&r->prod_head, &head, head + n,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (i = 0; i < n; i++)
+        r->ents[(head + i) & r->mask] = ents[i];
+    shm_ring_publish(&r->prod_tail, head, n);
+    if (!r->waitable)
+        return n;
+
+    // store prod_tail, load sleeping; receiver does the reverse
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED))
+    {
+        __atomic_fetch_add(&r->wake_seq, 1, __ATOMIC_RELAXED);
+        // not FUTEX_PRIVATE: the ring is shared between processes
+        syscall(SYS_futex, &r->wake_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return n;
+}
+
+uint32_t shm_ring_dequeue_burst(SHM_RING_T* r, uint64_t* ents, uint32_t n)
+{
+    uint32_t head, avail, i;
+
+    head = __atomic_load_n(&r->cons_head, __ATOMIC_RELAXED);
+    do
+    {
+        avail = __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) - head;
+        if (n > avail)
+            n = avail;
+        if (n == 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&r->cons_head, &head, head + n,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (i = 0; i < n; i++)
+        ents[i] = r->ents[(head + i) & r->mask];
+    shm_ring_publish(&r->cons_tail, head, n);
+    return n;
+}
+
+static inline bool shm_ring_empty(SHM_RING_T* r)
+{
+    return __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&r->cons_head, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void shm_ring_cons_wait(SHM_RING_T* r, uint32_t spin_us, uint32_t sleep_ms)
+{
+    struct timespec timeout = { sleep_ms / 1000, (sleep_ms % 1000) * 1000000 };
+    uint64_t deadline = 0;
+    uint32_t i, seq;
+
+    // spin: entries arriving under load are picked up without a syscall
+    for (i = 0; spin_us; i++)
+    {
+        if (!shm_ring_empty(r))
+            return;
+        if ((i & 63) == 0)
+        {
+            uint64_t now = now_us();
+            if (!deadline)
+                deadline = now + spin_us;
+            else if (now >= deadline)
+                break;
+        }
+        cpu_relax();
+    }
+
+    // park: announce, re-check, then sleep unless a producer bumped wake_seq
+    seq = __atomic_load_n(&r->wake_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_ring_empty(r))
+        syscall(SYS_futex, &r->wake_seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+    __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,60 @@
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+// Ring of 64-bit entries living in shared memory: power-of-two size,
+// lock-free multi-producer enqueue and multi-consumer dequeue.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SHM_RING_CACHELINE 64
+
+struct shm_ring_t
+{
+    // producer side: written by senders only
+    uint32_t prod_head __attribute__((aligned(SHM_RING_CACHELINE)));  // next entry to reserve
+    uint32_t prod_tail; // entries before it are readable
+
+    // consumer side: written by receivers only
+    uint32_t cons_head __attribute__((aligned(SHM_RING_CACHELINE)));  // next entry to take
+    uint32_t cons_tail; // entries before it are free
+    uint32_t sleeping;  // receiver is (about to be) parked on wake_seq
+    uint32_t wake_seq;  // futex word, only bumped by a producer waking the receiver
+
+    // constant after shm_ring_init()
+    uint32_t size __attribute__((aligned(SHM_RING_CACHELINE)));
+    uint32_t mask;
+    uint32_t waitable;  // a consumer may park in shm_ring_cons_wait()
+
+    uint64_t ents[] __attribute__((aligned(SHM_RING_CACHELINE)));
+};
+
+typedef struct shm_ring_t SHM_RING_T;
+
+/// bytes needed for a ring of @size (power of two) entries
+#define SHM_RING_SIZE(size) (sizeof(struct shm_ring_t) + (size_t)(size) * sizeof(uint64_t))
+
+/**
+ * Init a ring of @size entries, @size must be a power of two.
+ * Only @waitable rings can be waited on; producers of the others
+ * skip the check for a sleeping consumer.
+ */
+void shm_ring_init(SHM_RING_T* r, uint32_t size, bool waitable);
+
+/// Entries in the ring, may be stale by the time it returns
+uint32_t shm_ring_count(SHM_RING_T* r);
+
+/// Add up to @n entries, return the number enqueued
+uint32_t shm_ring_enqueue_burst(SHM_RING_T* r, const uint64_t* ents, uint32_t n);
+
+/// Take up to @n entries, return the number dequeued
+uint32_t shm_ring_dequeue_burst(SHM_RING_T* r, uint64_t* ents, uint32_t n);
+
+/**
+ * Wait for entries: busy-poll for @spin_us, then park on the
+ * futex in the ring until a producer enqueues (or @sleep_ms passes).
+ * Only one thread may wait on a ring, and it must be waitable.
+ */
+void shm_ring_cons_wait(SHM_RING_T* r, uint32_t spin_us, uint32_t sleep_ms);
+
+#endif
@@ -1,14 +1,94 @@
 #include "lib.h"
 #include "netif.h"
 #include "ether.h"
+#include "ip.h"
 #include "shm_eth.h"
 #include <arpa/inet.h>
 
+// pkbuf release callbacks: give the wrapped shared buffer back to its pool
+static void shmeth_tx_release(struct pkbuf* pkb)
+{
+    SHMETH_T* shmeth = pkb->pk_ext;
+    shmeth_tx_free(shmeth, (pkb->pk_head - shmeth->tx.bufs) / shmeth->tx.buf_size);
+}
+
+static void shmeth_rx_release(struct pkbuf* pkb)
+{
+    SHMETH_T* shmeth = pkb->pk_ext;
+    shmeth_rx_free(shmeth, (pkb->pk_head - shmeth->rx.bufs) / shmeth->rx.buf_size);
+}
+
+// tx pkbuf built in a shared buffer, so that xmit only passes a descriptor
+static struct pkbuf* shmeth_dev_alloc_pkb(struct netdev* d, int size)
+{
+    SHMETH_T* shmeth = d->priv;
+    struct pkbuf* pkb;
+    uint8_t* buf;
+    uint32_t id;
+
+    if (!shmeth->zero_copy || PKB_RESERVE + size > shmeth->tx.buf_size)
+        return NULL;
+    buf = shmeth_tx_alloc(shmeth, &id);
+    if (buf == NULL)
+        return NULL;
+    pkb = alloc_ext_pkb(buf, shmeth->tx.buf_size, shmeth_tx_release, shmeth);
+    pkb_reserve(pkb, PKB_RESERVE);
+    // same as alloc_tx_pkb(): only the headroom starts zeroed
+    memset(buf, 0, PKB_RESERVE);
+    return pkb;
+}
+
+/*
+ * Steer frames of one flow to one queue, so that each flow is received
+ * in order by one thread. Fragments are hashed on addresses only, all
+ * fragments of a datagram must meet in the same reassembly.
+ */
+static uint32_t shmeth_flow_hash(struct pkbuf* b)
+{
+    struct ether* eth = (struct ether*)b->pk_data;
+    struct ip* iphdr;
+    uint32_t h;
+
+    if (b->pk_len < ETH_HRD_SZ + IP_HRD_SZ || eth->eth_pro != _htons(ETH_P_IP))
+        return 0;
+    iphdr = (struct ip*)eth->eth_data;
+    h = (iphdr->ip_src * 0x9e3779b1) ^ iphdr->ip_dst ^ iphdr->ip_pro;
+    if ((iphdr->ip_pro == IP_P_TCP || iphdr->ip_pro == IP_P_UDP) &&
+        !(iphdr->ip_fragoff & _htons(IP_FRAG_MASK)) &&
+        b->pk_len >= ETH_HRD_SZ + iphlen(iphdr) + 4)
+    {
+        // source and destination port
+        h ^= *(uint32_t*)ipdata(iphdr);
+    }
+    h *= 0x9e3779b1;
+    return h ^ (h >> 16);
+}
+
 int shmeth_dev_xmit(struct netdev* d, struct pkbuf* b)
 {
     SHMETH_T* shmeth = (SHMETH_T*)d->priv;
-    bool ok = shmeth_write_packet(shmeth, b->pk_data, b->pk_len);
+    uint32_t queue = 0;
+    bool ok;
     int bytes = 0;
+
+    if (shmeth->queue_nr > 1)
+        queue = shmeth_flow_hash(b) % shmeth->queue_nr;
+
+    if (b->pk_release == shmeth_tx_release && b->pk_ext == shmeth && b->pk_refcnt == 1)
+    {
+        // frame already lives in our shared buffer: the peer frees it
+        uint32_t id = (b->pk_head - shmeth->tx.bufs) / shmeth->tx.buf_size;
+        ok = shmeth_tx_send(shmeth, queue, id, b->pk_data - b->pk_head, b->pk_len);
+        if (ok)
+        {
+            b->pk_release = NULL;
+            b->pk_ext = NULL;
+        }
+    }
+    else
+    {
+        ok = shmeth_write_packet(shmeth, queue, b->pk_data, b->pk_len);
+    }
     
     if (!ok) {
         d->net_stats.tx_errors++;
@@ -32,49 +112,116 @@ void shmeth_dev_exit(struct netdev* d)
     shmeth_close(shmeth);
 }
 
+// wrap a received frame, or copy it out when the peer runs short of buffers
+static struct pkbuf* shmeth_rx_pkb(struct netdev* dev, struct shmeth_frame_t* f, bool zero_copy)
+{
+    SHMETH_T* shmeth = dev->priv;
+    struct pkbuf* pkb;
+    uint8_t* buf;
+
+    if (zero_copy)
+    {
+        buf = shmeth->rx.bufs + (size_t)f->id * shmeth->rx.buf_size;
+        pkb = alloc_ext_pkb(buf, shmeth->rx.buf_size, shmeth_rx_release, shmeth);
+        pkb_reserve(pkb, f->data - buf);
+        pkb_put(pkb, f->len);
+        return pkb;
+    }
+
+    pkb = alloc_netdev_pkb(dev);
+    if (f->len > pkb_tailroom(pkb))
+    {
+        free_pkb(pkb);
+        pkb = NULL;
+    }
+    else
+    {
+        memcpy(pkb_put(pkb, f->len), f->data, f->len);
+    }
+    shmeth_rx_free(shmeth, f->id);
+    return pkb;
+}
+
+// one receiver thread per queue
+struct shmeth_rxq_t
+{
+    struct netdev* dev;
+    uint32_t queue;
+};
+
 static void* shmeth_rx_thread(void* x)
 {
-    struct netdev* dev = x;
+    struct shmeth_rxq_t* rxq = x;
+    struct netdev* dev = rxq->dev;
     SHMETH_T* shmeth = dev->priv;
+    struct shmeth_frame_t frames[NETDEV_RX_BURST];
+    struct pkbuf* pkbs[NETDEV_RX_BURST];
+    uint32_t i, n;
+    bool zero_copy;
+    int nr_in;
 
     while (1)
     {
-        struct pkbuf *pkb = alloc_netdev_pkb(dev);
-        while (1)
+        n = shmeth_rx_burst(shmeth, rxq->queue, frames, NETDEV_RX_BURST);
+        if (n == 0)
         {
-            uint32_t pktlen;
-            bool ok = shmeth_read_packet(shmeth, pkb->pk_data, pkb->pk_len, &pktlen);
-            if (ok)
-            {
-                pkb->pk_len = pktlen;
-                break;
-            }
-            else
+            shmeth_wait_packet(shmeth, rxq->queue);
+            continue;
+        }
+
+        // frames held by slow consumers (socket queues, arp) must not
+        // starve the sender, so keep a quarter of the pool free
+        zero_copy = shmeth->zero_copy &&
+                    shmeth_rx_free_count(shmeth) >= shmeth->rx.buf_nr / 4;
+        nr_in = 0;
+        for (i = 0; i < n; i++)
+        {
+            pkbs[nr_in] = shmeth_rx_pkb(dev, &frames[i], zero_copy);
+            if (!pkbs[nr_in])
             {
-                usleep(25);
+                dev->net_stats.rx_errors++;
+                continue;
             }
+            dev->net_stats.rx_packets++;
+            dev->net_stats.rx_bytes += frames[i].len;
+            nr_in++;
         }
-
-		dev->net_stats.rx_packets++;
-		dev->net_stats.rx_bytes += pkb->pk_len;
-        net_in(dev, pkb);
+        net_in_burst(dev, pkbs, nr_in);
     }
     return 0;
 }
 
-struct netdev* shmeth_dev_create(const char* devname, const char* side, char* ipstr, int maskbits)
+/*
+ * @spin_us: rx busy-poll budget before sleeping, 0 to sleep at once
+ * @zero_copy: build tx frames in and receive frames from the shared buffers
+ * @queue_nr: queue pairs, each with its own rx thread
+ * @shm_size: bytes of the shared segment, 0 for default
+ */
+struct netdev* shmeth_dev_create(const char* devname, const char* side, char* ipstr, int maskbits,
+                int spin_us, int zero_copy, int queue_nr, size_t shm_size)
 {
     struct netdev* dev;
+    struct shmeth_rxq_t* rxqs;
+    pthread_t tid;
+    uint32_t i;
     static struct netdev_ops peth_ops = {
         .init = shmeth_dev_init,
         .xmit = shmeth_dev_xmit,
+        .alloc_pkb = shmeth_dev_alloc_pkb,
         .exit = shmeth_dev_exit,
     };
     SHMETH_SIDE_T s = SHMETH_SIDE_A;
 
     if (!strcmp(side, "B") || !strcmp(side, "b"))
         s = SHMETH_SIDE_B;
-    SHMETH_T* shmeth = shmeth_open(devname, s);
+    if (shm_size == 0)
+        shm_size = SHMETH_DEFAULT_SHM_SIZE;
+    SHMETH_T* shmeth = shmeth_open(devname, s, queue_nr, shm_size);
+    if (!shmeth)
+        return NULL;
+    if (spin_us >= 0)
+        shmeth->spin_us = spin_us;
+    shmeth->zero_copy = zero_copy;
 
     printf("Allocating peth device\n");
     dev = netdev_alloc("shmeth", &peth_ops, shmeth);
@@ -83,8 +230,13 @@ struct netdev* shmeth_dev_create(const char* devname, const char* side, char* ip
     str2ip(ipstr, &dev->net_ipaddr);
     dev->net_mask = htonl(~((1<<(32-maskbits)) - 1));
     dev->priv = shmeth;
-    // just start the rx thread now
-    pthread_t tid;
-    pthread_create(&tid, 0, shmeth_rx_thread, dev);
+    // just start the rx threads now
+    rxqs = calloc(shmeth->queue_nr, sizeof(*rxqs));
+    for (i = 0; i < shmeth->queue_nr; i++)
+    {
+        rxqs[i].dev = dev;
+        rxqs[i].queue = i;
+        pthread_create(&tid, 0, shmeth_rx_thread, &rxqs[i]);
+    }
     return dev;
 }
@@ -93,7 +93,7 @@ static struct netdev_ops veth_ops = {
 static int veth_recv(struct pkbuf *pkb)
 {
 	int l;
-	l = read(tap->fd, pkb->pk_data, pkb->pk_len);
+	l = read(tap->fd, pkb->pk_data, pkb_tailroom(pkb));
 	if (l <= 0) {
 		devdbg("read net dev");
 		veth->net_stats.rx_errors++;
@@ -101,18 +101,29 @@ static int veth_recv(struct pkbuf *pkb)
 		devdbg("read net dev size: %d\n", l);
 		veth->net_stats.rx_packets++;
 		veth->net_stats.rx_bytes += l;
-		pkb->pk_len = l;
+		pkb_put(pkb, l);
 	}
 	return l;
 }
 
 static void veth_rx(void)
 {
-	struct pkbuf *pkb = alloc_netdev_pkb(veth);
-	if (veth_recv(pkb) > 0)
-		net_in(veth, pkb);	/* pass to upper */
-	else
-		free_pkb(pkb);
+	struct pkbuf *pkbs[NETDEV_RX_BURST];
+	struct pkbuf *pkb;
+	struct pollfd pfd = { .fd = tap->fd, .events = POLLIN };
+	int n = 0;
+
+	/* take all queued packets, up to one burst */
+	do {
+		pkb = alloc_netdev_pkb(veth);
+		if (veth_recv(pkb) <= 0) {
+			free_pkb(pkb);
+			break;
+		}
+		pkbs[n++] = pkb;
+	} while (n < NETDEV_RX_BURST && poll(&pfd, 1, 0) > 0);
+	if (n)
+		net_in_burst(veth, pkbs, n);	/* pass to upper */
 }
 
 void veth_poll(void)
@@ -0,0 +1,481 @@
+#include "lib.h"
+#include "netif.h"
+#include "ether.h"
+#include <stddef.h>
+#include <string.h>
+#include <net/if.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_DEVICE_NAME_LEN	16
+#define XDP_FRAME_SIZE		2048	/* umem chunk, one frame each */
+#define XDP_FRAME_NR		4096	/* half for rx (fill ring), half for tx */
+#define XDP_RING_SIZE		2048
+
+// single producer/consumer ring shared with the kernel
+struct xdp_ring
+{
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    void* desc;
+    uint32_t mask;
+    void* map;
+    size_t map_size;
+};
+
+struct xdp_dev
+{
+    int fd;
+    int ifindex;
+    int queue_id;
+    int zero_copy;
+    unsigned int ip;
+    unsigned int mask;
+    char device_name[XDP_DEVICE_NAME_LEN];
+
+    unsigned char* umem;
+    struct xdp_ring fq;	// fill: frames given to kernel for rx
+    struct xdp_ring cq;	// completion: tx frames sent by kernel
+    struct xdp_ring rx;
+    struct xdp_ring tx;
+
+    // umem frames free for tx
+    uint64_t tx_frames[XDP_FRAME_NR / 2];
+    uint32_t tx_free;
+    uint32_t tx_pending;	// tx descs produced since the last kick
+    pthread_mutex_t tx_lock;
+
+    // redirect program and its xskmap
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    int ready;	// set up to the xskmap entry, init() result is not returned
+};
+
+// set in the rx thread: frames it sends are kicked once per rx burst
+static __thread struct netdev* xdp_rx_dev;
+
+static int sys_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Load and attach: return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS)
+ * Frames of a queue without a bound socket go on to the kernel stack.
+ */
+static int xdp_prog_attach(struct xdp_dev* priv)
+{
+    union bpf_attr attr;
+    char log[1024];
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = priv->queue_id + 1;
+    priv->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (priv->map_fd < 0)
+    {
+        perror("bpf map create");
+        return -1;
+    }
+
+    struct bpf_insn insns[] = {
+        // r2 = ctx->rx_queue_index
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+          .off = offsetof(struct xdp_md, rx_queue_index) },
+        // r1 = xsks_map
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+          .src_reg = BPF_PSEUDO_MAP_FD, .imm = priv->map_fd },
+        { 0 },
+        // r3 = XDP_PASS if no socket
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (unsigned long)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (unsigned long)"GPL";
+    attr.log_buf = (unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    log[0] = '\0';
+    priv->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (priv->prog_fd < 0)
+    {
+        perror("bpf prog load");
+        printf("%s\n", log);
+        return -1;
+    }
+
+    // the program stays attached while link_fd is open
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = priv->prog_fd;
+    attr.link_create.target_ifindex = priv->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = priv->zero_copy ? XDP_FLAGS_DRV_MODE : 0;
+    priv->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (priv->link_fd < 0)
+    {
+        perror("bpf link create");
+        return -1;
+    }
+    return 0;
+}
+
+static int xdp_ring_map(struct xdp_dev* priv, struct xdp_ring* r, struct xdp_ring_offset* off,
+                        uint32_t size, size_t desc_size, off_t pgoff)
+{
+    r->map_size = off->desc + size * desc_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, priv->fd, pgoff);
+    if (r->map == MAP_FAILED)
+    {
+        perror("mmap xdp ring");
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t*)((unsigned char*)r->map + off->producer);
+    r->consumer = (uint32_t*)((unsigned char*)r->map + off->consumer);
+    r->flags = (uint32_t*)((unsigned char*)r->map + off->flags);
+    r->desc = (unsigned char*)r->map + off->desc;
+    r->mask = size - 1;
+    return 0;
+}
+
+static int xdp_socket_setup(struct xdp_dev* priv)
+{
+    struct xdp_umem_reg mr;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen = sizeof(off);
+    int size = XDP_RING_SIZE;
+    uint32_t i;
+
+    priv->umem = mmap(NULL, (size_t)XDP_FRAME_SIZE * XDP_FRAME_NR, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (priv->umem == MAP_FAILED)
+    {
+        perror("mmap umem");
+        priv->umem = NULL;
+        return -1;
+    }
+    priv->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (priv->fd < 0)
+    {
+        perror("socket AF_XDP");
+        return -1;
+    }
+
+    memset(&mr, 0, sizeof(mr));
+    mr.addr = (unsigned long)priv->umem;
+    mr.len = (uint64_t)XDP_FRAME_SIZE * XDP_FRAME_NR;
+    mr.chunk_size = XDP_FRAME_SIZE;
+    if (setsockopt(priv->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0 ||
+        setsockopt(priv->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(priv->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(priv->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(priv->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+    {
+        perror("setsockopt SOL_XDP");
+        return -1;
+    }
+    if (getsockopt(priv->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+    {
+        perror("getsockopt XDP_MMAP_OFFSETS");
+        return -1;
+    }
+    if (xdp_ring_map(priv, &priv->fq, &off.fr, size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        xdp_ring_map(priv, &priv->cq, &off.cr, size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        xdp_ring_map(priv, &priv->rx, &off.rx, size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        xdp_ring_map(priv, &priv->tx, &off.tx, size, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+        return -1;
+
+    // first half of umem is rx buffers, all given to the kernel
+    uint64_t* fq_desc = priv->fq.desc;
+    for (i = 0; i < XDP_FRAME_NR / 2 && i <= priv->fq.mask; i++)
+        fq_desc[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    __atomic_store_n(priv->fq.producer, i, __ATOMIC_RELEASE);
+    // second half for tx
+    for (i = 0; i < XDP_FRAME_NR / 2; i++)
+        priv->tx_frames[i] = (uint64_t)(XDP_FRAME_NR / 2 + i) * XDP_FRAME_SIZE;
+    priv->tx_free = XDP_FRAME_NR / 2;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = priv->ifindex;
+    sxdp.sxdp_queue_id = priv->queue_id;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | (priv->zero_copy ? XDP_ZEROCOPY : XDP_COPY);
+    if (bind(priv->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) < 0)
+    {
+        perror("bind AF_XDP");
+        return -1;
+    }
+
+    if (xdp_prog_attach(priv) < 0)
+        return -1;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = priv->map_fd;
+    attr.key = (unsigned long)&priv->queue_id;
+    attr.value = (unsigned long)&priv->fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        perror("bpf map update");
+        return -1;
+    }
+    priv->ready = 1;
+    return 0;
+}
+
+// ask the kernel to send produced tx descs
+static void xdp_tx_kick(struct xdp_dev* priv)
+{
+    if (!priv->zero_copy || (*priv->tx.flags & XDP_RING_NEED_WAKEUP))
+    {
+        if (sendto(priv->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+            devdbg("xdp tx kick");
+    }
+    priv->tx_pending = 0;
+}
+
+// take back tx frames the kernel has sent
+static void xdp_tx_complete(struct xdp_dev* priv)
+{
+    uint32_t cons = *priv->cq.consumer;
+    uint32_t prod = __atomic_load_n(priv->cq.producer, __ATOMIC_ACQUIRE);
+    uint64_t* desc = priv->cq.desc;
+
+    for (; cons != prod; cons++)
+        priv->tx_frames[priv->tx_free++] = desc[cons & priv->cq.mask];
+    __atomic_store_n(priv->cq.consumer, cons, __ATOMIC_RELEASE);
+}
+
+int xdp_dev_xmit(struct netdev* d, struct pkbuf* b)
+{
+    struct xdp_dev* priv = (struct xdp_dev*)d->priv;
+    struct xdp_desc* desc;
+    uint32_t prod;
+    int l = b->pk_len;
+
+    if (l > XDP_FRAME_SIZE)
+    {
+        d->net_stats.tx_errors++;
+        return 0;
+    }
+    pthread_mutex_lock(&priv->tx_lock);
+    if (!priv->tx_free)
+    {
+        // frames held by unkicked descs cannot complete
+        if (priv->tx_pending)
+            xdp_tx_kick(priv);
+        xdp_tx_complete(priv);
+    }
+    prod = *priv->tx.producer;
+    if (!priv->tx_free ||
+        prod - __atomic_load_n(priv->tx.consumer, __ATOMIC_ACQUIRE) > priv->tx.mask)
+    {
+        pthread_mutex_unlock(&priv->tx_lock);
+        d->net_stats.tx_errors++;
+        return 0;
+    }
+    desc = (struct xdp_desc*)priv->tx.desc + (prod & priv->tx.mask);
+    desc->addr = priv->tx_frames[--priv->tx_free];
+    desc->len = l;
+    desc->options = 0;
+    memcpy(priv->umem + desc->addr, b->pk_data, l);
+    __atomic_store_n(priv->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    priv->tx_pending++;
+    // the rx thread kicks after its burst, other senders kick now
+    if (xdp_rx_dev != d)
+        xdp_tx_kick(priv);
+    pthread_mutex_unlock(&priv->tx_lock);
+
+    d->net_stats.tx_packets++;
+    d->net_stats.tx_bytes += l;
+    return l;
+}
+
+int xdp_dev_init(struct netdev* d)
+{
+    struct xdp_dev* priv = (struct xdp_dev*)d->priv;
+    struct ifreq ifr;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, priv->device_name, sizeof(ifr.ifr_name) - 1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+    {
+        perror("ioctl");
+        close(fd);
+        return -1;
+    }
+    priv->ifindex = ifr.ifr_ifindex;
+    if (ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+    {
+        perror("ioctl MTU");
+        close(fd);
+        return -1;
+    }
+    d->net_mtu = ifr.ifr_mtu;
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+    {
+        perror("ioctl MAC");
+        close(fd);
+        return -1;
+    }
+    hwacpy(d->net_hwaddr, ifr.ifr_hwaddr.sa_data);
+    close(fd);
+
+    d->net_ipaddr = priv->ip;
+    d->net_mask = priv->mask;
+    pthread_mutex_init(&priv->tx_lock, NULL);
+    return xdp_socket_setup(priv);
+}
+
+void xdp_dev_exit(struct netdev* d)
+{
+    struct xdp_dev* priv = (struct xdp_dev*)d->priv;
+    struct xdp_ring* rings[] = { &priv->fq, &priv->cq, &priv->rx, &priv->tx };
+    unsigned int i;
+
+    // closing the link detaches the program
+    if (priv->link_fd >= 0)
+        close(priv->link_fd);
+    if (priv->prog_fd >= 0)
+        close(priv->prog_fd);
+    if (priv->map_fd >= 0)
+        close(priv->map_fd);
+    for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->map_size);
+    if (priv->fd >= 0)
+        close(priv->fd);
+    if (priv->umem)
+        munmap(priv->umem, (size_t)XDP_FRAME_SIZE * XDP_FRAME_NR);
+    free(priv);
+    d->priv = 0;
+}
+
+static void* xdp_rx_thread(void* x)
+{
+    struct netdev* dev = x;
+    struct xdp_dev* priv = (struct xdp_dev*)dev->priv;
+    struct pollfd pfd = { .fd = priv->fd, .events = POLLIN };
+    struct pkbuf* pkbs[NETDEV_RX_BURST];
+    struct xdp_desc* rx_desc = priv->rx.desc;
+    uint64_t* fq_desc = priv->fq.desc;
+
+    xdp_rx_dev = dev;
+    while (1)
+    {
+        uint32_t cons = *priv->rx.consumer;
+        uint32_t prod = __atomic_load_n(priv->rx.producer, __ATOMIC_ACQUIRE);
+        uint32_t fq_prod = *priv->fq.producer;
+        int n = 0;
+
+        if (cons == prod)
+        {
+            // kernel needs a syscall to refill when fill ring ran dry
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        for (; cons != prod && n < NETDEV_RX_BURST; cons++)
+        {
+            struct xdp_desc* desc = &rx_desc[cons & priv->rx.mask];
+            struct pkbuf* pkb = alloc_netdev_pkb(dev);
+            // copy out so that the frame goes straight back to the fill ring
+            if (desc->len > pkb_tailroom(pkb))
+            {
+                free_pkb(pkb);
+                dev->net_stats.rx_errors++;
+            }
+            else
+            {
+                memcpy(pkb_put(pkb, desc->len), priv->umem + desc->addr, desc->len);
+                dev->net_stats.rx_packets++;
+                dev->net_stats.rx_bytes += desc->len;
+                pkbs[n++] = pkb;
+            }
+            fq_desc[fq_prod++ & priv->fq.mask] = desc->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        }
+        __atomic_store_n(priv->rx.consumer, cons, __ATOMIC_RELEASE);
+        __atomic_store_n(priv->fq.producer, fq_prod, __ATOMIC_RELEASE);
+
+        net_in_burst(dev, pkbs, n);
+
+        // send the replies queued while handling the burst
+        pthread_mutex_lock(&priv->tx_lock);
+        if (priv->tx_pending)
+            xdp_tx_kick(priv);
+        pthread_mutex_unlock(&priv->tx_lock);
+    }
+    return 0;
+}
+
+/*
+ * AF_XDP device on queue @queue_id of kernel interface @device.
+ * @zero_copy: XDP_ZEROCOPY bind and native driver mode, needs driver support.
+ *             Only the kernel side avoids a copy: rx frames are still copied
+ *             into pkbufs and tx pkbufs into umem.
+ */
+struct netdev* xdp_dev_create(const char* device, char* ipstr, int maskbits,
+                int queue_id, int zero_copy)
+{
+    struct netdev* dev;
+    static struct netdev_ops xdp_ops = {
+        .init = xdp_dev_init,
+        .xmit = xdp_dev_xmit,
+        .exit = xdp_dev_exit,
+    };
+
+    struct xdp_dev* priv = (struct xdp_dev*)malloc(sizeof(struct xdp_dev));
+    memset(priv, 0, sizeof(*priv));
+    priv->fd = priv->map_fd = priv->prog_fd = priv->link_fd = -1;
+    priv->queue_id = queue_id;
+    priv->zero_copy = zero_copy;
+    strncpy(priv->device_name, device, XDP_DEVICE_NAME_LEN - 1);
+    str2ip(ipstr, &priv->ip);
+    priv->mask = htonl(~((1<<(32-maskbits)) - 1));
+
+    printf("Allocating xdp device\n");
+    dev = netdev_alloc("xdp", &xdp_ops, priv);
+    if (!priv->ready)
+    {
+        printf("Failed to set up AF_XDP on %s queue %d\n", device, queue_id);
+        // xdp_dev_exit() closes the link, which detaches the program
+        netdev_free(dev);
+        return NULL;
+    }
+    // just start the rx thread now
+    pthread_t tid;
+    pthread_create(&tid, 0, xdp_rx_thread, dev);
+    return dev;
+}
@@ -29,6 +29,7 @@ pthread_t newthread(pfunc_t thread_func)
 
 void net_stack_init(void)
 {
+	checksum_init();
 	netdev_init();
 	arp_cache_init();
 	rt_init();
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "netif.h"
 #include "ip.h"
@@ -9,6 +11,7 @@
 #include "route.h"
 #include "netcfg.h"
 #include "sock.h"
+#include "tcp.h"
 #include "cbuf.h"
 
 unsigned int net_debug = 0;
@@ -91,7 +94,29 @@ void netdebug(int argc, char **argv)
 
 void arpcache(int argc, char **argv)
 {
-	arp_cache_traverse();
+	int max;
+
+	if (argc == 1) {
+		arp_cache_traverse();
+	} else if (argc == 2 && !strcmp(argv[1], "stat")) {
+		arp_cache_stat();
+	} else if (argc == 3 && !strcmp(argv[1], "max") &&
+			(max = atoi(argv[2])) > 0) {
+		/* entries beyond it go as new ones come in */
+		arp_cache_max = max;
+	} else {
+		ferr("Usage: arpcache [stat|max entries]\n");
+	}
+}
+
+void tcphash(int argc, char **argv)
+{
+	if (argc == 1)
+		tcp_hash_stat();
+	else if (argc == 2 && !strcmp(argv[1], "reset"))
+		tcp_hash_stat_reset();
+	else
+		ferr("Usage: tcphash [reset]\n");
 }
 
 void route(int argc, char **argv)
@@ -121,60 +146,134 @@ void route(int argc, char **argv)
 	}
 }
 
-extern struct netdev* physical_eth_init(const char* device, const char* ipstr, int maskbits);
+extern struct netdev* physical_eth_init(const char* device, const char* ipstr, int maskbits,
+		int ring, unsigned int block_size, unsigned int block_nr, unsigned int frame_size);
 void attach_dev(int argc, char** argv)
 {
-	if (argc != 4)
+	unsigned int block_size = 0, block_nr = 0, frame_size = 0;
+	int ring = (argc > 4);
+	if (argc < 4 || argc > 8 || (argc > 4 && strcmp(argv[4], "mmap")))
 	{
-		printf("Usage: attach_dev [devname] [ip] [mask]");
+		printf("Usage: attach_dev [devname] [ip] [mask] [mmap [block_size] [block_nr] [frame_size]]");
 		return;
 	}
 	char* devname = argv[1];
 	char* ip = argv[2];
 	char* netmask = argv[3];
+	// PACKET_MMAP rings, 0 for default sizes
+	if (argc > 5)
+		block_size = strtoul(argv[5], NULL, 0);
+	if (argc > 6)
+		block_nr = strtoul(argv[6], NULL, 0);
+	if (argc > 7)
+		frame_size = strtoul(argv[7], NULL, 0);
 	// init the device
-	struct netdev* peth = physical_eth_init(devname, ip, atoi(netmask));
+	struct netdev* peth = physical_eth_init(devname, ip, atoi(netmask),
+						ring, block_size, block_nr, frame_size);
 	// add route table
 	rt_add(peth->net_ipaddr, 0xffffffff, 0, 0, RT_LOCALHOST, loop);
 	rt_add(LOCALNET(peth), peth->net_mask, 0, 0, RT_NONE, peth);
 }
 
+extern struct netdev* xdp_dev_create(const char* device, char* ipstr, int maskbits,
+		int queue_id, int zero_copy);
+void attach_xdp(int argc, char** argv)
+{
+	int zero_copy = 0;
+	int queue_id = 0;
+	if (argc < 4 || argc > 6 || (argc > 4 && strcmp(argv[4], "copy") &&
+					strcmp(argv[4], "zerocopy")))
+	{
+		printf("Usage: attach_xdp [devname] [ip] [mask] [copy|zerocopy] [queue]\n"
+			"zerocopy: kernel does not copy into umem, the stack still copies between umem and pkbufs");
+		return;
+	}
+	char* devname = argv[1];
+	char* ip = argv[2];
+	char* netmask = argv[3];
+	if (argc > 4)
+		zero_copy = !strcmp(argv[4], "zerocopy");
+	if (argc > 5)
+		queue_id = atoi(argv[5]);
+	// init the device
+	struct netdev* dev = xdp_dev_create(devname, ip, atoi(netmask),
+						queue_id, zero_copy);
+	if (!dev)
+		return;
+	// add route table
+	rt_add(dev->net_ipaddr, 0xffffffff, 0, 0, RT_LOCALHOST, loop);
+	rt_add(LOCALNET(dev), dev->net_mask, 0, 0, RT_NONE, dev);
+}
 
-struct netdev* shmeth_dev_create(const char* devname, const char* side, char* ipstr, int maskbits);
+struct netdev* shmeth_dev_create(const char* devname, const char* side, char* ipstr, int maskbits,
+		int spin_us, int zero_copy, int queue_nr, size_t shm_size);
+
+/* positive decimal number in @str, -1 if it is not one */
+static int parse_positive(const char* str)
+{
+	char* end;
+	long val;
+	errno = 0;
+	val = strtol(str, &end, 10);
+	if (errno || end == str || *end || val <= 0 || val > INT_MAX)
+		return -1;
+	return val;
+}
 
 void attach_shmeth_dev(int argc, char** argv)
 {
-	if (argc != 5)
+	int spin_us = -1;
+	int zero_copy = 0;
+	int queue_nr = 1;
+	int size_mb = 0;
+	if (argc > 7)
+		queue_nr = parse_positive(argv[7]);
+	if (argc > 8)
+		size_mb = parse_positive(argv[8]);
+	if (argc < 5 || argc > 9 || (argc > 6 && strcmp(argv[6], "copy") &&
+					strcmp(argv[6], "zerocopy")) ||
+		queue_nr < 0 || size_mb < 0)
 	{
-		printf("Usage: attach_dev [devname] [side] [ip] [mask]");
+		printf("Usage: attach_shmeth_dev [devname|/path] [side] [ip] [mask] [spin_us] [copy|zerocopy] [queues] [size_mb]");
 		return;
 	}
 	char* devname = argv[1];
 	char* side = argv[2];
 	char* ip = argv[3];
 	char* netmask = argv[4];
+	// rx busy-poll budget, default if not given
+	if (argc > 5)
+		spin_us = atoi(argv[5]);
+	if (argc > 6)
+		zero_copy = !strcmp(argv[6], "zerocopy");
 	// init the device
-	struct netdev* dev = shmeth_dev_create(devname, side, ip, atoi(netmask));
+	struct netdev* dev = shmeth_dev_create(devname, side, ip, atoi(netmask), spin_us, zero_copy,
+			queue_nr, (size_t)size_mb << 20);
+	if (!dev)
+		return;
 	// add route table
 	rt_add(dev->net_ipaddr, 0xffffffff, 0, 0, RT_LOCALHOST, loop);
 	rt_add(LOCALNET(dev), dev->net_mask, 0, 0, RT_NONE, dev);
 }
 
 #ifdef CONFIG_DPDK
-struct netdev* dpdk_dev_create(char* coremask, char* ipstr, int maskbits);
+struct netdev* dpdk_dev_create(char* coremask, char* ipstr, int maskbits, int pipeline);
 
 void attach_dpdk(int argc, char** argv)
 {
-	if (argc != 4)
+	// run to completion unless asked for a dedicated tx lcore
+	int pipeline = argc == 5 && !strcmp(argv[4], "pipeline");
+	if ((argc != 4 && argc != 5) ||
+		(argc == 5 && !pipeline && strcmp(argv[4], "rtc")))
 	{
-		printf("Usage: attach_dpdk [coremask] [ip] [mask]");
+		printf("Usage: attach_dpdk [coremask] [ip] [mask] [rtc|pipeline]");
 		return;
 	}
 	char* coremask = argv[1];
 	char* ip = argv[2];
 	char* netmask = argv[3];
 	// init the device
-	struct netdev* dev = dpdk_dev_create(coremask, ip, atoi(netmask));
+	struct netdev* dev = dpdk_dev_create(coremask, ip, atoi(netmask), pipeline);
 	// add route table
 	rt_add(dev->net_ipaddr, 0xffffffff, 0, 0, RT_LOCALHOST, loop);
 	rt_add(LOCALNET(dev), dev->net_mask, 0, 0, RT_NONE, dev);
@@ -215,6 +314,7 @@ void stat(int argc, char **argv)
 		" alloced pkbs: %d\n"
 		" free pkbs:    %d\n",
 		alloc_pkbs, free_pkbs);
+	pkb_pool_stat();
 	printf("[sock memory information]\n"
 		" alloced socks: %d\n"
 		" free socks:    %d\n",
@@ -98,12 +98,10 @@ static void send_packet(void)
 {
 	struct pkbuf *pkb;
 	struct icmp *icmphdr;
-	struct ip *iphdr;
 
 	/* alloc packet */
-	pkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + ICMP_HRD_SZ + size);
-	iphdr = pkb2ip(pkb);
-	icmphdr = (struct icmp *)iphdr->ip_data;
+	pkb = alloc_pkb(ICMP_HRD_SZ + size);
+	icmphdr = (struct icmp *)pkb_put(pkb, ICMP_HRD_SZ + size);
 	/* fill icmp data */
 	memset(icmphdr->icmp_data, 'x', size);
 	icmphdr->icmp_type = ICMP_T_ECHOREQ;
@@ -119,8 +117,7 @@ static void send_packet(void)
 			id,
 			_ntohs(icmphdr->icmp_seq),
 			ttl);
-	ip_send_info(pkb, 0, IP_HRD_SZ + ICMP_HRD_SZ + size,
-			ttl, IP_P_ICMP, ipaddr);
+	ip_send_info(pkb, 0, ttl, IP_P_ICMP, ipaddr);
 }
 
 extern void signal_wait(int);
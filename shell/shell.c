@@ -14,16 +14,20 @@ static void builtin_clear(int argc, char **argv);
 
 /* extern net stack command handlers */
 extern void arpcache(int, char **);
+extern void tcphash(int, char **);
 extern void netdebug(int, char **);
 extern void ifconfig(int, char **);
 extern void stat(int, char **);
 extern void route(int, char **);
 extern void ping(int, char **);
 extern void perf(int, char **);
+extern void csum_bench(int, char **);
+extern void rt_bench(int, char **);
 extern void ping2(int, char **);
 extern void snc(int, char **);
 extern void attach_dev(int, char **);
 extern void attach_shmeth_dev(int, char **);
+extern void attach_xdp(int, char **);
 extern void attach_dpdk(int, char **);
 
 struct command {
@@ -72,7 +76,8 @@ static struct command cmds[] = {
 	/* net stack command */
 	{ 0, CMD_NONUM, netdebug, "debug", "debug dev|l2|arp|ip|icmp|udp|tcp|all" },
 	{ 0, CMD_NONUM, ping2, "ping2", "ping [OPTIONS] ipaddr(Internal stack implementation)" },
-	{ 0, 1, arpcache, "arpcache", "see arp cache" },
+	{ 0, CMD_NONUM, arpcache, "arpcache", "arpcache [stat|max entries]" },
+	{ 0, CMD_NONUM, tcphash, "tcphash", "tcphash [reset]: tcp hash table sizes and histograms" },
 	{ 0, CMD_NONUM, route, "route", "show / manipulate the IP routing table" },
 	{ 0, 1, ifconfig, "ifconfig", "configure a network interface" },
 	{ 0, 1, stat, "stat", "display pkb/sock information" },
@@ -80,10 +85,13 @@ static struct command cmds[] = {
 	{ 1, CMD_NONUM, ping, "ping", "ping [OPTIONS] ipaddr" },
 	{ 1, CMD_NONUM, snc, "snc", "Simplex Net Cat" },
 	{ 1, CMD_NONUM, perf, "perf", "Performance test" },
-	{0, CMD_NONUM, attach_dev, "attach_dev", "attach_dev [devname] [ip] [mask]"},
-	{0, CMD_NONUM, attach_shmeth_dev, "attach_shmeth_dev", "attach_shmeth_dev [devname] [side] [ip] [mask]"},
+	{ 1, CMD_NONUM, csum_bench, "csum_bench", "csum_bench [-n MB] [size ...]" },
+	{ 1, CMD_NONUM, rt_bench, "rt_bench", "rt_bench [-n routes] [-l lookups]" },
+	{0, CMD_NONUM, attach_dev, "attach_dev", "attach_dev [devname] [ip] [mask] [mmap [block_size] [block_nr] [frame_size]]"},
+	{0, CMD_NONUM, attach_xdp, "attach_xdp", "attach_xdp [devname] [ip] [mask] [copy|zerocopy] [queue] (zerocopy: driver mode, frames are still copied to pkbufs)"},
+	{0, CMD_NONUM, attach_shmeth_dev, "attach_shmeth_dev", "attach_shmeth_dev [devname|/path] [side] [ip] [mask] [spin_us] [copy|zerocopy] [queues] [size_mb]"},
 #ifdef CONFIG_DPDK
-	{0, CMD_NONUM, attach_dpdk, "attach_dpdk", "attach_dpdk [cpumask] [ip] [mask]"},
+	{0, CMD_NONUM, attach_dpdk, "attach_dpdk", "attach_dpdk [cpumask] [ip] [mask] [rtc|pipeline]"},
 #endif
 	/* last one */
 	{ 0, 0, NULL, NULL, NULL }	/* can also use sizeof(cmds)/sizeof(cmds[0]) for cmds number */
@@ -155,12 +155,12 @@ static int inet_connect(struct socket *sock, struct sock_addr *skaddr)
 	/* Not allow double connection */
 	if (sk->sk_dport)
 		goto out;
-	/* if not bind, we try auto bind */
-	if (!sk->sk_sport && sock_autobind(sk) < 0)
+	/* if not bind, we try auto bind (tcp picks its port in connect) */
+	if (!sk->sk_sport && sk->protocol != IP_P_TCP && sock_autobind(sk) < 0)
 		goto out;
 	/* ROUTE */
 	{
-		struct rtentry *rt = rt_lookup(skaddr->dst_addr);
+		struct rtentry *rt = dst_route(skaddr->dst_addr);
 		if (!rt)
 			goto out;
 		sk->sk_dst = rt;
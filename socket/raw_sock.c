@@ -36,11 +36,11 @@ static int raw_hash(struct sock *sk)
 static void raw_init_pkb(struct sock *sk, struct pkbuf *pkb,
 					struct sock_addr *skaddr)
 {
-	struct ip *iphdr = pkb2ip(pkb);
+	struct ip *iphdr = pkb_push_ip(pkb);
 	iphdr->ip_hlen = IP_HRD_SZ >> 2;
 	iphdr->ip_ver = IP_VERSION_4;
 	iphdr->ip_tos = 0;
-	iphdr->ip_len = _htons(pkb->pk_len - ETH_HRD_SZ);
+	iphdr->ip_len = _htons(pkb->pk_len);
 	iphdr->ip_id = _htons(raw_id);
 	iphdr->ip_fragoff = 0;
 	iphdr->ip_ttl = RAW_DEFAULT_TTL;
@@ -51,8 +51,10 @@ static void raw_init_pkb(struct sock *sk, struct pkbuf *pkb,
 
 static int raw_send_pkb(struct sock *sk, struct pkbuf *pkb)
 {
+	/* pkb may be freed after sent out */
+	int len = pkb->pk_len - IP_HRD_SZ;
 	ip_send_out(pkb);
-	return pkb->pk_len - ETH_HRD_SZ - IP_HRD_SZ;
+	return len;
 }
 
 static int raw_send_buf(struct sock *sk, void *buf, int size,
@@ -61,8 +63,8 @@ static int raw_send_buf(struct sock *sk, void *buf, int size,
 	struct pkbuf *pkb;
 	if (size < 0 || size > RAW_MAX_BUFSZ)
 		return -1;
-	pkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + size);
-	memcpy(pkb->pk_data + ETH_HRD_SZ + IP_HRD_SZ, buf, size);
+	pkb = alloc_pkb(size);
+	memcpy(pkb_put(pkb, size), buf, size);
 	raw_init_pkb(sk, pkb, skaddr);
 	if (sk->ops->send_pkb)
 		return sk->ops->send_pkb(sk, pkb);
@@ -12,13 +12,20 @@ void sock_add_hash(struct sock *sk, struct hlist_head *head)
 	hlist_add_head(&sk->hash_list, head);
 }
 
-void sock_del_hash(struct sock *sk)
+/* unlink without dropping the hash reference, return 1 if it was hashed */
+int sock_unlink_hash(struct sock *sk)
 {
 	/* Must check whether sk is hashed! */
-	if (!hlist_unhashed(&sk->hash_list)) {
-		hlist_del(&sk->hash_list);
+	if (hlist_unhashed(&sk->hash_list))
+		return 0;
+	hlist_del(&sk->hash_list);
+	return 1;
+}
+
+void sock_del_hash(struct sock *sk)
+{
+	if (sock_unlink_hash(sk))
 		free_sock(sk);
-	}
 }
 
 #ifdef SOCK_DEBUG
@@ -27,7 +34,7 @@ struct sock *_get_sock(struct sock *sk)
 struct sock *get_sock(struct sock *sk)
 #endif
 {
-	sk->refcnt++;
+	__atomic_fetch_add(&sk->refcnt, 1, __ATOMIC_RELAXED);
 	return sk;
 }
 
@@ -37,7 +44,7 @@ void _free_sock(struct sock *sk)
 void free_sock(struct sock *sk)
 #endif
 {
-	if (--sk->refcnt <= 0) {
+	if (__atomic_sub_fetch(&sk->refcnt, 1, __ATOMIC_ACQ_REL) <= 0) {
 		free_socks++;
 		free(sk);
 	}
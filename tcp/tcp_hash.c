@@ -0,0 +1,221 @@
+#include "lib.h"
+#include "list.h"
+#include "epoch.h"
+#include "tcp_hash.h"
+
+struct tcp_hash_table tcp_table;
+
+static struct tcp_hbuckets *tcp_hbuckets_alloc(unsigned int bits)
+{
+	struct tcp_hbuckets *a;
+	unsigned int i;
+
+	a = xmalloc(sizeof(*a) + (sizeof(struct tcp_hbucket) << bits));
+	a->bits = bits;
+	a->next = NULL;
+	for (i = 0; i < (1U << bits); i++) {
+		pthread_spin_init(&a->b[i].lock, PTHREAD_PROCESS_PRIVATE);
+		hlist_head_init(&a->b[i].head);
+	}
+	return a;
+}
+
+static void tcp_hbuckets_free(struct tcp_hbuckets *a)
+{
+	unsigned int i;
+
+	for (i = 0; i < (1U << a->bits); i++)
+		pthread_spin_destroy(&a->b[i].lock);
+	free(a);
+}
+
+void tcp_htable_init(struct tcp_htable *t, const char *name,
+		unsigned int bits, unsigned int maxbits,
+		unsigned int (*node_hash)(struct hlist_node *))
+{
+	t->name = name;
+	t->bits = t->minbits = bits;
+	t->maxbits = maxbits;
+	t->buckets = tcp_hbuckets_alloc(bits);
+	t->count = 0;
+	t->resizes = 0;
+	t->node_hash = node_hash;
+	pthread_mutex_init(&t->lock, NULL);
+	t->retired = NULL;
+	memset(t->cost, 0, sizeof(t->cost));
+}
+
+/*
+ * Lock bucket of @hash. The array is read inside an epoch, so it is not
+ * freed under us even if a resize retires it before we get the lock.
+ */
+struct tcp_hbucket *tcp_hbucket_get(struct tcp_htable *t, unsigned int hash)
+{
+	struct tcp_hbuckets *a;
+	struct tcp_hbucket *b;
+
+	epoch_enter();
+	for (;;) {
+		a = __atomic_load_n(&t->buckets, __ATOMIC_ACQUIRE);
+		b = &a->b[hash & ((1U << a->bits) - 1)];
+		pthread_spin_lock(&b->lock);
+		/* array cannot be replaced while we hold one of its locks */
+		if (__atomic_load_n(&t->buckets, __ATOMIC_RELAXED) == a)
+			break;
+		pthread_spin_unlock(&b->lock);
+	}
+	epoch_exit();
+	return b;
+}
+
+void tcp_hbucket_put(struct tcp_htable *t, struct tcp_hbucket *b)
+{
+	pthread_spin_unlock(&b->lock);
+}
+
+static _inline int tcp_htable_overloaded(struct tcp_htable *t,
+		unsigned int bits)
+{
+	return t->count > (TCP_HASH_LOAD << bits) && bits < t->maxbits;
+}
+
+static _inline int tcp_htable_sparse(struct tcp_htable *t, unsigned int bits)
+{
+	return t->count < (1 << bits) / TCP_HASH_SHRINK && bits > t->minbits;
+}
+
+/* free retired arrays no bucket user can be on any more, @t locked */
+static void tcp_htable_reap(struct tcp_htable *t)
+{
+	struct tcp_hbuckets *a, **pprev = &t->retired;
+	unsigned long safe = epoch_safe();
+
+	while ((a = *pprev) != NULL) {
+		if (a->retire < safe) {
+			*pprev = a->next;
+			tcp_hbuckets_free(a);
+		} else {
+			pprev = &a->next;
+		}
+	}
+}
+
+/* double or halve buckets, unless someone already did meanwhile */
+static void tcp_htable_resize(struct tcp_htable *t, int grow)
+{
+	struct tcp_hbuckets *na, *oa;
+	struct hlist_node *node, *next;
+	unsigned int i, bits, obits;
+
+	pthread_mutex_lock(&t->lock);
+	oa = t->buckets;
+	obits = oa->bits;
+	if (grow ? !tcp_htable_overloaded(t, obits) :
+			!tcp_htable_sparse(t, obits)) {
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+	bits = grow ? obits + 1 : obits - 1;
+	na = tcp_hbuckets_alloc(bits);
+	for (i = 0; i < (1U << obits); i++)
+		pthread_spin_lock(&oa->b[i].lock);
+	for (i = 0; i < (1U << obits); i++) {
+		for (node = oa->b[i].head.first; node; node = next) {
+			next = node->next;
+			hlist_add_head(node, &na->b[t->node_hash(node) &
+						((1U << bits) - 1)].head);
+		}
+		hlist_head_init(&oa->b[i].head);
+	}
+	__atomic_store_n(&t->buckets, na, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->bits, bits, __ATOMIC_RELAXED);
+	for (i = 0; i < (1U << obits); i++)
+		pthread_spin_unlock(&oa->b[i].lock);
+	t->resizes++;
+
+	oa->retire = epoch_stamp();
+	oa->next = t->retired;
+	t->retired = oa;
+	tcp_htable_reap(t);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* called after an entry went in or out, with no bucket locked */
+void tcp_htable_added(struct tcp_htable *t)
+{
+	unsigned int bits = __atomic_load_n(&t->bits, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+	if (tcp_htable_overloaded(t, bits))
+		tcp_htable_resize(t, 1);
+}
+
+void tcp_htable_removed(struct tcp_htable *t)
+{
+	unsigned int bits = __atomic_load_n(&t->bits, __ATOMIC_RELAXED);
+
+	__atomic_sub_fetch(&t->count, 1, __ATOMIC_RELAXED);
+	if (tcp_htable_sparse(t, bits))
+		tcp_htable_resize(t, 0);
+}
+
+/* @n: entries compared by one lookup */
+void tcp_htable_cost(struct tcp_htable *t, unsigned int n)
+{
+	__atomic_fetch_add(&t->cost[tcp_hist_slot(n)], 1, __ATOMIC_RELAXED);
+}
+
+static void tcp_hist_print(const char *title, unsigned long *hist)
+{
+	static const char *range[TCP_HIST_NR] = {
+		"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"
+	};
+	int i;
+
+	printf("  %s:", title);
+	for (i = 0; i < TCP_HIST_NR; i++)
+		printf(" %s:%lu", range[i], hist[i]);
+	printf("\n");
+}
+
+static void tcp_htable_stat(struct tcp_htable *t, int cost)
+{
+	unsigned long chains[TCP_HIST_NR] = { 0 };
+	struct hlist_node *node;
+	struct tcp_hbuckets *a;
+	struct tcp_hbucket *b;
+	unsigned int i, n;
+
+	/* no resize meanwhile */
+	pthread_mutex_lock(&t->lock);
+	a = t->buckets;
+	for (i = 0; i < (1U << a->bits); i++) {
+		b = &a->b[i];
+		n = 0;
+		pthread_spin_lock(&b->lock);
+		for (node = b->head.first; node; node = node->next)
+			n++;
+		pthread_spin_unlock(&b->lock);
+		chains[tcp_hist_slot(n)]++;
+	}
+	printf("%s: %d entries, %u buckets(resized %u times)\n",
+		t->name, t->count, 1U << a->bits, t->resizes);
+	pthread_mutex_unlock(&t->lock);
+	tcp_hist_print("chain length", chains);
+	if (cost)
+		tcp_hist_print("lookup cost ", t->cost);
+}
+
+void tcp_hash_stat(void)
+{
+	tcp_htable_stat(&tcp_table.etable, 1);
+	tcp_htable_stat(&tcp_table.ltable, 1);
+	tcp_htable_stat(&tcp_table.btable, 0);
+	tcp_port_stat();
+}
+
+void tcp_hash_stat_reset(void)
+{
+	memset(tcp_table.etable.cost, 0, sizeof(tcp_table.etable.cost));
+	memset(tcp_table.ltable.cost, 0, sizeof(tcp_table.ltable.cost));
+}
@@ -62,21 +62,7 @@ static void tcp_segment_init(struct tcp_segment *seg, struct ip *iphdr, struct t
 			_ntohl(tcphdr->ackn), tcp_control_string(tcphdr));
 }
 
-static void tcp_recv(struct pkbuf *pkb, struct ip *iphdr, struct tcp *tcphdr)
-{
-	struct tcp_segment seg;
-	struct sock *sk;
-
-	tcp_segment_init(&seg, iphdr, tcphdr);
-	/* Should we use net device to match a connection? */
-	sk = tcp_lookup_sock(iphdr->ip_src, iphdr->ip_dst,
-				tcphdr->src, tcphdr->dst);
-	tcp_process(pkb, &seg, sk);
-	if (sk)
-		free_sock(sk);
-}
-
-void tcp_in(struct pkbuf *pkb)
+static int tcp_in_check(struct pkbuf *pkb)
 {
 	struct ip *iphdr = pkb2ip(pkb);
 	struct tcp *tcphdr = ip2tcp(iphdr);
@@ -85,14 +71,69 @@ void tcp_in(struct pkbuf *pkb)
 	tcpdbg("%d bytes, real %d bytes",tcplen, tcphlen(tcphdr));
 	if (tcplen < TCP_HRD_SZ || tcplen < tcphlen(tcphdr)) {
 		tcpdbg("tcp length it too small");
-		goto drop_pkb;
+		return -1;
 	}
-	if (tcp_chksum(iphdr->ip_src, iphdr->ip_dst,
+	/* segments merged by gro were verified one by one */
+	if (pkb->pk_csum != PKB_CSUM_UNNECESSARY &&
+		tcp_chksum(iphdr->ip_src, iphdr->ip_dst,
 		tcplen, (unsigned short *)tcphdr) != 0) {
 		tcpdbg("tcp packet checksum corrupts");
-		goto drop_pkb;
+		return -1;
+	}
+	return 0;
+}
+
+/* Can segment of @iphdr/@tcphdr reuse sock found for previous segment? */
+static _inline int tcp_sock_match(struct sock *sk, struct ip *iphdr,
+				struct tcp *tcphdr)
+{
+	/* listen sock or closing connection may be changed by the segment */
+	return tcpsk(sk)->state == TCP_ESTABLISHED &&
+		sk->sk_saddr == iphdr->ip_dst &&
+		sk->sk_daddr == iphdr->ip_src &&
+		sk->sk_sport == tcphdr->dst &&
+		sk->sk_dport == tcphdr->src;
+}
+
+/*
+ * Handle a list of tcp segments in order:
+ * consecutive segments of one connection share the sock lookup.
+ */
+void tcp_in_list(struct list_head *list)
+{
+	struct tcp_segment seg;
+	struct pkbuf *pkb, *next;
+	struct sock *sk = NULL;
+	struct ip *iphdr;
+	struct tcp *tcphdr;
+
+	list_for_each_entry_safe(pkb, next, list, pk_list) {
+		list_del(&pkb->pk_list);
+		if (tcp_in_check(pkb) < 0) {
+			free_pkb(pkb);
+			continue;
+		}
+		iphdr = pkb2ip(pkb);
+		tcphdr = ip2tcp(iphdr);
+		tcp_segment_init(&seg, iphdr, tcphdr);
+		if (sk && !tcp_sock_match(sk, iphdr, tcphdr)) {
+			free_sock(sk);
+			sk = NULL;
+		}
+		/* Should we use net device to match a connection? */
+		if (!sk)
+			sk = tcp_lookup_sock(iphdr->ip_src, iphdr->ip_dst,
+						tcphdr->src, tcphdr->dst);
+		tcp_process(pkb, &seg, sk);
 	}
-	return tcp_recv(pkb, iphdr, tcphdr);
-drop_pkb:
-	free_pkb(pkb);
+	if (sk)
+		free_sock(sk);
+}
+
+void tcp_in(struct pkbuf *pkb)
+{
+	LIST_HEAD(list);
+
+	list_add_tail(&pkb->pk_list, &list);
+	tcp_in_list(&list);
 }
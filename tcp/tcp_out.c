@@ -7,12 +7,12 @@
 static int tcp_init_pkb(struct tcp_sock *tsk, struct pkbuf *pkb,
 			unsigned int saddr, unsigned int daddr)
 {
-	struct ip *iphdr = pkb2ip(pkb);
+	struct ip *iphdr = pkb_push_ip(pkb);
 	/* fill ip head */
 	iphdr->ip_hlen = IP_HRD_SZ >> 2;
 	iphdr->ip_ver = IP_VERSION_4;
 	iphdr->ip_tos = 0;
-	iphdr->ip_len = _htons(pkb->pk_len - ETH_HRD_SZ);
+	iphdr->ip_len = _htons(pkb->pk_len);
 	iphdr->ip_id = _htons(tcp_id);
 	iphdr->ip_fragoff = 0;
 	iphdr->ip_ttl = TCP_DEFAULT_TTL;
@@ -31,10 +31,10 @@ static int tcp_init_pkb(struct tcp_sock *tsk, struct pkbuf *pkb,
 	return 0;
 }
 
+/* Assert pkb->pk_data is tcp segment, which ip header is prepended before */
 void tcp_send_out(struct tcp_sock *tsk, struct pkbuf *pkb, struct tcp_segment *seg)
 {
-	struct ip *iphdr = pkb2ip(pkb);
-	struct tcp *tcphdr = (struct tcp *)iphdr->ip_data;
+	struct tcp *tcphdr = (struct tcp *)pkb->pk_data;
 	unsigned int saddr, daddr;
 
 	if (seg) {
@@ -50,7 +50,12 @@ void tcp_send_out(struct tcp_sock *tsk, struct pkbuf *pkb, struct tcp_segment *s
 		free_pkb(pkb);
 		return;
 	}
-	tcp_set_checksum(iphdr, tcphdr);
+	/* gso segments are checksummed one by one when split */
+	if (pkb->pk_gso_size ||
+		(pkb->pk_rtdst->rt_dev->net_features & NETIF_F_TX_L4_CSUM))
+		pkb->pk_csum = PKB_CSUM_PARTIAL;
+	else
+		tcp_set_checksum_text(pkb2ip(pkb), tcphdr, pkb->pk_textsum);
 	ip_send_out(pkb);
 }
 
@@ -66,9 +71,9 @@ void tcp_send_reset(struct tcp_sock *tsk, struct tcp_segment *seg)
 
 	if (tcphdr->rst)
 		return;
-	opkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + TCP_HRD_SZ);
+	opkb = alloc_pkb(TCP_HRD_SZ);
 	/* fill tcp head */
-	otcp = (struct tcp *)pkb2ip(opkb)->ip_data;
+	otcp = (struct tcp *)pkb_put(opkb, TCP_HRD_SZ);
 	otcp->src = tcphdr->dst;
 	otcp->dst = tcphdr->src;
 	if (tcphdr->ack) {
@@ -116,9 +121,9 @@ void tcp_send_ack(struct tcp_sock *tsk, struct tcp_segment *seg)
 
 	if (tcphdr->rst)
 		return;
-	opkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + TCP_HRD_SZ);
+	opkb = alloc_pkb(TCP_HRD_SZ);
 	/* fill tcp head */
-	otcp = (struct tcp *)pkb2ip(opkb)->ip_data;
+	otcp = (struct tcp *)pkb_put(opkb, TCP_HRD_SZ);
 	otcp->src = tcphdr->dst;
 	otcp->dst = tcphdr->src;
 	otcp->doff = TCP_HRD_DOFF;
@@ -146,9 +151,9 @@ void tcp_send_synack(struct tcp_sock *tsk, struct tcp_segment *seg)
 
 	if (tcphdr->rst)
 		return;
-	opkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + TCP_HRD_SZ);
+	opkb = alloc_pkb(TCP_HRD_SZ);
 	/* fill tcp head */
-	otcp = (struct tcp *)pkb2ip(opkb)->ip_data;
+	otcp = (struct tcp *)pkb_put(opkb, TCP_HRD_SZ);
 	otcp->src = tcphdr->dst;
 	otcp->dst = tcphdr->src;
 	otcp->doff = TCP_HRD_DOFF;
@@ -172,9 +177,9 @@ void tcp_send_syn(struct tcp_sock *tsk, struct tcp_segment *seg)
 	struct tcp *otcp;
 	struct pkbuf *opkb;
 
-	opkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + TCP_HRD_SZ);
+	opkb = alloc_pkb(TCP_HRD_SZ);
 	/* fill tcp head */
-	otcp = (struct tcp *)pkb2ip(opkb)->ip_data;
+	otcp = (struct tcp *)pkb_put(opkb, TCP_HRD_SZ);
 	otcp->src = tsk->sk.sk_sport;
 	otcp->dst = tsk->sk.sk_dport;
 	otcp->doff = TCP_HRD_DOFF;
@@ -192,9 +197,9 @@ void tcp_send_fin(struct tcp_sock *tsk)
 	struct tcp *otcp;
 	struct pkbuf *opkb;
 
-	opkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + TCP_HRD_SZ);
+	opkb = alloc_pkb(TCP_HRD_SZ);
 	/* fill tcp head */
-	otcp = (struct tcp *)pkb2ip(opkb)->ip_data;
+	otcp = (struct tcp *)pkb_put(opkb, TCP_HRD_SZ);
 	otcp->src = tsk->sk.sk_sport;
 	otcp->dst = tsk->sk.sk_dport;
 	otcp->doff = TCP_HRD_DOFF;
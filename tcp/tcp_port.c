@@ -0,0 +1,177 @@
+/*
+ *  Ephemeral port allocation [TCP_BPORT_MIN, TCP_BPORT_MAX]:
+ *    bound: port owned by one sock through the bind table
+ *    used:  bound, or shared by connected socks (users[] > 0)
+ *
+ *  A connecting sock may share any port that is not bound as long as its
+ *  4-tuple is unique in the established table. The search starts at an
+ *  offset hashed from the destination plus a counter kept per destination
+ *  hash (RFC 6056, algorithm 4): ports cannot be guessed from outside,
+ *  and connections to one peer take consecutive ports, so the next one
+ *  is free at the first try. Free ports are found a bitmap word at a time.
+ */
+#include "lib.h"
+#include "tcp_hash.h"
+
+#define TCP_BPORT_NR	(TCP_BPORT_MAX - TCP_BPORT_MIN + 1)
+#define TCP_PORT_WORDS	((TCP_BPORT_NR + 63) / 64)
+#define TCP_PORT_PERTURB	256	/* next_ephemeral counters */
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned long long bound[TCP_PORT_WORDS];
+	unsigned long long used[TCP_PORT_WORDS];
+	unsigned int users[TCP_BPORT_NR];
+	unsigned int next;		/* for random ports of bind */
+	unsigned int perturb[TCP_PORT_PERTURB];
+	unsigned int secret[2];		/* offset and counter hash keys */
+} tcp_ports = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define port_set(map, i) ((map)[(i) / 64] |= 1ULL << ((i) % 64))
+#define port_clear(map, i) ((map)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+#define port_test(map, i) ((map)[(i) / 64] & (1ULL << ((i) % 64)))
+
+/* first index from @idx on, wrapping around, clear in @map, -1 for none */
+static int tcp_port_find_clear(unsigned long long *map, unsigned int idx)
+{
+	unsigned long long bits;
+	unsigned int n, w;
+
+	for (n = 0; n <= TCP_PORT_WORDS; n++) {
+		w = (idx / 64 + n) % TCP_PORT_WORDS;
+		bits = ~map[w];
+		if (n == 0)
+			bits &= ~0ULL << (idx % 64);
+		if (w == TCP_PORT_WORDS - 1 && TCP_BPORT_NR % 64)
+			bits &= (1ULL << (TCP_BPORT_NR % 64)) - 1;
+		if (bits)
+			return w * 64 + __builtin_ctzll(bits);
+	}
+	return -1;
+}
+
+/* @nport is net order */
+int tcp_port_ephemeral(unsigned short nport)
+{
+	unsigned short port = _ntohs(nport);
+	return port >= TCP_BPORT_MIN && port <= TCP_BPORT_MAX;
+}
+
+/* take ephemeral @nport for the bind table, -1 if anyone uses it */
+int tcp_port_reserve(unsigned short nport)
+{
+	unsigned int i = _ntohs(nport) - TCP_BPORT_MIN;
+	int err = -1;
+
+	pthread_mutex_lock(&tcp_ports.lock);
+	if (!port_test(tcp_ports.used, i)) {
+		port_set(tcp_ports.bound, i);
+		port_set(tcp_ports.used, i);
+		err = 0;
+	}
+	pthread_mutex_unlock(&tcp_ports.lock);
+	return err;
+}
+
+/* take a random unused port for the bind table, 0 if all are in use */
+unsigned short tcp_port_pick(void)
+{
+	int i;
+
+	pthread_mutex_lock(&tcp_ports.lock);
+	i = tcp_port_find_clear(tcp_ports.used,
+		jhash_1word(tcp_ports.next++, tcp_ports.secret[0]) % TCP_BPORT_NR);
+	if (i >= 0) {
+		port_set(tcp_ports.bound, i);
+		port_set(tcp_ports.used, i);
+	}
+	pthread_mutex_unlock(&tcp_ports.lock);
+	return i >= 0 ? _htons(TCP_BPORT_MIN + i) : 0;
+}
+
+void tcp_port_release(unsigned short nport)
+{
+	unsigned int i = _ntohs(nport) - TCP_BPORT_MIN;
+
+	pthread_mutex_lock(&tcp_ports.lock);
+	port_clear(tcp_ports.bound, i);
+	if (!tcp_ports.users[i])
+		port_clear(tcp_ports.used, i);
+	pthread_mutex_unlock(&tcp_ports.lock);
+}
+
+/*
+ * Choose source port of connecting @tsk and hash it into the established
+ * table in one go. Assert its addresses and destination port are set.
+ */
+int tcp_port_connect(struct tcp_sock *tsk)
+{
+	struct sock *sk = &tsk->sk;
+	unsigned int offset, idx, tries, skip, *next;
+	int i;
+
+	offset = jhash_3words(sk->sk_saddr, sk->sk_daddr, sk->sk_dport,
+				tcp_ports.secret[0]);
+	next = &tcp_ports.perturb[jhash_3words(sk->sk_saddr, sk->sk_daddr,
+			sk->sk_dport, tcp_ports.secret[1]) % TCP_PORT_PERTURB];
+	pthread_mutex_lock(&tcp_ports.lock);
+	for (tries = 0; tries < TCP_BPORT_NR; tries += skip + 1) {
+		idx = (offset + *next) % TCP_BPORT_NR;
+		i = tcp_port_find_clear(tcp_ports.bound, idx);
+		if (i < 0)
+			break;
+		skip = (i + TCP_BPORT_NR - idx) % TCP_BPORT_NR;
+		*next += skip + 1;
+		sk->sk_sport = _htons(TCP_BPORT_MIN + i);
+		/* fails only if this 4-tuple is taken */
+		if (tcp_hash(sk) == 0) {
+			tcp_ports.users[i]++;
+			port_set(tcp_ports.used, i);
+			__atomic_fetch_or(&tsk->flags, TCP_F_PORTSHARE,
+						__ATOMIC_RELAXED);
+			pthread_mutex_unlock(&tcp_ports.lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&tcp_ports.lock);
+	sk->sk_sport = 0;
+	return -1;
+}
+
+/* drop port share of @tsk taken by tcp_port_connect(), if any */
+void tcp_port_unshare(struct tcp_sock *tsk)
+{
+	unsigned int i = _ntohs(tsk->sk.sk_sport) - TCP_BPORT_MIN;
+
+	if (!(__atomic_fetch_and(&tsk->flags, ~TCP_F_PORTSHARE,
+				__ATOMIC_RELAXED) & TCP_F_PORTSHARE))
+		return;
+	pthread_mutex_lock(&tcp_ports.lock);
+	if (--tcp_ports.users[i] == 0 && !port_test(tcp_ports.bound, i))
+		port_clear(tcp_ports.used, i);
+	pthread_mutex_unlock(&tcp_ports.lock);
+}
+
+void tcp_port_init(void)
+{
+	get_random_bytes(tcp_ports.secret, sizeof(tcp_ports.secret));
+	get_random_bytes(&tcp_ports.next, sizeof(tcp_ports.next));
+}
+
+void tcp_port_stat(void)
+{
+	unsigned int i, bound = 0, shared = 0, conns = 0;
+
+	pthread_mutex_lock(&tcp_ports.lock);
+	for (i = 0; i < TCP_BPORT_NR; i++) {
+		if (port_test(tcp_ports.bound, i))
+			bound++;
+		if (tcp_ports.users[i]) {
+			shared++;
+			conns += tcp_ports.users[i];
+		}
+	}
+	pthread_mutex_unlock(&tcp_ports.lock);
+	printf("ephemeral ports: %u of %u bound, %u shared by %u connections\n",
+		bound, TCP_BPORT_NR, shared, conns);
+}
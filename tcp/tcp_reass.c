@@ -16,13 +16,13 @@ void tcp_free_reass_head(struct tcp_sock *tsk)
 	while (!list_empty(&tsk->rcv_reass)) {
 		trh = list_first_entry(&tsk->rcv_reass, struct tcp_reass_head, list);
 		list_del(&trh->list);
-		free_pkb(containof(trh, struct pkbuf, pk_data));
+		free_pkb(containof(trh, struct pkbuf, pk_cb));
 	}
 }
 
 void tcp_segment_reass(struct tcp_sock *tsk, struct tcp_segment *seg, struct pkbuf *pkb)
 {
-	/* reuse ether header as tcp_reass_head magically */
+	/* tcp_reass_head is stored in pkb control buffer */
 	struct tcp_reass_head *trh, *ctrh, *prev, *next;
 	int rlen, len;
 
@@ -48,11 +48,11 @@ void tcp_segment_reass(struct tcp_sock *tsk, struct tcp_segment *seg, struct pkb
 		}
 		/* delete duplicate segment from reass list */
 		list_del(&trh->list);
-		free_pkb(containof(trh, struct pkbuf, pk_data));
+		free_pkb(containof(trh, struct pkbuf, pk_cb));
 	}
 
 	/* insert segment into prev of trh */
-	ctrh = (struct tcp_reass_head *)pkb->pk_data;
+	ctrh = (struct tcp_reass_head *)pkb->pk_cb;
 	list_init(&ctrh->list);
 	ctrh->data = seg->text;
 	ctrh->seq = seg->seq;
@@ -71,7 +71,7 @@ void tcp_segment_reass(struct tcp_sock *tsk, struct tcp_segment *seg, struct pkb
 			break;
 		len += rlen;
 		list_del(&trh->list);
-		free_pkb(containof(trh, struct pkbuf, pk_data));
+		free_pkb(containof(trh, struct pkbuf, pk_cb));
 	}
 
 	if (len > 0 && seg->tcphdr->psh)
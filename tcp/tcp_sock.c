@@ -5,37 +5,52 @@
 #include "netif.h"
 #include "cbuf.h"
 
-static struct tcp_hash_table tcp_table;
 /* @src is for remote machine */
 static struct sock *tcp_lookup_sock_establish(unsigned int src, unsigned int dst,
 				unsigned short src_port, unsigned short dst_port)
 {
-	struct hlist_head *head;
+	struct tcp_htable *t = &tcp_table.etable;
+	struct tcp_hbucket *b;
 	struct hlist_node *node;
-	struct sock *sk;
-	head = tcp_ehash_head(tcp_ehashfn(src, dst, src_port, dst_port));
-	hlist_for_each_sock(sk, node, head) {
+	struct sock *sk, *found = NULL;
+	unsigned int n = 0;
+
+	b = tcp_hbucket_get(t, tcp_ehashfn(dst, src, dst_port, src_port));
+	hlist_for_each_sock(sk, node, &b->head) {
+		n++;
 		if (sk->sk_saddr == dst &&
 			sk->sk_daddr == src &&
 			sk->sk_sport == dst_port &&
-			sk->sk_dport == src_port)
-			return get_sock(sk);
+			sk->sk_dport == src_port) {
+			found = get_sock(sk);
+			break;
+		}
 	}
-	return NULL;
+	tcp_hbucket_put(t, b);
+	tcp_htable_cost(t, n);
+	return found;
 }
 
 static struct sock *tcp_lookup_sock_listen(unsigned int addr, unsigned int nport)
 {
-	struct hlist_head *head = tcp_lhash_head(_ntohs(nport) & TCP_LHASH_MASK);
+	struct tcp_htable *t = &tcp_table.ltable;
+	struct tcp_hbucket *b;
 	struct hlist_node *node;
-	struct sock *sk;
+	struct sock *sk, *found = NULL;
+	unsigned int n = 0;
 
-	hlist_for_each_sock(sk, node, head) {
+	b = tcp_hbucket_get(t, tcp_phashfn(nport));
+	hlist_for_each_sock(sk, node, &b->head) {
+		n++;
 		if ((!sk->sk_saddr || sk->sk_saddr == addr) &&
-			sk->sk_sport == nport)
-			return get_sock(sk);
+			sk->sk_sport == nport) {
+			found = get_sock(sk);
+			break;
+		}
 	}
-	return NULL;
+	tcp_hbucket_put(t, b);
+	tcp_htable_cost(t, n);
+	return found;
 }
 
 /* port is net order! */
@@ -59,62 +74,64 @@ static _inline int __tcp_port_used(unsigned short nport, struct hlist_head *head
 	return 0;
 }
 
-static _inline int tcp_port_used(unsigned short nport)
+/* add @tsk to bind table under @nport, -1 if somebody has it */
+static int tcp_bhash(struct tcp_sock *tsk, unsigned short nport)
 {
-	return __tcp_port_used(nport,
-		tcp_bhash_head(_ntohs(nport) & TCP_BHASH_MASK));
-}
+	struct tcp_htable *t = &tcp_table.btable;
+	struct tcp_hbucket *b;
+	unsigned int hash = tcp_phashfn(nport);
 
-static unsigned short tcp_get_port(void)
-{
-	static unsigned short defport = TCP_BPORT_MIN;
-	unsigned short nport = 0;
-	/* no free bind port resource */
-	if (tcp_table.bfree <= 0)
-		return 0;
-	/* assert that we can break the loop */
-	while (tcp_port_used(_htons(defport))) {
-		if (++defport > TCP_BPORT_MAX)
-			defport = TCP_BPORT_MIN;
+	b = tcp_hbucket_get(t, hash);
+	if (__tcp_port_used(nport, &b->head)) {
+		tcp_hbucket_put(t, b);
+		return -1;
 	}
-	nport = _htons(defport);
-	if (++defport > TCP_BPORT_MAX)
-		defport = TCP_BPORT_MIN;
-	return nport;
-}
-
-static void tcp_bhash(struct tcp_sock *tsk)
-{
+	tsk->sk.sk_sport = nport;
+	tsk->bhash = hash;
 	get_tcp_sock(tsk);
-	hlist_add_head(&tsk->bhash_list, tcp_bhash_head(tsk->bhash));
+	hlist_add_head(&tsk->bhash_list, &b->head);
+	tcp_hbucket_put(t, b);
+	tcp_htable_added(t);
+	return 0;
 }
 
+/*
+ * Ephemeral ports are taken in the port map first: connected socks may
+ * share them without being in the bind table.
+ */
 static int tcp_set_sport(struct sock *sk, unsigned short nport)
 {
-	int err = -1;
-
-	if ((nport && tcp_port_used(nport)) ||
-		(!nport && !(nport = tcp_get_port())))
-		goto out;
-	tcp_table.bfree--;
-	sk->sk_sport = nport;
-	tcpsk(sk)->bhash = _ntohs(nport) & TCP_BHASH_MASK;
-	tcp_bhash(tcpsk(sk));
-	err = 0;
-out:
-	return err;
-}
-
-static void tcp_unset_sport(struct sock *sk)
-{
-	tcp_table.bfree++;
+	if (!nport) {
+		nport = tcp_port_pick();
+		if (!nport)
+			return -1;
+	} else if (tcp_port_ephemeral(nport) && tcp_port_reserve(nport) < 0) {
+		return -1;
+	}
+	if (tcp_bhash(tcpsk(sk), nport) < 0) {
+		if (tcp_port_ephemeral(nport))
+			tcp_port_release(nport);
+		return -1;
+	}
+	return 0;
 }
 
 void tcp_unbhash(struct tcp_sock *tsk)
 {
-	if (!hlist_unhashed(&tsk->bhash_list)) {
-		tcp_unset_sport(&tsk->sk);
+	struct tcp_htable *t = &tcp_table.btable;
+	struct tcp_hbucket *b;
+	int hashed;
+
+	tcp_port_unshare(tsk);
+	b = tcp_hbucket_get(t, tsk->bhash);
+	hashed = !hlist_unhashed(&tsk->bhash_list);
+	if (hashed)
 		hlist_del(&tsk->bhash_list);
+	tcp_hbucket_put(t, b);
+	if (hashed) {
+		tcp_htable_removed(t);
+		if (tcp_port_ephemeral(tsk->sk.sk_sport))
+			tcp_port_release(tsk->sk.sk_sport);
 		free_sock(&tsk->sk);
 	}
 }
@@ -122,34 +139,54 @@ void tcp_unbhash(struct tcp_sock *tsk)
 int tcp_hash(struct sock *sk)
 {
 	struct tcp_sock *tsk = tcpsk(sk);
-	struct hlist_head *head;
-	unsigned int hash;
+	struct tcp_htable *t;
+	struct tcp_hbucket *b;
 
 	if (tsk->state == TCP_CLOSED)
 		return -1;
 	if (tsk->state == TCP_LISTEN) {
-		sk->hash = _ntohs(sk->sk_sport) & TCP_LHASH_MASK;
-		head = tcp_lhash_head(sk->hash);
+		t = &tcp_table.ltable;
+		sk->hash = tcp_phashfn(sk->sk_sport);
+		b = tcp_hbucket_get(t, sk->hash);
 		/*
 		 * We dont need to check conflict of listen hash
 		 * bind hash has done it for us.
 		 */
 	} else {
-		hash = tcp_ehashfn(sk->sk_saddr, sk->sk_daddr,
+		t = &tcp_table.etable;
+		sk->hash = tcp_ehashfn(sk->sk_saddr, sk->sk_daddr,
 				sk->sk_sport, sk->sk_dport);
-		head = tcp_ehash_head(hash);
-		if (tcp_ehash_conflict(head, sk))
+		b = tcp_hbucket_get(t, sk->hash);
+		if (tcp_ehash_conflict(&b->head, sk)) {
+			tcp_hbucket_put(t, b);
 			return -1;
-		sk->hash = hash;
+		}
 	}
-	sock_add_hash(sk, head);
+	sock_add_hash(sk, &b->head);
+	tcp_hbucket_put(t, b);
+	tcp_htable_added(t);
 	return 0;
 }
 
+/* a listening sock is unhashed before it leaves TCP_LISTEN */
 void tcp_unhash(struct sock *sk)
 {
-	sock_del_hash(sk);
+	struct tcp_htable *t;
+	struct tcp_hbucket *b;
+	int hashed;
+
+	if (tcpsk(sk)->state == TCP_LISTEN)
+		t = &tcp_table.ltable;
+	else
+		t = &tcp_table.etable;
+	b = tcp_hbucket_get(t, sk->hash);
+	hashed = sock_unlink_hash(sk);
+	tcp_hbucket_put(t, b);
 	sk->hash = 0;
+	if (hashed) {
+		tcp_htable_removed(t);
+		free_sock(sk);
+	}
 }
 
 static _inline void tcp_pre_wait_connect(struct tcp_sock *tsk)
@@ -178,7 +215,8 @@ static int tcp_connect(struct sock *sk, struct sock_addr *skaddr)
 	tsk->iss = alloc_new_iss();
 	tsk->snd_una = tsk->iss;
 	tsk->snd_nxt = tsk->iss + 1;
-	if (tcp_hash(sk) < 0) {
+	/* unbound: port is chosen per destination, see tcp_port.c */
+	if ((sk->sk_sport ? tcp_hash(sk) : tcp_port_connect(tsk)) < 0) {
 		tsk->state = TCP_CLOSED;
 		return -1;
 	}
@@ -244,11 +282,15 @@ static struct sock *tcp_accept(struct sock *sk)
 	 * (Should we fix it? Simulating multi-threads on my _accept()
 	 *  is so difficult, maybe we dont support thread-safe accept.)
 	 */
+	pthread_mutex_lock(&tsk->queue_lock);
 	while (list_empty(&tsk->accept_queue)) {
+		pthread_mutex_unlock(&tsk->queue_lock);
 		if (tcp_wait_accept(tsk) < 0)
 			goto out;
+		pthread_mutex_lock(&tsk->queue_lock);
 	}
 	newtsk = tcp_accept_dequeue(tsk);
+	pthread_mutex_unlock(&tsk->queue_lock);
 	free_sock(&newtsk->sk);
 	/* disassociate it with parent */
 	free_sock(&newtsk->parent->sk);
@@ -260,9 +302,11 @@ out:
 static void tcp_clear_listen_queue(struct tcp_sock *tsk)
 {
 	struct tcp_sock *ltsk;
+	pthread_mutex_lock(&tsk->queue_lock);
 	while (!list_empty(&tsk->listen_queue)) {
 		ltsk = list_first_entry(&tsk->listen_queue, struct tcp_sock, list);
 		list_del_init(&ltsk->list);
+		pthread_mutex_unlock(&tsk->queue_lock);
 		if (ltsk->state == TCP_SYN_RECV) {
 			free_sock(&ltsk->parent->sk);
 			ltsk->parent = NULL;
@@ -270,7 +314,9 @@ static void tcp_clear_listen_queue(struct tcp_sock *tsk)
 			free_sock(&ltsk->sk);
 		}
 		/* FIXME: Why other state? How to handle other state? */
+		pthread_mutex_lock(&tsk->queue_lock);
 	}
+	pthread_mutex_unlock(&tsk->queue_lock);
 }
 
 static int tcp_close(struct sock *sk)
@@ -433,6 +479,7 @@ struct sock *tcp_alloc_sock(int protocol)
 	tsk->rcv_wnd = TCP_DEFAULT_WINDOW;
 	list_init(&tsk->listen_queue);
 	list_init(&tsk->accept_queue);
+	pthread_mutex_init(&tsk->queue_lock, NULL);
 	list_init(&tsk->list);
 	list_init(&tsk->sk.recv_queue);
 	list_init(&tsk->rcv_reass);
@@ -440,14 +487,26 @@ struct sock *tcp_alloc_sock(int protocol)
 	return &tsk->sk;
 }
 
+static unsigned int tcp_sock_hash(struct hlist_node *node)
+{
+	return hlist_entry(node, struct sock, hash_list)->hash;
+}
+
+static unsigned int tcp_bind_hash(struct hlist_node *node)
+{
+	return hlist_entry(node, struct tcp_sock, bhash_list)->bhash;
+}
+
 void tcp_init(void)
 {
-	int i;
-	for (i = 0; i < TCP_EHASH_SIZE; i++)
-		hlist_head_init(&tcp_table.etable[i]);
-	for (i = 0; i < TCP_LHASH_SIZE; i++)
-		hlist_head_init(&tcp_table.ltable[i]);
-	tcp_table.bfree = TCP_BPORT_MAX - TCP_BPORT_MIN + 1;
+	get_random_bytes(&tcp_table.seed, sizeof(tcp_table.seed));
+	tcp_port_init();
+	tcp_htable_init(&tcp_table.etable, "established", TCP_EHASH_BITS,
+			TCP_EHASH_MAXBITS, tcp_sock_hash);
+	tcp_htable_init(&tcp_table.ltable, "listen", TCP_LHASH_BITS,
+			TCP_LHASH_MAXBITS, tcp_sock_hash);
+	tcp_htable_init(&tcp_table.btable, "bind", TCP_BHASH_BITS,
+			TCP_BHASH_MAXBITS, tcp_bind_hash);
 	/* tcp ip id */
 	tcp_id = 0;
 }
@@ -39,9 +39,7 @@ static _inline void tcp_dbg_state(struct tcp_sock *tsk)
 unsigned int alloc_new_iss(void)
 {
 	static unsigned int iss = 12345678;
-	if (++iss >= 0xffffffff)
-		iss = 12345678;
-	return iss;
+	return __atomic_add_fetch(&iss, 1, __ATOMIC_RELAXED);
 }
 
 static struct tcp_sock *tcp_listen_child_sock(struct tcp_sock *tsk,
@@ -67,7 +65,9 @@ static struct tcp_sock *tcp_listen_child_sock(struct tcp_sock *tsk,
 	 */
 	newtsk->parent = get_tcp_sock(tsk);
 	/* FIXME: add limit to listen queue */
+	pthread_mutex_lock(&tsk->queue_lock);
 	list_add(&newtsk->list, &tsk->listen_queue);
+	pthread_mutex_unlock(&tsk->queue_lock);
 	/* reference for being listed into parent queue */
 	return get_tcp_sock(newtsk);
 }
@@ -230,12 +230,17 @@ discarded:
 /* handle sock acccept queue when receiving ack in SYN-RECV state */
 static int tcp_synrecv_ack(struct tcp_sock *tsk)
 {
+	struct tcp_sock *parent = tsk->parent;
 	/* FIXME: Maybe parent is dead. */
-	if (tsk->parent->state != TCP_LISTEN)
+	if (parent->state != TCP_LISTEN)
 		return -1;
-	if (tcp_accept_queue_full(tsk->parent))
+	pthread_mutex_lock(&parent->queue_lock);
+	if (tcp_accept_queue_full(parent)) {
+		pthread_mutex_unlock(&parent->queue_lock);
 		return -1;
+	}
 	tcp_accept_enqueue(tsk);
+	pthread_mutex_unlock(&parent->queue_lock);
 	tcpsdbg("Passive three-way handshake successes!");
 	wake_up(tsk->parent->wait_accept);
 	return 0;
@@ -72,10 +72,18 @@ out:
 		tsk->sk.ops->recv_notify(&tsk->sk);
 }
 
-static void tcp_init_text(struct tcp_sock *tsk, struct pkbuf *pkb,
+static struct tcp *tcp_init_text(struct tcp_sock *tsk, struct pkbuf *pkb,
 		void *buf, int size)
 {
-	struct tcp *tcphdr = pkb2tcp(pkb);
+	struct netdev *dev = tsk->sk.sk_dst->rt_dev;
+	struct tcp *tcphdr;
+	/* text is summed while copied if the checksum is done here */
+	if (!pkb->pk_gso_size && !(dev->net_features & NETIF_F_TX_L4_CSUM))
+		pkb->pk_textsum = csum_partial_copy(pkb_put(pkb, size), buf,
+						size, 0);
+	else
+		memcpy(pkb_put(pkb, size), buf, size);
+	tcphdr = (struct tcp *)pkb_push(pkb, TCP_HRD_SZ);
 	tcphdr->src = tsk->sk.sk_sport;
 	tcphdr->dst = tsk->sk.sk_dport;
 	tcphdr->doff = TCP_HRD_DOFF;
@@ -83,28 +91,36 @@ static void tcp_init_text(struct tcp_sock *tsk, struct pkbuf *pkb,
 	tcphdr->ackn = _htonl(tsk->rcv_nxt);
 	tcphdr->ack = 1;
 	tcphdr->window = _htons(tsk->rcv_wnd);
-	memcpy(tcphdr->data, buf, size);
 	tsk->snd_nxt += size;
 	tsk->snd_wnd -= size;
 	tcpsdbg("send TEXT(%u:%d) [WIN %d] to "IPFMT":%d",
 			_ntohl(tcphdr->seq), size, _ntohs(tcphdr->window),
 			ipfmt(tsk->sk.sk_daddr), _ntohs(tcphdr->dst));
+	return tcphdr;
 }
 
 int tcp_send_text(struct tcp_sock *tsk, void *buf, int len)
 {
+	struct netdev *dev = tsk->sk.sk_dst->rt_dev;
 	struct pkbuf *pkb;
+	struct tcp *tcphdr;
 	int slen = 0;
-	int segsize = tsk->sk.sk_dst->rt_dev->net_mtu - IP_HRD_SZ - TCP_HRD_SZ;
+	int mss = dev->net_mtu - IP_HRD_SZ - TCP_HRD_SZ;
+	int segsize = mss;
+	/* one super-segment of whole mss's goes down the stack at a time */
+	if (dev->net_features & NETIF_F_GSO)
+		segsize = NETDEV_GSO_MAX / mss * mss;
 	len = min(len, (int)tsk->snd_wnd);
 	while (slen < len) {
 		/* TODO: handle silly window syndrome */
 		segsize = min(segsize, len - slen);
-		pkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + TCP_HRD_SZ + segsize);
-		tcp_init_text(tsk, pkb, buf + slen, segsize);
+		pkb = netdev_alloc_pkb(dev, TCP_HRD_SZ + segsize);
+		if (segsize > mss)
+			pkb->pk_gso_size = mss;
+		tcphdr = tcp_init_text(tsk, pkb, buf + slen, segsize);
 		slen += segsize;
 		if (slen >= len)
-			pkb2tcp(pkb)->psh = 1;
+			tcphdr->psh = 1;
 		tcp_send_out(tsk, pkb, NULL);
 	}
 
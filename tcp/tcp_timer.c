@@ -2,39 +2,48 @@
 #include "lib.h"
 
 static struct tcp_timer_head timewait;
+static pthread_mutex_t timewait_lock = PTHREAD_MUTEX_INITIALIZER;
 /* static struct tcp_timer_head retrans; */
 
 /* TIME-WAIT TIMEOUT */
 void tcp_timewait_timer(int delta)
 {
-	struct tcp_timer *t, *next, **pprev;
+	struct tcp_timer *t, *next, **pprev, *expired = NULL;
 	struct tcp_sock *tsk;
+	pthread_mutex_lock(&timewait_lock);
 	for (pprev = &timewait.next, t = timewait.next; t; t = next) {
 		next = t->next;		/* for safe deletion */
 		t->next = NULL;
 		t->timeout -= delta;
 		if (t->timeout <= 0) {
-			/* TIME-WAIT expires: tcb deletion */
-			tsk = timewait2tsk(t);
-			if (!tsk->parent)
-				tcp_unbhash(tsk);
-			tcp_unhash(&tsk->sk);
-			tcp_set_state(tsk, TCP_CLOSED);
-			free_sock(&tsk->sk);
+			t->next = expired;
+			expired = t;
 			*pprev = next;
 		} else {
 			pprev = &t->next;
 		}
 	}
+	pthread_mutex_unlock(&timewait_lock);
+	for (t = expired; t; t = next) {
+		next = t->next;
+		/* TIME-WAIT expires: tcb deletion */
+		tsk = timewait2tsk(t);
+		if (!tsk->parent)
+			tcp_unbhash(tsk);
+		tcp_unhash(&tsk->sk);
+		tcp_set_state(tsk, TCP_CLOSED);
+		free_sock(&tsk->sk);
+	}
 }
 
 void tcp_set_timewait_timer(struct tcp_sock *tsk)
 {
 	tcp_set_state(tsk, TCP_TIME_WAIT);
-	/* FIXME: lock */
+	pthread_mutex_lock(&timewait_lock);
 	tsk->timewait.timeout = TCP_TIMEWAIT_TIMEOUT;
 	tsk->timewait.next = timewait.next;
 	timewait.next = &tsk->timewait;
+	pthread_mutex_unlock(&timewait_lock);
 	/* reference for TIME-WAIT TIMEOUT releasing */
 	get_tcp_sock(tsk);
 }
@@ -7,40 +7,38 @@
 #include "udp.h"
 #include "socket.h"
 
-static void udp_recv(struct pkbuf *pkb, struct ip *iphdr, struct udp *udphdr)
+/* queue @pkbs(list) received by @sk, sock ref is dropped */
+static void udp_recv(struct sock *sk, struct list_head *pkbs)
 {
-	struct sock *sk;
-	sk = udp_lookup_sock(udphdr->dst);
-	if (!sk) {
-		icmp_send(ICMP_T_DESTUNREACH, ICMP_PORT_UNREACH, 0, pkb);
-		goto drop;
-	}
+	struct pkbuf *pkb, *next;
+
 	// check if the socket has a customized callback defined
 	struct socket* sock = sk->sock;
 	if (sock != 0 && sock->rx_cb != 0) {
-		sock->rx_cb(sock->priv, pkb);
-		free_pkb(pkb);
+		list_for_each_entry_safe(pkb, next, pkbs, pk_list) {
+			list_del(&pkb->pk_list);
+			sock->rx_cb(sock->priv, pkb);
+			free_pkb(pkb);
+		}
+		free_sock(sk);
 		return;
 	}
-	
-	/* FIFO receive queue */
+
+	/* FIFO receive queue: one lock and wakeup per batch */
 	pthread_mutex_lock(&sk->recv_wait->mutex);
 	int notify = 0;
 	if (list_empty(&sk->recv_queue))
 		notify = 1;
-	list_add_tail(&pkb->pk_list, &sk->recv_queue);
+	list_splice_tail_init(pkbs, &sk->recv_queue);
 	//sk->ops->recv_notify(sk);
 	if (notify)
 		pthread_cond_broadcast(&sk->recv_wait->cond);
 	pthread_mutex_unlock(&sk->recv_wait->mutex);
 	/* We have handled the input packet with sock, so release it */
 	free_sock(sk);
-	return;
-drop:
-	free_pkb(pkb);
 }
 
-void udp_in(struct pkbuf *pkb)
+static int udp_in_check(struct pkbuf *pkb)
 {
 	struct ip *iphdr = pkb2ip(pkb);
 	struct udp *udphdr = ip2udp(iphdr);
@@ -48,15 +46,16 @@ void udp_in(struct pkbuf *pkb)
 
 	if (udplen < UDP_HRD_SZ || udplen < _ntohs(udphdr->length)) {
 		udpdbg("udp length is too small");
-		goto drop_pkb;
+		return -1;
 	}
 	/* Maybe ip data has pad bytes. */
 	if (udplen > _ntohs(udphdr->length))
 		udplen = _ntohs(udphdr->length);
-	if (udphdr->checksum && udp_chksum(iphdr->ip_src, iphdr->ip_dst,
+	if (udphdr->checksum && pkb->pk_csum != PKB_CSUM_UNNECESSARY &&
+		udp_chksum(iphdr->ip_src, iphdr->ip_dst,
 				udplen, (unsigned short *)udphdr) != 0) {
 		udpdbg("udp packet checksum corrupts");
-		goto drop_pkb;
+		return -1;
 	}
 	/*
 	 * Should we check source ip address?
@@ -66,8 +65,48 @@ void udp_in(struct pkbuf *pkb)
 	udpdbg("from "IPFMT":%d" " to " IPFMT ":%d",
 			ipfmt(iphdr->ip_src), _ntohs(udphdr->src),
 			ipfmt(iphdr->ip_dst), _ntohs(udphdr->dst));
-	udp_recv(pkb, iphdr, udphdr);
-	return;
-drop_pkb:
-	free_pkb(pkb);
+	return 0;
+}
+
+/*
+ * Handle a list of udp packets: consecutive packets to the same port
+ * share one sock lookup and are queued to it at once.
+ */
+void udp_in_list(struct list_head *list)
+{
+	struct pkbuf *pkb, *next;
+	struct sock *sk = NULL;
+	unsigned short port = 0;
+	LIST_HEAD(pkbs);
+
+	list_for_each_entry_safe(pkb, next, list, pk_list) {
+		list_del(&pkb->pk_list);
+		if (udp_in_check(pkb) < 0) {
+			free_pkb(pkb);
+			continue;
+		}
+		if (!sk || ip2udp(pkb2ip(pkb))->dst != port) {
+			if (sk)
+				udp_recv(sk, &pkbs);
+			port = ip2udp(pkb2ip(pkb))->dst;
+			sk = udp_lookup_sock(port);
+			if (!sk) {
+				icmp_send(ICMP_T_DESTUNREACH, ICMP_PORT_UNREACH,
+								0, pkb);
+				free_pkb(pkb);
+				continue;
+			}
+		}
+		list_add_tail(&pkb->pk_list, &pkbs);
+	}
+	if (sk)
+		udp_recv(sk, &pkbs);
+}
+
+void udp_in(struct pkbuf *pkb)
+{
+	LIST_HEAD(list);
+
+	list_add_tail(&pkb->pk_list, &list);
+	udp_in_list(&list);
 }
@@ -201,45 +201,53 @@ static int udp_hash(struct sock *sk)
 
 static int udp_send_pkb(struct sock *sk, struct pkbuf *pkb)
 {
+	/* pkb may be freed after sent out */
+	int len = pkb->pk_len - IP_HRD_SZ - UDP_HRD_SZ;
 	ip_send_out(pkb);
-	return pkb->pk_len - ETH_HRD_SZ - IP_HRD_SZ - UDP_HRD_SZ;
+	return len;
 }
 
-static int udp_init_pkb(struct sock *sk, struct pkbuf *pkb,
+/* @rt: route to skaddr->dst_addr, which @pkb was allocated for */
+static void udp_init_pkb(struct sock *sk, struct pkbuf *pkb, struct rtentry *rt,
 		void *buf, int size, struct sock_addr *skaddr)
 {
-	struct ip *iphdr = pkb2ip(pkb);
-	struct udp *udphdr = (struct udp *)iphdr->ip_data;
+	struct ip *iphdr;
+	struct udp *udphdr;
+	/* data, udp head and ip head are prepended in turn */
+	memcpy(pkb_put(pkb, size), buf, size);
+	udphdr = (struct udp *)pkb_push(pkb, UDP_HRD_SZ);
+	iphdr = pkb_push_ip(pkb);
 	/* fill ip head */
 	iphdr->ip_hlen = IP_HRD_SZ >> 2;
 	iphdr->ip_ver = IP_VERSION_4;
 	iphdr->ip_tos = 0;
-	iphdr->ip_len = _htons(pkb->pk_len - ETH_HRD_SZ);
+	iphdr->ip_len = _htons(pkb->pk_len);
 	iphdr->ip_id = _htons(udp_id);
 	iphdr->ip_fragoff = 0;
 	iphdr->ip_ttl = UDP_DEFAULT_TTL;
 	iphdr->ip_pro = sk->protocol;	/* IP_P_UDP */
 	iphdr->ip_dst = skaddr->dst_addr;
-	/* FIXME:use the sk->rt_dst */
-	if (rt_output(pkb) < 0)		/* fill ip src */
-		return -1;
+	iphdr->ip_src = rt->rt_dev->net_ipaddr;
+	pkb->pk_rtdst = rt;
 	/* fill udp */
 	udphdr->src = sk->sk_sport;	/* bound local address */
 	udphdr->dst = skaddr->dst_port;
 	udphdr->length = _htons(size + UDP_HRD_SZ);
-	memcpy(udphdr->data, buf, size);
 	udpdbg(IPFMT":%d" "->" IPFMT":%d(proto %d)",
 			ipfmt(iphdr->ip_src), _ntohs(udphdr->src),
 			ipfmt(iphdr->ip_dst), _ntohs(udphdr->dst),
 			iphdr->ip_pro);
-	udp_set_checksum(iphdr, udphdr);
-	return 0;
+	if (pkb->pk_rtdst->rt_dev->net_features & NETIF_F_TX_L4_CSUM)
+		pkb->pk_csum = PKB_CSUM_PARTIAL;
+	else
+		udp_set_checksum(iphdr, udphdr);
 }
 
 static int udp_send_buf(struct sock *sk, void *buf, int size,
 				struct sock_addr *skaddr)
 {
 	struct sock_addr sk_addr;
+	struct rtentry *rt;
 	struct pkbuf *pkb;
 
 	/* destination address check */
@@ -256,12 +264,12 @@ static int udp_send_buf(struct sock *sk, void *buf, int size,
 		return -1;
 	if (!sk->sk_sport && sock_autobind(sk) < 0)
 		return -1;
-	/* udp packet send */
-	pkb = alloc_pkb(ETH_HRD_SZ + IP_HRD_SZ + UDP_HRD_SZ + size);
-	if (udp_init_pkb(sk, pkb, buf, size, &sk_addr) < 0) {
-		free_pkb(pkb);
+	/* udp packet send: build it in tx buffer of the output device */
+	rt = dst_route(sk_addr.dst_addr);
+	if (!rt)
 		return -1;
-	}
+	pkb = netdev_alloc_pkb(rt->rt_dev, UDP_HRD_SZ + size);
+	udp_init_pkb(sk, pkb, rt, buf, size, &sk_addr);
 	if (sk->ops->send_pkb)
 		return sk->ops->send_pkb(sk, pkb);
 	else